@@ -10,7 +10,16 @@
 #include <print>
 #include <Errors.h>
 #include <Runtime.h>
+#include <Compiler.h>
+#include <VirtualMachine.h>
+#include <RegisterCompiler.h>
+#include <RegisterMachine.h>
+#include <Jit.h>
+#include <DictionaryValue.h>
+#include <FlatMap.h>
 #include <conio.h>
+#include <chrono>
+#include <unordered_map>
 
 const char* TokenTypeToString(Logo2::TokenType type) {
 	switch (type) {
@@ -22,21 +31,404 @@ const char* TokenTypeToString(Logo2::TokenType type) {
 	return "";
 }
 
+enum class Engine {
+	Tree,
+	Stack,
+	Register,
+	Jit,		// tree interpreter tiering hot code up to native code
+};
+
+struct Options {
+	Engine ExecEngine{ Engine::Tree };
+	bool Benchmark{ false };
+	bool Superinstructions{ true };
+	bool DictionaryBenchmark{ false };
+	bool MapBenchmark{ false };
+	bool ParseBenchmark{ false };
+	bool CheckEngines{ false };
+	size_t MemoryLimit{ 0 };		// bytes, 0 for no limit
+	const char* File{ nullptr };
+};
+
+Options ParseOptions(int argc, const char* argv[]) {
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		if (_stricmp(argv[i], "-engine") == 0 && i + 1 < argc) {
+			i++;
+			if (_stricmp(argv[i], "stack") == 0)
+				options.ExecEngine = Engine::Stack;
+			else if (_stricmp(argv[i], "register") == 0)
+				options.ExecEngine = Engine::Register;
+			else if (_stricmp(argv[i], "tree") == 0)
+				options.ExecEngine = Engine::Tree;
+			else if (_stricmp(argv[i], "jit") == 0)
+				options.ExecEngine = Engine::Jit;
+			else
+				printf("Unknown engine: %s\n", argv[i]);
+		}
+		else if (_stricmp(argv[i], "-bench") == 0)
+			options.Benchmark = true;
+		else if (_stricmp(argv[i], "-nosuper") == 0)
+			options.Superinstructions = false;
+		else if (_stricmp(argv[i], "-dictbench") == 0)
+			options.DictionaryBenchmark = true;
+		else if (_stricmp(argv[i], "-mapbench") == 0)
+			options.MapBenchmark = true;
+		else if (_stricmp(argv[i], "-parsebench") == 0)
+			options.ParseBenchmark = true;
+		else if (_stricmp(argv[i], "-check") == 0)
+			options.CheckEngines = true;
+		else if (_stricmp(argv[i], "-memlimit") == 0 && i + 1 < argc)
+			options.MemoryLimit = strtoull(argv[++i], nullptr, 10) << 20;		// in MB
+		else
+			options.File = argv[i];
+	}
+	return options;
+}
+
+Logo2::Value Execute(Options const& options, Logo2::Interpreter& inter, Logo2::VirtualMachine& vm, Logo2::RegisterMachine& rm, Logo2::LogoAstNode const* node) {
+	using namespace Logo2;
+
+	auto start = std::chrono::steady_clock::now();
+	Value result;
+	switch (options.ExecEngine) {
+		case Engine::Tree:
+		case Engine::Jit:
+			result = inter.Eval(node);
+			break;
+
+		case Engine::Stack:
+		{
+			Compiler compiler;
+			compiler.EnableSuperinstructions(options.Superinstructions);
+			auto chunk = compiler.Compile(node);
+			vm.ResetStats();
+			result = vm.Run(*chunk);
+			break;
+		}
+
+		case Engine::Register:
+		{
+			RegisterCompiler compiler;
+			auto chunk = compiler.Compile(node);
+			rm.ResetStats();
+			result = rm.Run(*chunk);
+			break;
+		}
+	}
+	if (options.Benchmark) {
+		auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		//
+		// time per executed instruction approximates the dispatch cost when comparing builds
+		// (LOGO2_SWITCH_DISPATCH) or runs with and without -nosuper
+		//
+		auto perInstruction = [&](uint64_t count) {
+			return count ? elapsed * 1e6 / count : 0.0;
+		};
+		switch (options.ExecEngine) {
+			case Engine::Tree: std::println("[tree] {:.3f} msec", elapsed); break;
+			case Engine::Stack:
+				std::println("[stack] {:.3f} msec, {} instructions, {:.2f} nsec/instruction ({} dispatch{})", elapsed, vm.InstructionCount(),
+					perInstruction(vm.InstructionCount()), VirtualMachine::DispatchKind(), options.Superinstructions ? ", superinstructions" : "");
+				break;
+			case Engine::Register:
+				std::println("[register] {:.3f} msec, {} instructions, {:.2f} nsec/instruction ({} dispatch)", elapsed, rm.InstructionCount(),
+					perInstruction(rm.InstructionCount()), VirtualMachine::DispatchKind());
+				break;
+			case Engine::Jit:
+			{
+				auto jit = inter.GetJit();
+				if (!jit) {
+					std::println("[jit] {:.3f} msec (no JIT for this platform, tree tier only)", elapsed);
+					break;
+				}
+				//
+				// the baseline is the same script on the tree tier alone, in a scratch interpreter
+				//
+				Interpreter tree;
+				Runtime scratch(tree);
+				auto treeStart = std::chrono::steady_clock::now();
+				try {
+					tree.Eval(node);
+				}
+				catch (...) {
+				}
+				auto treeElapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - treeStart).count();
+				std::println("[jit] {:.3f} msec, tree tier {:.3f} msec, speedup {:.2f}x ({} functions, {} loops compiled)", elapsed, treeElapsed,
+					elapsed > 0 ? treeElapsed / elapsed : 0.0, jit->CompiledFunctions(), jit->CompiledLoops());
+				break;
+			}
+		}
+		//
+		// compare builds with and without LOGO2_VARIANT_VALUE for the cost of the value layout
+		//
+		std::println("Value layout: {}, {} bytes", Value::Layout(), sizeof(Value));
+#ifdef LOGO2_COUNT_COPIES
+		std::println("[copies] {} values copied", std::exchange(Value::Copies, 0));
+#endif
+
+		auto& heap = inter.GetHeap().Stats();
+		std::println("[gc] {} collections ({} full), {} objects / {} bytes collected, pause total {:.3f} msec, max {:.3f} msec, {} objects live",
+			heap.Collections, heap.FullCollections, heap.ObjectsCollected, heap.BytesCollected,
+			std::chrono::duration<double, std::milli>(heap.TotalPause).count(), std::chrono::duration<double, std::milli>(heap.MaxPause).count(),
+			inter.GetHeap().ObjectCount());
+		auto memory = inter.GetHeap().Memory();
+		std::println("[memory] {} bytes used, {} peak, {} pool allocations, {} from the system allocator, {} bytes held",
+			memory.Used, memory.Peak, memory.Allocations, memory.SystemAllocations, memory.SystemBytes);
+	}
+	return result;
+}
+
+//
+// dictionary Values against std::unordered_map with the same hashing, under a mix of integer, real and string keys
+//
+void BenchmarkDictionary() {
+	using namespace Logo2;
+
+	constexpr int Count = 1 << 18;
+	std::vector<Value> keys, missing;
+	keys.reserve(Count);
+	missing.reserve(Count);
+	for (int i = 0; i < Count; i++) {
+		switch (i % 3) {
+			case 0: keys.emplace_back((long long)i * 7919); missing.emplace_back((long long)i * 7919 + 1); break;
+			case 1: keys.emplace_back(i + 0.5); missing.emplace_back(i + 0.25); break;
+			case 2: keys.emplace_back("key" + std::to_string(i)); missing.emplace_back("nokey" + std::to_string(i)); break;
+		}
+	}
+
+	auto time = [](auto&& f) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	long long found = 0;
+	DictionaryValue dictionary;
+	auto dictInsert = time([&] {
+		for (int i = 0; i < Count; i++)
+			dictionary.Set(keys[i], (long long)i);
+	});
+	auto dictLookup = time([&] {
+		for (int i = 0; i < Count; i++)
+			found += (dictionary.Find(keys[i]) != nullptr) + (dictionary.Find(missing[i]) != nullptr);
+	});
+	auto dictIterate = time([&] {
+		dictionary.ForEach([&](Value const&, Value const& value) {
+			found += value.Integer() & 1;
+		});
+	});
+
+	std::unordered_map<Value, Value, DictionaryValue::KeyHash, DictionaryValue::KeyEqual> map;
+	auto mapInsert = time([&] {
+		for (int i = 0; i < Count; i++)
+			map[keys[i]] = (long long)i;
+	});
+	auto mapLookup = time([&] {
+		for (int i = 0; i < Count; i++)
+			found += map.contains(keys[i]) + map.contains(missing[i]);
+	});
+	auto mapIterate = time([&] {
+		for (auto& [key, value] : map)
+			found += value.Integer() & 1;
+	});
+
+	std::println("{} mixed keys ({} found)", Count, found);
+	std::println("{:<20}{:>12}{:>12}{:>12}", "msec", "insert", "lookup", "iterate");
+	std::println("{:<20}{:>12.3f}{:>12.3f}{:>12.3f}", "dictionary", dictInsert, dictLookup, dictIterate);
+	std::println("{:<20}{:>12.3f}{:>12.3f}{:>12.3f}", "std::unordered_map", mapInsert, mapLookup, mapIterate);
+}
+
+//
+// name lookups in FlatMap against std::unordered_map, at the sizes of scopes and function tables,
+// half of them hits and half misses (as when a name is looked up through enclosing scopes)
+//
+void BenchmarkNameMaps() {
+	using namespace Logo2;
+
+	constexpr int Lookups = 1 << 22;
+	std::println("{:<8}{:>16}{:>16}{:>16}{:>16}", "names", "flat hit", "flat miss", "std hit", "std miss");
+	for (int size : { 4, 16, 64, 256 }) {
+		std::vector<Atom> names, missing;
+		for (int i = 0; i < size; i++) {
+			names.push_back(AtomTable::Intern("name" + std::to_string(i)));
+			missing.push_back(AtomTable::Intern("other" + std::to_string(i)));
+		}
+
+		FlatMap<Atom, Value> flat;
+		std::unordered_map<Atom, Value> map;
+		for (int i = 0; i < size; i++) {
+			flat.TryEmplace(names[i], (long long)i);
+			map.try_emplace(names[i], (long long)i);
+		}
+
+		long long found = 0;
+		auto time = [&](std::vector<Atom> const& keys, auto&& find) {
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < Lookups; i++)
+				found += find(keys[i & (size - 1)]);
+			return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / Lookups;
+		};
+		auto inFlat = [&](Atom name) { return flat.Find(name) != nullptr; };
+		auto inMap = [&](Atom name) { return map.contains(name); };
+
+		auto flatHit = time(names, inFlat), flatMiss = time(missing, inFlat);
+		auto mapHit = time(names, inMap), mapMiss = time(missing, inMap);
+		std::println("{:<8}{:>13.2f} ns{:>13.2f} ns{:>13.2f} ns{:>13.2f} ns", size, flatHit, flatMiss, mapHit, mapMiss);
+		if (found != 2LL * Lookups)
+			std::println("lookups found {} names, expected {}", found, 2LL * Lookups);
+	}
+}
+
+//
+// parse throughput on a generated script of a few MB mixing declarations, loops, calls, literals and comments
+//
+void BenchmarkParser() {
+	using namespace Logo2;
+
+	std::string script;
+	for (int i = 0; script.size() < (4 << 20); i++) {
+		script += std::format("// function {}\n", i);
+		script += std::format("fn f{}(a, b) {{\n", i);
+		script += std::format("\tvar x = a * {} + b - (a / 3) % 7;\n", i);
+		script += std::format("\tvar s = \"text {}\";\n", i);
+		script += std::format("\tvar list = [x, a, b, {}.5];\n", i);
+		script += "\trepeat 10 { x = x + 1; }\n";
+		script += "\twhile x > 0 { x = x - 2; }\n";
+		script += std::format("\tif x == 0 {{ return list[1]; }} else {{ return f{}(b, x); }}\n}}\n", i);
+	}
+
+	constexpr int Runs = 5;
+	double best = 0;
+	for (int run = 0; run < Runs; run++) {
+		//
+		// a new parser each time, as the symbols of a parse are kept for the next one
+		//
+		Tokenizer tokenizer;
+		Parser parser(tokenizer);
+		std::unique_ptr<LogoAstNode> root;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			root = parser.Parse(script);
+		}
+		catch (ParseError const& err) {
+			parser.AddError(err);
+		}
+		auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (parser.HasErrors()) {
+			std::println("parse error {} at line {}", (int)parser.Errors()[0].Error, parser.Errors()[0].ErrorToken.Line);
+			return;
+		}
+		best = std::max(best, script.size() / elapsed / (1 << 20));
+	}
+	std::println("{:.1f} MB script, best of {} parses: {:.1f} MB/s", script.size() / double(1 << 20), Runs, best);
+}
+
+//
+// runs each script on every engine, in a fresh interpreter each time, and reports the results that are not the expected one;
+// the engines run the same AST, so a script must mean the same on all of them
+//
+int CheckEngines() {
+	using namespace Logo2;
+
+	struct Check {
+		std::string Script;
+		std::string Expected;
+	};
+	std::vector<Check> checks{
+		//
+		// loop bodies get a fresh scope each time around, the init variable of a for a scope around the whole loop
+		//
+		{ "var z = 0; repeat 10 { var q = z; z = q + 1; } z;", "10" },
+		{ "var z = 0; while z < 10 { var q = z; z = q + 1; } z;", "10" },
+		{ "var z = 0; for var i = 0; i < 10; i = i + 1 { var q = z; z = q + 1; } z;", "10" },
+		{ "for var j = 0; j < 3; j = j + 1 { } var j = 7; j;", "7" },
+		{ "var s = 0; for var i = 0; i < 10; i = i + 1 { var t = i * 2; if i == 3 { continue; } if i == 8 { break; } s = s + t; } s;", "50" },
+		{ "var s = 0; repeat 10 { var t = s; if t == 3 { break; } s = t + 1; } s;", "3" },
+		{ "var s = 0; var n = 0; while n < 10 { var t = n; n = t + 1; if t % 2 == 0 { continue; } s = s + t; } s;", "25" },
+		{ "fn f() { var z = 0; repeat 10 { var q = z; z = q + 1; } for var i = 0; i < 10; i = i + 1 { var q = z; z = q + 1; } return z; } f();", "20" },
+	};
+	//
+	// a repeat loop tiers up to the JIT once it has run Jit::LoopThreshold iterations, which must not change its result
+	//
+	for (auto count : { Jit::LoopThreshold - 1, Jit::LoopThreshold + 1 }) {
+		checks.push_back({ std::format("var z = 0; repeat {} {{ var q = z; z = q + 1; }} z;", count), std::to_string(count) });
+		checks.push_back({ std::format("fn f(n) {{ var z = 0; repeat n {{ var q = z; z = q + 1; }} return z; }} f({});", count), std::to_string(count) });
+	}
+
+	auto run = [](std::string const& script, Engine engine) -> std::string {
+		Options options;
+		options.ExecEngine = engine;
+		Tokenizer tokenizer;
+		Parser parser(tokenizer);
+		Interpreter inter;
+		VirtualMachine vm(inter);
+		RegisterMachine rm(inter);
+		if (engine == Engine::Jit)
+			inter.EnableJit(true);
+		try {
+			auto code = parser.Parse(script);
+			if (parser.HasErrors())
+				return std::format("parse error {}", (int)parser.Errors()[0].Error);
+			return Execute(options, inter, vm, rm, code.get()).ToString();
+		}
+		catch (ParseError const& err) {
+			return std::format("parse error {}", (int)err.Error);
+		}
+		catch (RuntimeError const& err) {
+			return std::format("runtime error {}", (int)err.Error);
+		}
+	};
+
+	int failed = 0;
+	for (auto& check : checks) {
+		for (auto [engine, name] : { std::pair{ Engine::Tree, "tree" }, { Engine::Stack, "stack" }, { Engine::Register, "register" }, { Engine::Jit, "jit" } }) {
+			auto result = run(check.Script, engine);
+			if (result != check.Expected) {
+				std::println("[{}] {}\n\texpected {}, got {}", name, check.Script, check.Expected, result);
+				failed++;
+			}
+		}
+	}
+	std::println("{} scripts on 4 engines, {} failed", checks.size(), failed);
+	return failed ? 1 : 0;
+}
+
 int main(int argc, const char* argv[]) {
 	using namespace std;
 	using namespace Logo2;
 
+	auto options = ParseOptions(argc, argv);
+	if (options.DictionaryBenchmark) {
+		BenchmarkDictionary();
+		return 0;
+	}
+	if (options.MapBenchmark) {
+		BenchmarkNameMaps();
+		return 0;
+	}
+	if (options.ParseBenchmark) {
+		BenchmarkParser();
+		return 0;
+	}
+	if (options.CheckEngines)
+		return CheckEngines();
 	Tokenizer t;
 	Parser parser(t);
 	Interpreter inter;
+	inter.GetHeap().SetMemoryLimit(options.MemoryLimit);
+	VirtualMachine vm(inter);
+	RegisterMachine rm(inter);
 	Runtime runtime(inter);
 	runtime.Init();
+	if (options.ExecEngine == Engine::Jit)
+		inter.EnableJit(true);
 	runtime.CreateLogoWindow(L"Logo 2", 800, 800);
 
 	std::unique_ptr<LogoAstNode> code;
-	if (argc > 1) {
+	if (options.File) {
 		try {
-			code = parser.ParseFile(argv[1]);
+			code = parser.ParseFile(options.File);
 			if (parser.HasErrors()) {
 				for (auto& err : parser.Errors()) {
 					printf("Error (%d,%d): %d\n", err.ErrorToken.Line, err.ErrorToken.Col, err.Error);
@@ -44,7 +436,7 @@ int main(int argc, const char* argv[]) {
 				return 1;
 			}
 			try {
-				auto result = code->Accept(&inter);
+				auto result = Execute(options, inter, vm, rm, code.get());
 				if (result)
 					std::println("{}", result.ToString());
 			}
@@ -56,6 +448,13 @@ int main(int argc, const char* argv[]) {
 			printf("Error (%d,%d): %d\n", err.ErrorToken.Line, err.ErrorToken.Col, err.Error);
 			return 1;
 		}
+		catch (RuntimeError const& err) {
+			//
+			// the memory limit, hit while parsing
+			//
+			printf("Runtime error: %d\n", (int)err.Error);
+			return 1;
+		}
 	}
 
 	for (;;) {
@@ -101,7 +500,7 @@ int main(int argc, const char* argv[]) {
 				continue;
 			}
 			try {
-				auto result = ast->Accept(&inter);
+				auto result = Execute(options, inter, vm, rm, ast.get());
 				if (result)
 					std::println("{}", result.ToString());
 			}
@@ -116,6 +515,10 @@ int main(int argc, const char* argv[]) {
 			println("Error {} ({},{}): {}\n", (int)err.Error, err.ErrorToken.Line, err.ErrorToken.Col, err.ErrorText);
 			continue;
 		}
+		catch (RuntimeError const& err) {
+			printf("Runtime error: %d\n", (int)err.Error);
+			continue;
+		}
 
 	}
 
@@ -0,0 +1,320 @@
+#include "pch.h"
+#include "ArrayValue.h"
+#include "Heap.h"
+#include <Errors.h>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define LOGO2_SIMD_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LOGO2_AVX2
+#else
+#define LOGO2_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace Logo2;
+using namespace std;
+
+namespace {
+	//
+	// element-wise kernels: out[i] = a[i] op b[i], where a scalar operand is repeated for every element
+	// AVX2 is used when the CPU has it, SSE2 (always there on x64) otherwise, with a scalar loop for the tail
+	// there are no vector instructions for 64 bit integer multiplication and division, these stay scalar
+	//
+	struct AddOp {
+		static constexpr bool VectorIntegers = true;
+		template<typename T>
+		static T Scalar(T a, T b) { return a + b; }
+#ifdef LOGO2_SIMD_X64
+		static __m128d Sse(__m128d a, __m128d b) { return _mm_add_pd(a, b); }
+		static __m128i Sse(__m128i a, __m128i b) { return _mm_add_epi64(a, b); }
+		LOGO2_AVX2 static __m256d Avx2(__m256d a, __m256d b) { return _mm256_add_pd(a, b); }
+		LOGO2_AVX2 static __m256i Avx2(__m256i a, __m256i b) { return _mm256_add_epi64(a, b); }
+#endif
+	};
+
+	struct SubOp {
+		static constexpr bool VectorIntegers = true;
+		template<typename T>
+		static T Scalar(T a, T b) { return a - b; }
+#ifdef LOGO2_SIMD_X64
+		static __m128d Sse(__m128d a, __m128d b) { return _mm_sub_pd(a, b); }
+		static __m128i Sse(__m128i a, __m128i b) { return _mm_sub_epi64(a, b); }
+		LOGO2_AVX2 static __m256d Avx2(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); }
+		LOGO2_AVX2 static __m256i Avx2(__m256i a, __m256i b) { return _mm256_sub_epi64(a, b); }
+#endif
+	};
+
+	struct MulOp {
+		static constexpr bool VectorIntegers = false;
+		template<typename T>
+		static T Scalar(T a, T b) { return a * b; }
+#ifdef LOGO2_SIMD_X64
+		static __m128d Sse(__m128d a, __m128d b) { return _mm_mul_pd(a, b); }
+		LOGO2_AVX2 static __m256d Avx2(__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+#endif
+	};
+
+	struct DivOp {
+		static constexpr bool VectorIntegers = false;
+		template<typename T>
+		static T Scalar(T a, T b) { return a / b; }
+#ifdef LOGO2_SIMD_X64
+		static __m128d Sse(__m128d a, __m128d b) { return _mm_div_pd(a, b); }
+		LOGO2_AVX2 static __m256d Avx2(__m256d a, __m256d b) { return _mm256_div_pd(a, b); }
+#endif
+	};
+
+	template<typename Op, typename T>
+	void ScalarLoop(T const* a, bool aScalar, T const* b, bool bScalar, T* out, size_t i, size_t n) {
+		for (; i < n; i++)
+			out[i] = Op::Scalar(aScalar ? *a : a[i], bScalar ? *b : b[i]);
+	}
+
+#ifdef LOGO2_SIMD_X64
+	bool HasAvx2() {
+		static bool const avx2 = [] {
+#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] < 7)
+				return false;
+			__cpuid(info, 1);
+			constexpr int osxsave = 1 << 27, avx = 1 << 28;
+			if ((info[2] & (osxsave | avx)) != (osxsave | avx) || (_xgetbv(0) & 6) != 6)
+				return false;
+			__cpuidex(info, 7, 0);
+			return (info[1] & (1 << 5)) != 0;
+#else
+			return __builtin_cpu_supports("avx2") != 0;
+#endif
+		}();
+		return avx2;
+	}
+
+	__m128d Load128(double const* p) { return _mm_loadu_pd(p); }
+	__m128i Load128(long long const* p) { return _mm_loadu_si128(reinterpret_cast<__m128i const*>(p)); }
+	__m128d Broadcast128(double v) { return _mm_set1_pd(v); }
+	__m128i Broadcast128(long long v) { return _mm_set1_epi64x(v); }
+	void Store128(double* p, __m128d v) { _mm_storeu_pd(p, v); }
+	void Store128(long long* p, __m128i v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+
+	LOGO2_AVX2 __m256d Load256(double const* p) { return _mm256_loadu_pd(p); }
+	LOGO2_AVX2 __m256i Load256(long long const* p) { return _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p)); }
+	LOGO2_AVX2 __m256d Broadcast256(double v) { return _mm256_set1_pd(v); }
+	LOGO2_AVX2 __m256i Broadcast256(long long v) { return _mm256_set1_epi64x(v); }
+	LOGO2_AVX2 void Store256(double* p, __m256d v) { _mm256_storeu_pd(p, v); }
+	LOGO2_AVX2 void Store256(long long* p, __m256i v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+
+	template<typename Op, typename T>
+	void Sse2Loop(T const* a, bool aScalar, T const* b, bool bScalar, T* out, size_t n) {
+		constexpr size_t lanes = 16 / sizeof(T);
+		size_t i = 0;
+		for (; i + lanes <= n; i += lanes) {
+			auto x = aScalar ? Broadcast128(*a) : Load128(a + i);
+			auto y = bScalar ? Broadcast128(*b) : Load128(b + i);
+			Store128(out + i, Op::Sse(x, y));
+		}
+		ScalarLoop<Op>(a, aScalar, b, bScalar, out, i, n);
+	}
+
+	template<typename Op, typename T>
+	LOGO2_AVX2 void Avx2Loop(T const* a, bool aScalar, T const* b, bool bScalar, T* out, size_t n) {
+		constexpr size_t lanes = 32 / sizeof(T);
+		size_t i = 0;
+		for (; i + lanes <= n; i += lanes) {
+			auto x = aScalar ? Broadcast256(*a) : Load256(a + i);
+			auto y = bScalar ? Broadcast256(*b) : Load256(b + i);
+			Store256(out + i, Op::Avx2(x, y));
+		}
+		ScalarLoop<Op>(a, aScalar, b, bScalar, out, i, n);
+	}
+#endif
+
+	template<typename Op, typename T>
+	void Kernel(T const* a, bool aScalar, T const* b, bool bScalar, T* out, size_t n) {
+#ifdef LOGO2_SIMD_X64
+		if constexpr (is_same_v<T, double> || Op::VectorIntegers) {
+			if (HasAvx2())
+				Avx2Loop<Op>(a, aScalar, b, bScalar, out, n);
+			else
+				Sse2Loop<Op>(a, aScalar, b, bScalar, out, n);
+			return;
+		}
+#endif
+		ScalarLoop<Op>(a, aScalar, b, bScalar, out, 0, n);
+	}
+
+	template<typename T>
+	pmr::vector<T> Run(ArrayValue::Operation op, T const* a, bool aScalar, T const* b, bool bScalar, size_t n) {
+		if (op == ArrayValue::Operation::Div) {
+			//
+			// same rule as the scalar operator: any zero divisor is an error
+			//
+			if (bScalar ? *b == 0 : any_of(b, b + n, [](T x) { return x == 0; }))
+				throw RuntimeError(ErrorType::DivisionByZero);
+		}
+
+		pmr::vector<T> out(n, Heap::CurrentResource());
+		switch (op) {
+			case ArrayValue::Operation::Add: Kernel<AddOp>(a, aScalar, b, bScalar, out.data(), n); break;
+			case ArrayValue::Operation::Sub: Kernel<SubOp>(a, aScalar, b, bScalar, out.data(), n); break;
+			case ArrayValue::Operation::Mul: Kernel<MulOp>(a, aScalar, b, bScalar, out.data(), n); break;
+			case ArrayValue::Operation::Div: Kernel<DivOp>(a, aScalar, b, bScalar, out.data(), n); break;
+		}
+		return out;
+	}
+
+	Value ApplyScalar(ArrayValue::Operation op, Value const& a, Value const& b) {
+		switch (op) {
+			case ArrayValue::Operation::Add: return a + b;
+			case ArrayValue::Operation::Sub: return a - b;
+			case ArrayValue::Operation::Mul: return a * b;
+			case ArrayValue::Operation::Div: return a / b;
+		}
+		return Value();
+	}
+}
+
+ArrayValue::ArrayValue(vector<Value> values) : HeapObject(Value::TypeArray) {
+	auto resource = Heap::CurrentResource();
+	if (all_of(values.begin(), values.end(), [](auto& v) { return v.IsInteger(); })) {
+		pmr::vector<long long> integers(values.size(), resource);
+		transform(values.begin(), values.end(), integers.begin(), [](auto& v) { return v.Integer(); });
+		m_Elements = move(integers);
+	}
+	else if (all_of(values.begin(), values.end(), [](auto& v) { return v.IsReal(); })) {
+		pmr::vector<double> reals(values.size(), resource);
+		transform(values.begin(), values.end(), reals.begin(), [](auto& v) { return v.Real(); });
+		m_Elements = move(reals);
+	}
+	else
+		m_Elements = pmr::vector<Value>(make_move_iterator(values.begin()), make_move_iterator(values.end()), resource);
+}
+
+ArrayValue::ArrayValue(pmr::vector<long long> integers) : HeapObject(Value::TypeArray), m_Elements(move(integers)) {
+}
+
+ArrayValue::ArrayValue(pmr::vector<double> reals) : HeapObject(Value::TypeArray), m_Elements(move(reals)) {
+}
+
+void ArrayValue::Clear() {
+	m_Elements = pmr::vector<long long>();
+}
+
+size_t ArrayValue::ByteSize() const {
+	return sizeof(*this) + visit([](auto& elements) { return elements.capacity() * sizeof(elements[0]); }, m_Elements);
+}
+
+ArrayValue::ElementType ArrayValue::Type() const {
+	return ElementType(m_Elements.index());
+}
+
+size_t ArrayValue::Size() const {
+	return visit([](auto& elements) { return elements.size(); }, m_Elements);
+}
+
+size_t ArrayValue::CheckIndex(long long index) const {
+	if (index < 0 || index >= (long long)Size())
+		throw RuntimeError(ErrorType::IndexOutOfRange, nullptr, to_string(index));
+	return (size_t)index;
+}
+
+Value ArrayValue::Get(long long index) const {
+	auto i = CheckIndex(index);
+	switch (Type()) {
+		case ElementType::Integer: return get<0>(m_Elements)[i];
+		case ElementType::Real: return get<1>(m_Elements)[i];
+		case ElementType::Generic: break;
+	}
+	return get<2>(m_Elements)[i];
+}
+
+void ArrayValue::Set(long long index, Value value) {
+	auto i = CheckIndex(index);
+	if (Type() == ElementType::Integer && value.IsInteger())
+		get<0>(m_Elements)[i] = value.Integer();
+	else if (Type() == ElementType::Real && value.IsReal())
+		get<1>(m_Elements)[i] = value.Real();
+	else {
+		Widen();
+		get<2>(m_Elements)[i] = move(value);
+	}
+}
+
+void ArrayValue::Widen() {
+	if (Type() == ElementType::Generic)
+		return;
+
+	pmr::vector<Value> values(visit([](auto& elements) { return elements.get_allocator().resource(); }, m_Elements));
+	values.reserve(Size());
+	visit([&](auto& elements) {
+		for (auto& e : elements)
+			values.emplace_back(e);
+		}, m_Elements);
+	m_Elements = move(values);
+}
+
+string ArrayValue::ToString() const {
+	string text = "[";
+	for (size_t i = 0; i < Size(); i++) {
+		if (i > 0)
+			text += ", ";
+		text += Get(i).ToString();
+	}
+	return text + "]";
+}
+
+Value ArrayValue::Apply(Operation op, Value const& left, Value const& right) {
+	auto a = left.IsArray() ? left.Array() : nullptr;
+	auto b = right.IsArray() ? right.Array() : nullptr;
+	assert(a || b);
+	if (a && b && a->Size() != b->Size())
+		throw RuntimeError(ErrorType::TypeMismatch, nullptr, "array sizes differ");
+	auto n = a ? a->Size() : b->Size();
+
+	auto typeOf = [](ArrayValue const* array, Value const& scalar) {
+		if (array)
+			return array->Type();
+		return scalar.IsInteger() ? ElementType::Integer : scalar.IsReal() ? ElementType::Real : ElementType::Generic;
+	};
+	auto ta = typeOf(a, left), tb = typeOf(b, right);
+
+	if (ta == ElementType::Integer && tb == ElementType::Integer) {
+		long long sa = a ? 0 : left.Integer(), sb = b ? 0 : right.Integer();
+		auto pa = a ? get<0>(a->m_Elements).data() : &sa;
+		auto pb = b ? get<0>(b->m_Elements).data() : &sb;
+		return Value(MakeRef<ArrayValue>(Run(op, pa, !a, pb, !b, n)));
+	}
+
+	if (ta != ElementType::Generic && tb != ElementType::Generic) {
+		//
+		// integers meet reals: the integer operand is converted first
+		//
+		auto reals = [](ArrayValue const* array, Value const& scalar, double& single, vector<double>& converted) -> double const* {
+			if (!array) {
+				single = scalar.ToDouble();
+				return &single;
+			}
+			if (array->Type() == ElementType::Real)
+				return get<1>(array->m_Elements).data();
+			auto& integers = get<0>(array->m_Elements);
+			converted.assign(integers.begin(), integers.end());
+			return converted.data();
+		};
+		double sa, sb;
+		vector<double> ca, cb;
+		auto pa = reals(a, left, sa, ca);
+		auto pb = reals(b, right, sb, cb);
+		return Value(MakeRef<ArrayValue>(Run(op, pa, !a, pb, !b, n)));
+	}
+
+	vector<Value> out;
+	out.reserve(n);
+	for (size_t i = 0; i < n; i++)
+		out.push_back(ApplyScalar(op, a ? a->Get(i) : left, b ? b->Get(i) : right));
+	return Value(MakeRef<ArrayValue>(move(out)));
+}
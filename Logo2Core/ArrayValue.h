@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Value.h"
+
+namespace Logo2 {
+	//
+	// array held by array Values (by reference): integers and reals are kept unboxed in contiguous storage,
+	// any other mix of elements in a vector of Values; storing an element of another type widens the storage to Values
+	// the elements are allocated from the pools of the heap current when the array is made
+	//
+	class ArrayValue : public HeapObject {
+	public:
+		enum class ElementType {
+			Integer,
+			Real,
+			Generic,
+		};
+
+		enum class Operation {
+			Add,
+			Sub,
+			Mul,
+			Div,
+		};
+
+		explicit ArrayValue(std::vector<Value> values);
+		explicit ArrayValue(std::pmr::vector<long long> integers);
+		explicit ArrayValue(std::pmr::vector<double> reals);
+
+		ElementType Type() const;
+		size_t Size() const;
+		Value Get(long long index) const;
+		void Set(long long index, Value value);
+		std::string ToString() const;
+
+		//
+		// element-wise arithmetic of two arrays of the same size, or of an array and a scalar (on either side)
+		// integer and real arrays run vectorized kernels where the CPU supports them
+		//
+		static Value Apply(Operation op, Value const& left, Value const& right);
+
+		//
+		// the elements held as values (only by a generic array), and dropping them all, for the heap
+		//
+		template<typename F>
+		void ForEachValue(F&& f) const {
+			if (auto values = std::get_if<std::pmr::vector<Value>>(&m_Elements))
+				for (auto& value : *values)
+					f(value);
+		}
+		void Clear();
+		size_t ByteSize() const;
+
+	private:
+		size_t CheckIndex(long long index) const;
+		void Widen();
+
+		std::variant<std::pmr::vector<long long>, std::pmr::vector<double>, std::pmr::vector<Value>> m_Elements;
+	};
+}
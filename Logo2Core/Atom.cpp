@@ -0,0 +1,56 @@
+#include "pch.h"
+#include "Atom.h"
+#include "FlatMap.h"
+#include <deque>
+#include <mutex>
+
+using namespace Logo2;
+
+namespace {
+	//
+	// names are stored in a deque so the views used as keys stay valid as the table grows
+	//
+	struct Atoms {
+		std::mutex Lock;
+		std::deque<std::string> Names{ 1 };
+		FlatMap<std::string_view, Atom> Index;
+	};
+
+	Atoms& Table() {
+		static Atoms atoms;
+		return atoms;
+	}
+}
+
+Atom AtomTable::Intern(std::string_view name) {
+	return Intern(name, std::hash<std::string_view>{}(name));
+}
+
+Atom AtomTable::Intern(std::string_view name, size_t hash) {
+	if (name.empty())
+		return Atom::None;
+
+	auto& table = Table();
+	std::lock_guard lock(table.Lock);
+	if (auto atom = table.Index.Find(name, hash))
+		return *atom;
+
+	auto atom = Atom(table.Names.size());
+	auto& stored = table.Names.emplace_back(name);
+	table.Index.TryEmplaceHashed(std::string_view(stored), hash, atom);
+	return atom;
+}
+
+Atom AtomTable::Find(std::string_view name) {
+	auto& table = Table();
+	std::lock_guard lock(table.Lock);
+	auto atom = table.Index.Find(name);
+	return atom ? *atom : Atom::None;
+}
+
+std::string const& AtomTable::Name(Atom atom) {
+	auto& table = Table();
+	std::lock_guard lock(table.Lock);
+	assert((size_t)atom < table.Names.size());
+	return table.Names[(size_t)atom];
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string_view>
+
+namespace Logo2 {
+	//
+	// an interned identifier: equal names map to the same atom, so names compare and hash as integers
+	// atoms are never released; Atom::None stands for the empty name
+	//
+	enum class Atom : uint32_t {
+		None = 0,
+	};
+
+	class AtomTable {
+	public:
+		static Atom Intern(std::string_view name);
+		//
+		// with the std::hash<std::string_view> of name, when the caller already has it
+		//
+		static Atom Intern(std::string_view name, size_t hash);
+		//
+		// Atom::None if the name was never interned (so nothing can be bound to it)
+		//
+		static Atom Find(std::string_view name);
+		static std::string const& Name(Atom atom);
+	};
+}
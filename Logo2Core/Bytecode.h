@@ -0,0 +1,99 @@
+#pragma once
+
+#include "Value.h"
+#include "Logo2Ast.h"
+
+namespace Logo2 {
+	class Expression;
+
+	enum class OpCode : uint8_t {
+		Nop,
+		LoadConst,
+		LoadNull,
+		LoadTrue,
+		LoadFalse,
+		Pop,
+
+		LoadName,
+		StoreName,
+		DefineVar,
+		LoadLocal,
+		StoreLocal,
+		DefineLocal,
+		LoadUpvalue,
+		StoreUpvalue,
+
+		Add,
+		Sub,
+		Mul,
+		Div,
+		Mod,
+		Power,
+		And,
+		Or,
+		Xor,
+		Equal,
+		NotEqual,
+		Less,
+		LessEqual,
+		Greater,
+		GreaterEqual,
+		Neg,
+		Not,
+
+		Jump,
+		JumpIfFalse,
+		RepeatInit,
+		RepeatNext,
+
+		PushScope,
+		PopScope,
+
+		Call,
+		CallValue,
+		TailCall,			// Call (or CallValue if Operand < 0) in tail position, runs in the returning frame
+		Return,
+		DefineFunction,
+		MakeClosure,
+
+		MakeArray,			// pops Count elements
+		MakeDictionary,		// pops Count key, value pairs
+		LoadIndex,			// container, index -> element
+		StoreIndex,			// container, index, value -> value
+		LoadField,			// object -> object.S[Operand]
+		StoreField,			// object, value -> value, object.S[Operand] = value
+
+		//
+		// superinstructions, produced by the compiler's peephole pass
+		//
+		AddLocalConst,		// push L[Count] + K[Operand]
+		SubLocalConst,		// push L[Count] - K[Operand]
+		CallWithLocal,		// push N[Operand](L[Count])
+		CallWithConst,		// push N[Operand](K[Count])
+
+		Count				// number of opcodes
+	};
+
+	struct Instruction {
+		OpCode Code;
+		uint16_t Count;		// argument count or variable flags
+		int Operand;		// constant, name, slot, function index or jump target
+	};
+	static_assert(sizeof(Instruction) == 8);
+
+	struct CodeChunk {
+		Atom Name{ Atom::None };
+		std::vector<Atom> Parameters;
+		Expression const* Body{ nullptr };
+		int FrameSize{ 0 };
+		std::vector<Capture> Captures;
+
+		std::vector<Instruction> Code;
+		std::vector<LogoAstNode const*> Nodes;		// the node each instruction comes from, parallel to Code
+		std::vector<Value> Constants;
+		std::vector<Atom> Names;
+		mutable std::vector<CallCache> Callees;		// inline caches for calls by name, parallel to Names
+		mutable std::vector<FieldSite> FieldSites;	// one per field access
+		std::vector<std::shared_ptr<CodeChunk>> Functions;
+	};
+}
@@ -0,0 +1,514 @@
+#include "pch.h"
+#include "Compiler.h"
+#include "Logo2Ast.h"
+#include <Errors.h>
+
+using namespace Logo2;
+using namespace std;
+
+shared_ptr<CodeChunk> Compiler::Compile(LogoAstNode const* root) {
+	auto chunk = Begin(true);
+	CompileNode(root);
+	End(*chunk);
+	return chunk;
+}
+
+shared_ptr<CodeChunk> Compiler::CompileBody(Expression const* body, int frameSize) {
+	auto chunk = Begin(false);
+	chunk->Body = body;
+	chunk->FrameSize = frameSize;
+	CompileNode(body);
+	End(*chunk);
+	return chunk;
+}
+
+shared_ptr<CodeChunk> Compiler::CompileLoop(RepeatStatement const* loop, bool topLevel) {
+	//
+	// the final Return is marked (Count = 1) so running off the end of the loop
+	// can be told apart from a return statement in its body
+	//
+	auto chunk = Begin(topLevel);
+	CompileRepeatLoop(loop);
+	End(*chunk, 1);
+	return chunk;
+}
+
+shared_ptr<CodeChunk> Compiler::Begin(bool topLevel) {
+	auto chunk = make_shared<CodeChunk>();
+	m_Chunk = chunk.get();
+	m_Loops.clear();
+	m_ScopeDepth = 0;
+	m_TopLevel = topLevel;
+	return chunk;
+}
+
+void Compiler::End(CodeChunk& chunk, int completed) {
+	Emit(OpCode::Return, 0, (uint16_t)completed);
+	Fuse(chunk);
+	m_Chunk = nullptr;
+}
+
+void Compiler::EnableSuperinstructions(bool enable) {
+	m_Superinstructions = enable;
+}
+
+Value Compiler::VisitLiteral(LiteralExpression const* expr) {
+	auto& lit = expr->Literal();
+	switch (lit.Type) {
+		case TokenType::Integer: Emit(OpCode::LoadConst, AddConstant(get<0>(lit.Value))); break;
+		case TokenType::Real: Emit(OpCode::LoadConst, AddConstant(get<1>(lit.Value))); break;
+		case TokenType::String: Emit(OpCode::LoadConst, AddConstant(lit.Lexeme)); break;
+		case TokenType::Keyword_True: Emit(OpCode::LoadTrue); break;
+		case TokenType::Keyword_False: Emit(OpCode::LoadFalse); break;
+		default: Emit(OpCode::LoadNull); break;
+	}
+	return {};
+}
+
+Value Compiler::VisitBinary(BinaryExpression const* expr) {
+	OpCode code;
+	switch (expr->Operator().Type) {
+		case TokenType::Add: code = OpCode::Add; break;
+		case TokenType::Sub: code = OpCode::Sub; break;
+		case TokenType::Mul: code = OpCode::Mul; break;
+		case TokenType::Div: code = OpCode::Div; break;
+		case TokenType::Power: code = OpCode::Power; break;
+		case TokenType::Mod: code = OpCode::Mod; break;
+		case TokenType::And: code = OpCode::And; break;
+		case TokenType::Or: code = OpCode::Or; break;
+		case TokenType::Xor: code = OpCode::Xor; break;
+		case TokenType::Equal: code = OpCode::Equal; break;
+		case TokenType::NotEqual: code = OpCode::NotEqual; break;
+		case TokenType::LessThan: code = OpCode::Less; break;
+		case TokenType::LessThanOrEqual: code = OpCode::LessEqual; break;
+		case TokenType::GreaterThan: code = OpCode::Greater; break;
+		case TokenType::GreaterThanOrEqual: code = OpCode::GreaterEqual; break;
+		default:
+			Emit(OpCode::LoadNull);
+			return {};
+	}
+	CompileNode(expr->Left());
+	CompileNode(expr->Right());
+	Emit(code);
+	return {};
+}
+
+Value Compiler::VisitUnary(UnaryExpression const* expr) {
+	CompileNode(expr->Arg());
+	switch (expr->Operator().Type) {
+		case TokenType::Sub: Emit(OpCode::Neg); break;
+		case TokenType::Add: break;
+		case TokenType::Not: Emit(OpCode::Not); break;
+		default: throw RuntimeError(ErrorType::UndefinedOperator, expr->Arg());
+	}
+	return {};
+}
+
+Value Compiler::VisitName(NameExpression const* expr) {
+	if (auto& slot = expr->Slot(); slot.IsResolved())
+		Emit(slot.IsUpvalue ? OpCode::LoadUpvalue : OpCode::LoadLocal, slot.Index);
+	else
+		Emit(OpCode::LoadName, AddName(expr->Id()));
+	return {};
+}
+
+Value Compiler::VisitBlock(BlockExpression const* expr) {
+	auto& stmts = expr->Expressions();
+	if (stmts.empty()) {
+		Emit(OpCode::LoadNull);
+		return {};
+	}
+	for (size_t i = 0; i < stmts.size(); i++) {
+		if (i > 0)
+			Emit(OpCode::Pop);
+		CompileNode(stmts[i].get());
+	}
+	return {};
+}
+
+Value Compiler::VisitVar(VarStatement const* expr) {
+	if (expr->Init())
+		CompileNode(expr->Init());
+	else
+		Emit(OpCode::LoadNull);
+	if (expr->Slot() >= 0)
+		Emit(OpCode::DefineLocal, expr->Slot());
+	else
+		Emit(OpCode::DefineVar, AddName(expr->Id()), expr->IsConst() ? 1 : 0);
+	Emit(OpCode::LoadNull);
+	return {};
+}
+
+Value Compiler::VisitAssign(AssignExpression const* expr) {
+	CompileNode(expr->Value());
+	if (auto& slot = expr->Slot(); slot.IsResolved())
+		Emit(slot.IsUpvalue ? OpCode::StoreUpvalue : OpCode::StoreLocal, slot.Index);
+	else
+		Emit(OpCode::StoreName, AddName(expr->Id()));
+	return {};
+}
+
+Value Compiler::VisitPostfix(PostfixExpression const*) {
+	Emit(OpCode::LoadNull);
+	return {};
+}
+
+Value Compiler::VisitInvokeFunction(InvokeFunctionExpression const* expr) {
+	//
+	// a callee held in a local is pushed below its arguments
+	//
+	auto& slot = expr->Slot();
+	if (slot.IsResolved())
+		Emit(slot.IsUpvalue ? OpCode::LoadUpvalue : OpCode::LoadLocal, slot.Index);
+	for (auto& arg : expr->Arguments())
+		CompileNode(arg.get());
+	if (expr->IsTailCall())
+		Emit(OpCode::TailCall, slot.IsResolved() ? -1 : AddName(expr->Id()), (uint16_t)expr->Arguments().size());
+	else if (slot.IsResolved())
+		Emit(OpCode::CallValue, 0, (uint16_t)expr->Arguments().size());
+	else
+		Emit(OpCode::Call, AddName(expr->Id()), (uint16_t)expr->Arguments().size());
+	return {};
+}
+
+Value Compiler::VisitRepeat(RepeatStatement const* expr) {
+	//
+	// the remaining count lives on the stack for the duration of the loop
+	//
+	CompileNode(expr->Count());
+	auto repeat = exchange(m_Node, expr->Count());		// a count that is not an integer is reported at the count
+	Emit(OpCode::RepeatInit);
+	m_Node = repeat;
+	CompileRepeatLoop(expr);
+	return {};
+}
+
+void Compiler::CompileRepeatLoop(RepeatStatement const* expr) {
+	auto start = Here();
+	auto next = Emit(OpCode::RepeatNext);
+	m_Loops.push_back({ m_ScopeDepth });
+	CompileScoped(expr->Block());
+	Emit(OpCode::Pop);
+	Emit(OpCode::Jump, start);
+	auto loop = move(m_Loops.back());
+	m_Loops.pop_back();
+
+	PatchJumps(loop.Continues, start);
+	PatchJumps({ next }, Here());
+	PatchJumps(loop.Breaks, Here());
+	Emit(OpCode::Pop);		// remaining count
+	Emit(OpCode::LoadNull);
+}
+
+Value Compiler::VisitWhile(WhileStatement const* stmt) {
+	auto start = Here();
+	CompileNode(stmt->Condition());
+	auto exit = Emit(OpCode::JumpIfFalse);
+	m_Loops.push_back({ m_ScopeDepth });
+	CompileScoped(stmt->Body());
+	Emit(OpCode::Pop);
+	Emit(OpCode::Jump, start);
+	auto loop = move(m_Loops.back());
+	m_Loops.pop_back();
+
+	PatchJumps(loop.Continues, start);
+	PatchJumps({ exit }, Here());
+	PatchJumps(loop.Breaks, Here());
+	Emit(OpCode::LoadNull);
+	return {};
+}
+
+Value Compiler::VisitIfThenElse(IfThenElseExpression const* expr) {
+	CompileNode(expr->Condition());
+	auto elseJump = Emit(OpCode::JumpIfFalse);
+	CompileScoped(expr->Then());
+	auto endJump = Emit(OpCode::Jump);
+	PatchJumps({ elseJump }, Here());
+	if (expr->Else())
+		CompileScoped(expr->Else());
+	else
+		Emit(OpCode::LoadNull);
+	PatchJumps({ endJump }, Here());
+	return {};
+}
+
+Value Compiler::VisitFunctionDeclaration(FunctionDeclaration const* decl) {
+	Emit(OpCode::DefineFunction, CompileFunction(decl->Id(), decl->Parameters(), decl->Body(), decl->FrameSize(), decl->Captures()));
+	Emit(OpCode::LoadNull);
+	return {};
+}
+
+Value Compiler::VisitReturn(ReturnStatement const* stmt) {
+	if (stmt->ReturnValue())
+		CompileNode(stmt->ReturnValue());
+	else
+		Emit(OpCode::LoadNull);
+	Emit(OpCode::Return);
+	return {};
+}
+
+Value Compiler::VisitBreakContinue(BreakOrContinueStatement const* stmt) {
+	assert(!m_Loops.empty());		// the parser rejects break/continue outside a loop
+	auto& loop = m_Loops.back();
+	LeaveScopes(loop.ScopeDepth);
+	auto jump = Emit(OpCode::Jump);
+	if (stmt->IsContinue())
+		loop.Continues.push_back(jump);
+	else
+		loop.Breaks.push_back(jump);
+	//
+	// keep the stack balanced for the (unreachable) code that follows
+	//
+	Emit(OpCode::LoadNull);
+	return {};
+}
+
+Value Compiler::VisitFor(ForStatement const* stmt) {
+	EnterScope();
+	if (stmt->Init()) {
+		CompileNode(stmt->Init());
+		Emit(OpCode::Pop);
+	}
+	auto start = Here();
+	CompileNode(stmt->While());
+	auto exit = Emit(OpCode::JumpIfFalse);
+	m_Loops.push_back({ m_ScopeDepth });
+	CompileScoped(stmt->Body());
+	Emit(OpCode::Pop);
+	auto loop = move(m_Loops.back());
+	m_Loops.pop_back();
+
+	PatchJumps(loop.Continues, Here());
+	CompileNode(stmt->Inc());
+	Emit(OpCode::Pop);
+	Emit(OpCode::Jump, start);
+	PatchJumps({ exit }, Here());
+	PatchJumps(loop.Breaks, Here());
+	ExitScope();
+	Emit(OpCode::LoadNull);
+	return {};
+}
+
+Value Compiler::VisitStatements(Statements const* stmts) {
+	auto& list = stmts->Get();
+	if (list.empty()) {
+		Emit(OpCode::LoadNull);
+		return {};
+	}
+	for (size_t i = 0; i < list.size(); i++) {
+		if (i > 0)
+			Emit(OpCode::Pop);
+		CompileNode(list[i].get());
+	}
+	return {};
+}
+
+Value Compiler::VisitAnonymousFunction(AnonymousFunctionExpression const* func) {
+	Emit(OpCode::MakeClosure, CompileFunction(Atom::None, func->Args(), func->Body(), func->FrameSize(), func->Captures()));
+	return {};
+}
+
+Value Compiler::VisitEnumDeclaration(EnumDeclaration const*) {
+	Emit(OpCode::LoadNull);
+	return {};
+}
+
+Value Compiler::VisitArray(ArrayExpression const* expr) {
+	for (auto& element : expr->Elements())
+		CompileNode(element.get());
+	Emit(OpCode::MakeArray, 0, (uint16_t)expr->Elements().size());
+	return {};
+}
+
+Value Compiler::VisitDictionary(DictionaryExpression const* expr) {
+	for (auto& [key, value] : expr->Entries()) {
+		CompileNode(key.get());
+		CompileNode(value.get());
+	}
+	Emit(OpCode::MakeDictionary, 0, (uint16_t)expr->Entries().size());
+	return {};
+}
+
+Value Compiler::VisitIndex(IndexExpression const* expr) {
+	CompileNode(expr->Container());
+	CompileNode(expr->Index());
+	Emit(OpCode::LoadIndex);
+	return {};
+}
+
+Value Compiler::VisitMember(MemberExpression const* expr) {
+	CompileNode(expr->Object());
+	Emit(OpCode::LoadField, AddFieldSite(expr->Field()));
+	return {};
+}
+
+Value Compiler::VisitAssignMember(AssignMemberExpression const* expr) {
+	CompileNode(expr->Target()->Object());
+	CompileNode(expr->Value());
+	Emit(OpCode::StoreField, AddFieldSite(expr->Target()->Field()));
+	return {};
+}
+
+Value Compiler::VisitAssignIndex(AssignIndexExpression const* expr) {
+	CompileNode(expr->Target()->Container());
+	CompileNode(expr->Target()->Index());
+	CompileNode(expr->Value());
+	Emit(OpCode::StoreIndex);
+	return {};
+}
+
+void Compiler::CompileNode(LogoAstNode const* node) {
+	auto outer = exchange(m_Node, node);
+	node->Accept(this);
+	m_Node = outer;
+}
+
+int Compiler::Emit(OpCode code, int operand, uint16_t count) {
+	m_Chunk->Code.push_back(Instruction{ .Code = code, .Count = count, .Operand = operand });
+	m_Chunk->Nodes.push_back(m_Node);
+	return (int)m_Chunk->Code.size() - 1;
+}
+
+void Compiler::Fuse(CodeChunk& chunk) {
+	//
+	// peephole pass replacing common sequences with superinstructions
+	// a sequence is fused only if no jump lands inside it
+	//
+	if (!m_Superinstructions)
+		return;
+
+	auto& code = chunk.Code;
+	auto isJump = [](OpCode op) {
+		return op == OpCode::Jump || op == OpCode::JumpIfFalse || op == OpCode::RepeatNext;
+	};
+	vector<bool> target(code.size() + 1);
+	for (auto& inst : code)
+		if (isJump(inst.Code))
+			target[inst.Operand] = true;
+
+	auto match = [&](size_t i, initializer_list<OpCode> ops) {
+		if (i + ops.size() > code.size())
+			return false;
+		auto first = i;
+		for (auto op : ops) {
+			if (code[i].Code != op || (i != first && target[i]))
+				return false;
+			i++;
+		}
+		return true;
+	};
+
+	vector<int> remap(code.size() + 1);
+	size_t count = 0;
+	for (size_t i = 0; i < code.size(); ) {
+		auto& inst = code[i];
+		Instruction fused{ OpCode::Nop, 0, 0 };
+		size_t length = 1;
+		if (inst.Operand <= UINT16_MAX) {
+			if (match(i, { OpCode::LoadLocal, OpCode::LoadConst, OpCode::Add }) || match(i, { OpCode::LoadLocal, OpCode::LoadConst, OpCode::Sub })) {
+				fused = { code[i + 2].Code == OpCode::Add ? OpCode::AddLocalConst : OpCode::SubLocalConst, uint16_t(inst.Operand), code[i + 1].Operand };
+				length = 3;
+			}
+			else if ((match(i, { OpCode::LoadLocal, OpCode::Call }) || match(i, { OpCode::LoadConst, OpCode::Call })) && code[i + 1].Count == 1) {
+				fused = { inst.Code == OpCode::LoadLocal ? OpCode::CallWithLocal : OpCode::CallWithConst, uint16_t(inst.Operand), code[i + 1].Operand };
+				length = 2;
+			}
+		}
+		for (size_t n = 0; n < length; n++)
+			remap[i + n] = (int)count;
+		chunk.Nodes[count] = chunk.Nodes[i + length - 1];		// a fused sequence fails where its last instruction would
+		code[count++] = length > 1 ? fused : inst;
+		i += length;
+	}
+	remap[code.size()] = (int)count;
+	code.resize(count);
+	chunk.Nodes.resize(count);
+	for (auto& inst : code)
+		if (isJump(inst.Code))
+			inst.Operand = remap[inst.Operand];
+}
+
+void Compiler::PatchJumps(vector<int> const& jumps, int target) {
+	for (auto index : jumps)
+		m_Chunk->Code[index].Operand = target;
+}
+
+int Compiler::Here() const {
+	return (int)m_Chunk->Code.size();
+}
+
+int Compiler::AddConstant(Value v) {
+	m_Chunk->Constants.push_back(move(v));
+	return (int)m_Chunk->Constants.size() - 1;
+}
+
+int Compiler::AddName(Atom name) {
+	auto& names = m_Chunk->Names;
+	if (auto it = find(names.begin(), names.end(), name); it != names.end())
+		return int(it - names.begin());
+	names.push_back(name);
+	m_Chunk->Callees.emplace_back();
+	return (int)names.size() - 1;
+}
+
+int Compiler::AddFieldSite(Atom field) {
+	m_Chunk->FieldSites.push_back(FieldSite{ .Name = field });
+	return (int)m_Chunk->FieldSites.size() - 1;
+}
+
+int Compiler::CompileFunction(Atom name, vector<Atom> const& parameters, Expression const* body, int frameSize, vector<Capture> const& captures) {
+	auto chunk = make_shared<CodeChunk>();
+	chunk->Name = name;
+	chunk->Parameters = parameters;
+	chunk->Body = body;
+	chunk->FrameSize = frameSize;
+	chunk->Captures = captures;
+
+	auto parent = m_Chunk;
+	auto loops = move(m_Loops);
+	auto depth = m_ScopeDepth;
+	auto topLevel = m_TopLevel;
+	m_Chunk = chunk.get();
+	m_Loops.clear();
+	m_ScopeDepth = 0;
+	m_TopLevel = false;
+
+	CompileNode(body);
+	Emit(OpCode::Return);
+	Fuse(*chunk);
+
+	m_Chunk = parent;
+	m_Loops = move(loops);
+	m_ScopeDepth = depth;
+	m_TopLevel = topLevel;
+	m_Chunk->Functions.push_back(move(chunk));
+	return (int)m_Chunk->Functions.size() - 1;
+}
+
+void Compiler::CompileScoped(LogoAstNode const* node) {
+	EnterScope();
+	CompileNode(node);
+	ExitScope();
+}
+
+void Compiler::EnterScope() {
+	//
+	// function locals live in frame slots, only top level code needs runtime scopes
+	//
+	if (m_TopLevel) {
+		Emit(OpCode::PushScope);
+		m_ScopeDepth++;
+	}
+}
+
+void Compiler::ExitScope() {
+	if (m_TopLevel) {
+		m_ScopeDepth--;
+		Emit(OpCode::PopScope);
+	}
+}
+
+void Compiler::LeaveScopes(int depth) {
+	for (auto i = m_ScopeDepth; i > depth; i--)
+		Emit(OpCode::PopScope);
+}
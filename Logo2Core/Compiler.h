@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Visitor.h"
+#include "Bytecode.h"
+
+namespace Logo2 {
+	class LogoAstNode;
+
+	//
+	// lowers the AST produced by the Parser into bytecode for the VirtualMachine
+	// every node leaves exactly one value on the VM stack
+	//
+	class Compiler : public Visitor {
+	public:
+		std::shared_ptr<CodeChunk> Compile(LogoAstNode const* root);
+		//
+		// standalone chunks for the JIT: a function body running in a frame set up by the caller,
+		// and a repeat loop whose remaining count the caller pushes before running it
+		//
+		std::shared_ptr<CodeChunk> CompileBody(Expression const* body, int frameSize);
+		std::shared_ptr<CodeChunk> CompileLoop(RepeatStatement const* loop, bool topLevel);
+		void EnableSuperinstructions(bool enable);
+
+		Value VisitLiteral(LiteralExpression const* expr) override;
+		Value VisitBinary(BinaryExpression const* expr) override;
+		Value VisitUnary(UnaryExpression const* expr) override;
+		Value VisitName(NameExpression const* expr) override;
+		Value VisitBlock(BlockExpression const* expr) override;
+		Value VisitVar(VarStatement const* expr) override;
+		Value VisitAssign(AssignExpression const* expr) override;
+		Value VisitPostfix(PostfixExpression const* expr) override;
+		Value VisitInvokeFunction(InvokeFunctionExpression const* expr) override;
+		Value VisitRepeat(RepeatStatement const* expr) override;
+		Value VisitWhile(WhileStatement const* stmt) override;
+		Value VisitIfThenElse(IfThenElseExpression const* expr) override;
+		Value VisitFunctionDeclaration(FunctionDeclaration const* decl) override;
+		Value VisitReturn(ReturnStatement const* expr) override;
+		Value VisitBreakContinue(BreakOrContinueStatement const* stmt) override;
+		Value VisitFor(ForStatement const* stmt) override;
+		Value VisitStatements(Statements const* stmts) override;
+		Value VisitAnonymousFunction(AnonymousFunctionExpression const* func) override;
+		Value VisitEnumDeclaration(EnumDeclaration const* decl) override;
+		Value VisitArray(ArrayExpression const* expr) override;
+		Value VisitDictionary(DictionaryExpression const* expr) override;
+		Value VisitIndex(IndexExpression const* expr) override;
+		Value VisitAssignIndex(AssignIndexExpression const* expr) override;
+		Value VisitMember(MemberExpression const* expr) override;
+		Value VisitAssignMember(AssignMemberExpression const* expr) override;
+
+	private:
+		struct LoopInfo {
+			int ScopeDepth;
+			std::vector<int> Breaks{};
+			std::vector<int> Continues{};
+		};
+
+		void CompileNode(LogoAstNode const* node);
+		int Emit(OpCode code, int operand = 0, uint16_t count = 0);
+		void PatchJumps(std::vector<int> const& jumps, int target);
+		int Here() const;
+		int AddConstant(Value v);
+		int AddName(Atom name);
+		int AddFieldSite(Atom field);
+		int CompileFunction(Atom name, std::vector<Atom> const& parameters, Expression const* body, int frameSize, std::vector<Capture> const& captures);
+		void CompileScoped(LogoAstNode const* node);
+		void EnterScope();
+		void ExitScope();
+		void LeaveScopes(int depth);
+		void Fuse(CodeChunk& chunk);
+		void CompileRepeatLoop(RepeatStatement const* expr);
+		std::shared_ptr<CodeChunk> Begin(bool topLevel);
+		void End(CodeChunk& chunk, int completed = 0);
+
+		CodeChunk* m_Chunk{ nullptr };
+		bool m_TopLevel{ true };
+		bool m_Superinstructions{ true };
+		std::vector<LoopInfo> m_Loops;
+		int m_ScopeDepth{ 0 };
+		LogoAstNode const* m_Node{ nullptr };		// the node being compiled, recorded with each instruction
+	};
+}
@@ -0,0 +1,186 @@
+#include "pch.h"
+#include "DictionaryValue.h"
+#include "Heap.h"
+#include <Errors.h>
+#include <cstring>
+
+using namespace Logo2;
+using namespace std;
+
+namespace {
+	//
+	// murmur3 finalizer: spreads nearby integers over the whole table
+	//
+	uint64_t Mix(uint64_t x) {
+		x ^= x >> 33;
+		x *= 0xFF51AFD7ED558CCDull;
+		x ^= x >> 33;
+		x *= 0xC4CEB9FE1A85EC53ull;
+		x ^= x >> 33;
+		return x;
+	}
+
+	uint64_t HashText(string_view text) {
+		uint64_t h = 0xCBF29CE484222325ull;		// FNV-1a
+		for (auto ch : text) {
+			h ^= (uint8_t)ch;
+			h *= 0x100000001B3ull;
+		}
+		return h;
+	}
+}
+
+size_t DictionaryValue::KeyHash::operator()(Value const& key) const {
+	return Hash(key);
+}
+
+bool DictionaryValue::KeyEqual::operator()(Value const& left, Value const& right) const {
+	//
+	// Value equality, plus booleans (which do not compare equal as values)
+	//
+	if (left.IsBoolean() || right.IsBoolean())
+		return left.IsBoolean() && right.IsBoolean() && left.Boolean() == right.Boolean();
+	return left == right;
+}
+
+uint32_t DictionaryValue::Hash(Value const& key) {
+	switch (key.Index()) {
+		case Value::TypeNull: return 0;
+		case Value::TypeBoolean: return (uint32_t)Mix(key.Boolean() ? 0x7275 : 0x6661);
+		case Value::TypeInteger: return (uint32_t)Mix(key.Integer());
+		case Value::TypeString: return (uint32_t)Mix(HashText(key.String().View()));
+		case Value::TypeReal:
+		{
+			auto d = key.Real();
+			if (d >= -0x1p63 && d < 0x1p63 && d == (double)(long long)d)
+				return (uint32_t)Mix((long long)d);
+			uint64_t bits;
+			memcpy(&bits, &d, sizeof(d));
+			return (uint32_t)Mix(bits);
+		}
+		default: break;
+	}
+	throw RuntimeError(ErrorType::TypeMismatch, nullptr, "dictionary keys must be null, booleans, numbers or strings");
+}
+
+DictionaryValue::DictionaryValue() : HeapObject(Value::TypeDictionary), m_Entries(Heap::CurrentResource()), m_Slots(Heap::CurrentResource()) {
+}
+
+DictionaryValue::DictionaryValue(size_t capacity) : DictionaryValue() {
+	m_Entries.reserve(capacity);
+	Rehash(capacity);
+}
+
+size_t DictionaryValue::Size() const {
+	return m_Entries.size() - m_Removed;
+}
+
+size_t DictionaryValue::Probe(Value const& key, uint32_t hash) const {
+	//
+	// the slot holding the key, or the empty slot that ends its probe sequence
+	//
+	auto mask = m_Slots.size() - 1;
+	for (auto i = hash & mask;; i = (i + 1) & mask) {
+		auto& slot = m_Slots[i];
+		if (slot.Index == Empty)
+			return i;
+		if (slot.Index != Erased && slot.Hash == hash && KeyEqual()(m_Entries[slot.Index].Key, key))
+			return i;
+	}
+}
+
+void DictionaryValue::Rehash(size_t capacity) {
+	auto size = MinCapacity;
+	while (size * 3 < capacity * 4)
+		size *= 2;
+
+	//
+	// the new table is allocated before anything changes, so a failure (memory limit) leaves the dictionary intact
+	//
+	pmr::vector<Slot> slots(size, Slot{ 0, Empty }, m_Slots.get_allocator());
+	if (m_Removed) {
+		erase_if(m_Entries, [](auto& entry) { return entry.Removed; });
+		m_Removed = 0;
+	}
+	auto mask = size - 1;
+	for (uint32_t index = 0; index < (uint32_t)m_Entries.size(); index++) {
+		auto i = m_Entries[index].Hash & mask;
+		while (slots[i].Index != Empty)
+			i = (i + 1) & mask;
+		slots[i] = Slot{ m_Entries[index].Hash, index };
+	}
+	m_Slots = move(slots);
+	m_Used = m_Entries.size();
+}
+
+Value const* DictionaryValue::Find(Value const& key) const {
+	if (m_Slots.empty())
+		return nullptr;
+	auto& slot = m_Slots[Probe(key, Hash(key))];
+	return slot.Index == Empty ? nullptr : &m_Entries[slot.Index].Item;
+}
+
+Value DictionaryValue::Get(Value const& key) const {
+	auto item = Find(key);
+	return item ? *item : Value();
+}
+
+void DictionaryValue::Set(Value const& key, Value value) {
+	auto hash = Hash(key);
+	if ((m_Used + 1) * 4 > m_Slots.size() * 3)
+		Rehash(Size() * 2 + 1);
+
+	auto& slot = m_Slots[Probe(key, hash)];
+	if (slot.Index != Empty) {
+		m_Entries[slot.Index].Item = move(value);
+		return;
+	}
+	//
+	// the entry first: growing the entries may fail (memory limit), leaving the table as it was
+	//
+	m_Entries.push_back(Entry{ .Key = key, .Item = move(value), .Hash = hash });
+	slot = Slot{ hash, (uint32_t)m_Entries.size() - 1 };
+	m_Used++;
+}
+
+bool DictionaryValue::Remove(Value const& key) {
+	if (m_Slots.empty())
+		return false;
+	auto& slot = m_Slots[Probe(key, Hash(key))];
+	if (slot.Index == Empty)
+		return false;
+
+	//
+	// the slot stays used so later keys of the probe sequence are still found,
+	// removed entries are compacted away once they are the majority
+	//
+	auto& entry = m_Entries[slot.Index];
+	entry = Entry{ .Hash = entry.Hash, .Removed = true };
+	slot.Index = Erased;
+	if (++m_Removed * 2 > m_Entries.size())
+		Rehash(Size() * 2);
+	return true;
+}
+
+void DictionaryValue::Clear() {
+	m_Entries.clear();
+	m_Slots.clear();
+	m_Used = m_Removed = 0;
+}
+
+size_t DictionaryValue::ByteSize() const {
+	return sizeof(*this) + m_Entries.capacity() * sizeof(Entry) + m_Slots.capacity() * sizeof(Slot);
+}
+
+string DictionaryValue::ToString() const {
+	if (Size() == 0)
+		return "[:]";
+
+	string text = "[";
+	ForEach([&](Value const& key, Value const& value) {
+		if (text.length() > 1)
+			text += ", ";
+		text += key.ToString() + ": " + value.ToString();
+	});
+	return text + "]";
+}
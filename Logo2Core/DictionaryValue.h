@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Value.h"
+
+namespace Logo2 {
+	//
+	// dictionary held by dictionary Values (by reference): the entries are kept in insertion order in a dense vector,
+	// found through an open addressing table (linear probing) of entry indices and the low bits of their hash
+	// keys are null, booleans, numbers and strings; an integral real is the same key as the equal integer
+	//
+	class DictionaryValue : public HeapObject {
+	public:
+		DictionaryValue();
+		explicit DictionaryValue(size_t capacity);
+
+		size_t Size() const;
+		Value const* Find(Value const& key) const;
+		Value Get(Value const& key) const;		// null if the key is missing
+		void Set(Value const& key, Value value);
+		bool Remove(Value const& key);
+		std::string ToString() const;
+		void Clear();
+		size_t ByteSize() const;
+
+		//
+		// f(key, value) for all entries, in insertion order
+		//
+		template<typename F>
+		void ForEach(F&& f) const {
+			for (auto& entry : m_Entries)
+				if (!entry.Removed)
+					f(entry.Key, entry.Item);
+		}
+
+		//
+		// the key hashing and equality of dictionaries, for use with other containers
+		//
+		struct KeyHash {
+			size_t operator()(Value const& key) const;
+		};
+		struct KeyEqual {
+			bool operator()(Value const& left, Value const& right) const;
+		};
+
+	private:
+		struct Entry {
+			Value Key{};
+			Value Item{};
+			uint32_t Hash;
+			bool Removed{ false };
+		};
+		struct Slot {
+			uint32_t Hash;
+			uint32_t Index;			// into m_Entries, or Empty / Removed
+		};
+		static constexpr uint32_t Empty = ~0u;
+		static constexpr uint32_t Erased = ~0u - 1;
+		static constexpr size_t MinCapacity = 8;
+
+		static uint32_t Hash(Value const& key);
+		size_t Probe(Value const& key, uint32_t hash) const;
+		void Rehash(size_t capacity);
+
+		std::pmr::vector<Entry> m_Entries;
+		std::pmr::vector<Slot> m_Slots;		// power of 2 size, at most 3/4 used (counting erased slots)
+		size_t m_Used{ 0 };				// slots not Empty
+		size_t m_Removed{ 0 };			// entries removed since the last rehash
+	};
+}
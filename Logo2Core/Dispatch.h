@@ -0,0 +1,32 @@
+#pragma once
+
+//
+// instruction dispatch shared by the VM loops
+// with GCC/Clang every handler jumps straight to the next one through a table of label
+// addresses (computed goto), other compilers use a switch in a loop
+// define LOGO2_SWITCH_DISPATCH to force the switch
+//
+// the loop must name its locals code, ip, inst (a pointer to the current instruction) and
+// labels (the label table, in opcode order); with the switch it also declares OpType as its opcode enum
+//
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LOGO2_SWITCH_DISPATCH)
+#define LOGO2_THREADED_DISPATCH
+#endif
+
+#ifdef LOGO2_THREADED_DISPATCH
+
+#define LABEL(op)		&&L_##op
+#define DISPATCH(op)	goto *labels[size_t(op)];
+#define CASE(op)		L_##op:
+#define DEFAULT_CASE
+#define NEXT()			do { inst = code + ip++; m_Instructions++; goto *labels[size_t(inst->Code)]; } while (false)
+
+#else
+
+#define DISPATCH(op)	switch (op)
+#define CASE(op)		case OpType::op:
+#define DEFAULT_CASE	default:
+#define NEXT()			continue
+
+#endif
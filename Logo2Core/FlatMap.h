@@ -0,0 +1,245 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <tuple>
+#include <utility>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define LOGO2_FLATMAP_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace Logo2 {
+	//
+	// open addressing hash map for the name tables (scopes, symbols, functions, keywords): no erase, only Clear
+	// slots are in groups of 16 with a control byte each, holding 7 bits of the hash of the key in it (or Empty),
+	// so a probe compares a whole group at once (with SSE2 on x64) and only looks at the keys whose bits match;
+	// it stops at the first group with an empty slot
+	// the entries live in blocks that are never moved, so pointers to them hold until Clear, Clear keeps the memory
+	// Find and TryEmplaceHashed take a hash computed before (by Hash, or a compatible one for another key type),
+	// so a name hashed once by the tokenizer is not hashed again
+	//
+	template<typename Key, typename T, typename Hash = std::hash<Key>>
+	class FlatMap {
+	public:
+		using Entry = std::pair<Key const, T>;
+
+		explicit FlatMap(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) : m_Resource(resource) {
+		}
+
+		~FlatMap() {
+			Clear();
+			for (size_t b = 0; b < BlockCount; b++)
+				if (m_Blocks[b])
+					m_Resource->deallocate(m_Blocks[b], BlockSize(b) * sizeof(Entry), alignof(Entry));
+			FreeSlots();
+		}
+
+		FlatMap(FlatMap const&) = delete;
+		FlatMap& operator=(FlatMap const&) = delete;
+
+		size_t Size() const {
+			return m_Size;
+		}
+
+		bool Empty() const {
+			return m_Size == 0;
+		}
+
+		template<typename K>
+		T* Find(K const& key, size_t hash) {
+			return const_cast<T*>(std::as_const(*this).Find(key, hash));
+		}
+
+		template<typename K>
+		T const* Find(K const& key, size_t hash) const {
+			if (m_Size == 0)
+				return nullptr;
+			hash = Mix(hash);
+			auto h2 = Control(hash);
+			for (size_t group = GroupOf(hash), step = 1; ; group = (group + step++) & m_GroupMask) {
+				auto control = m_Control + group * GroupWidth;
+				for (auto match = Match(control, h2); match; match &= match - 1) {
+					auto entry = m_Slots[group * GroupWidth + std::countr_zero(match)];
+					if (entry->first == key)
+						return &entry->second;
+				}
+				if (MatchEmpty(control))
+					return nullptr;
+			}
+		}
+
+		T* Find(Key const& key) {
+			return Find(key, Hash{}(key));
+		}
+
+		T const* Find(Key const& key) const {
+			return Find(key, Hash{}(key));
+		}
+
+		bool Contains(Key const& key) const {
+			return Find(key) != nullptr;
+		}
+
+		//
+		// the value for key and whether it was added (constructed from args), or the one that was there
+		//
+		template<typename K, typename... Args>
+		std::pair<T*, bool> TryEmplaceHashed(K&& key, size_t hash, Args&&... args) {
+			if (auto found = Find(key, hash))
+				return { found, false };
+			if ((m_Size + 1) * 8 > m_GroupCount * GroupWidth * 7)
+				Grow();
+			auto entry = NewEntry(std::forward<K>(key), std::forward<Args>(args)...);
+			Place(entry, Mix(hash));
+			return { &entry->second, true };
+		}
+
+		template<typename... Args>
+		std::pair<T*, bool> TryEmplace(Key const& key, Args&&... args) {
+			return TryEmplaceHashed(key, Hash{}(key), std::forward<Args>(args)...);
+		}
+
+		template<typename... Args>
+		std::pair<T*, bool> TryEmplace(Key&& key, Args&&... args) {
+			auto hash = Hash{}(key);
+			return TryEmplaceHashed(std::move(key), hash, std::forward<Args>(args)...);
+		}
+
+		void Clear() {
+			for (size_t i = 0; i < m_Size; i++)
+				At(i)->~Entry();
+			m_Size = 0;
+			if (m_Control)
+				std::memset(m_Control, EmptyControl, m_GroupCount * GroupWidth);
+		}
+
+	private:
+		static constexpr size_t GroupWidth = 16;
+		static constexpr uint8_t EmptyControl = 0x80;
+		static constexpr size_t FirstBlockSize = 8;
+		static constexpr size_t BlockCount = 32 - 3;		// 2^32 entries at most
+
+		//
+		// spreads the bits of hashes that are poor in some of them (the identity for integers): the control byte
+		// comes from the top bits of the product, the group from the bits above the lowest 7
+		//
+		static size_t Mix(size_t hash) {
+			return size_t(uint64_t(hash) * 0x9e3779b97f4a7c15ull);
+		}
+
+		static uint8_t Control(size_t hash) {
+			return uint8_t(uint64_t(hash) >> 57);
+		}
+
+		size_t GroupOf(size_t hash) const {
+			return (hash >> 7) & m_GroupMask;
+		}
+
+		//
+		// bit i set for each slot i of the group with control byte h2 / that is empty
+		//
+		static uint32_t Match(uint8_t const* control, uint8_t h2) {
+#ifdef LOGO2_FLATMAP_SSE2
+			auto group = _mm_loadu_si128(reinterpret_cast<__m128i const*>(control));
+			return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(char(h2)))));
+#else
+			uint32_t match = 0;
+			for (size_t i = 0; i < GroupWidth; i++)
+				match |= uint32_t(control[i] == h2) << i;
+			return match;
+#endif
+		}
+
+		static uint32_t MatchEmpty(uint8_t const* control) {
+#ifdef LOGO2_FLATMAP_SSE2
+			return uint32_t(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(control))));
+#else
+			return Match(control, EmptyControl);
+#endif
+		}
+
+		//
+		// block b holds FirstBlockSize << b entries, so entry i is in block bit_width(i / FirstBlockSize + 1) - 1
+		//
+		static size_t BlockSize(size_t block) {
+			return FirstBlockSize << block;
+		}
+
+		Entry* At(size_t index) const {
+			auto block = std::bit_width(index / FirstBlockSize + 1) - 1;
+			return m_Blocks[block] + (index - FirstBlockSize * ((size_t(1) << block) - 1));
+		}
+
+		template<typename K, typename... Args>
+		Entry* NewEntry(K&& key, Args&&... args) {
+			auto block = std::bit_width(m_Size / FirstBlockSize + 1) - 1;
+			if (!m_Blocks[block])
+				m_Blocks[block] = static_cast<Entry*>(m_Resource->allocate(BlockSize(block) * sizeof(Entry), alignof(Entry)));
+			auto entry = At(m_Size);
+			new (entry) Entry(std::piecewise_construct, std::forward_as_tuple(std::forward<K>(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+			m_Size++;
+			return entry;
+		}
+
+		void Place(Entry* entry, size_t hash) {
+			for (size_t group = GroupOf(hash), step = 1; ; group = (group + step++) & m_GroupMask) {
+				if (auto empty = MatchEmpty(m_Control + group * GroupWidth)) {
+					auto slot = group * GroupWidth + std::countr_zero(empty);
+					m_Control[slot] = Control(hash);
+					m_Slots[slot] = entry;
+					return;
+				}
+			}
+		}
+
+		//
+		// the new slots are allocated before the old ones are let go, so the map stays usable if that fails
+		//
+		void Grow() {
+			auto groups = m_GroupCount ? m_GroupCount * 2 : 1;
+			auto slots = groups * GroupWidth;
+			auto control = static_cast<uint8_t*>(m_Resource->allocate(slots, GroupWidth));
+			Entry** entries;
+			try {
+				entries = static_cast<Entry**>(m_Resource->allocate(slots * sizeof(Entry*), alignof(Entry*)));
+			}
+			catch (...) {
+				m_Resource->deallocate(control, slots, GroupWidth);
+				throw;
+			}
+			FreeSlots();
+			m_Control = control;
+			m_Slots = entries;
+			m_GroupCount = groups;
+			m_GroupMask = groups - 1;
+			std::memset(m_Control, EmptyControl, slots);
+			for (size_t i = 0; i < m_Size; i++) {
+				auto entry = At(i);
+				Place(entry, Mix(Hash{}(entry->first)));
+			}
+		}
+
+		void FreeSlots() {
+			if (!m_Control)
+				return;
+			auto slots = m_GroupCount * GroupWidth;
+			m_Resource->deallocate(m_Control, slots, GroupWidth);
+			m_Resource->deallocate(m_Slots, slots * sizeof(Entry*), alignof(Entry*));
+			m_Control = nullptr;
+			m_Slots = nullptr;
+		}
+
+		std::pmr::memory_resource* m_Resource;
+		uint8_t* m_Control{ nullptr };
+		Entry** m_Slots{ nullptr };
+		size_t m_GroupCount{ 0 };
+		size_t m_GroupMask{ 0 };
+		size_t m_Size{ 0 };
+		Entry* m_Blocks[BlockCount]{};
+	};
+}
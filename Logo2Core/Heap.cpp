@@ -0,0 +1,427 @@
+#include "pch.h"
+#include "Heap.h"
+#include "ArrayValue.h"
+#include "DictionaryValue.h"
+#include "TypeObject.h"
+#include "Interpreter.h"
+#include <Errors.h>
+
+using namespace Logo2;
+using namespace std;
+
+namespace {
+	thread_local Heap* t_CurrentHeap;
+
+	//
+	// value(v) for the values an object holds, upvalue(u) for the captures of a function
+	//
+	template<typename FValue, typename FUpvalue>
+	void ForEachReference(HeapObject* object, FValue&& value, FUpvalue&& upvalue) {
+		switch (object->Type) {
+			case Value::TypeFunction:
+				for (auto& up : static_cast<Function*>(object)->Upvalues)
+					upvalue(up);
+				break;
+
+			case Value::TypeArray:
+				static_cast<ArrayValue*>(object)->ForEachValue(value);
+				break;
+
+			case Value::TypeDictionary:
+				//
+				// keys are never objects
+				//
+				static_cast<DictionaryValue*>(object)->ForEach([&](Value const&, Value const& item) { value(item); });
+				break;
+
+			case Value::TypeUserObject:
+			{
+				auto user = static_cast<UserObject*>(object);
+				for (int i = 0; i < user->FieldCount(); i++)
+					value(user->Fields()[i]);
+				break;
+			}
+		}
+	}
+
+	//
+	// drops the references of an object, which breaks the cycles it is part of
+	//
+	void ClearReferences(HeapObject* object) {
+		switch (object->Type) {
+			case Value::TypeFunction: static_cast<Function*>(object)->Upvalues.clear(); break;
+			case Value::TypeArray: static_cast<ArrayValue*>(object)->Clear(); break;
+			case Value::TypeDictionary: static_cast<DictionaryValue*>(object)->Clear(); break;
+			case Value::TypeUserObject:
+			{
+				auto user = static_cast<UserObject*>(object);
+				for (int i = 0; i < user->FieldCount(); i++)
+					user->Fields()[i] = Value();
+				break;
+			}
+		}
+	}
+
+	size_t ByteSize(HeapObject* object) {
+		switch (object->Type) {
+			case Value::TypeFunction:
+			{
+				auto f = static_cast<Function*>(object);
+				return sizeof(Function) + f->Upvalues.capacity() * sizeof(f->Upvalues[0]) + f->Parameters.size() * sizeof(Atom);
+			}
+			case Value::TypeArray: return static_cast<ArrayValue*>(object)->ByteSize();
+			case Value::TypeDictionary: return static_cast<DictionaryValue*>(object)->ByteSize();
+			case Value::TypeUserObject: return sizeof(UserObject) + static_cast<UserObject*>(object)->FieldCount() * sizeof(Value);
+		}
+		return 0;
+	}
+
+	//
+	// the object a closed upvalue holds; an open one points into a frame, which is not part of the heap
+	//
+	HeapObject* ClosedReferent(Upvalue const* up) {
+		return up->Location == &up->Closed ? up->Closed.Referent() : nullptr;
+	}
+}
+
+CountingResource::CountingResource(pmr::memory_resource* upstream) : m_Upstream(upstream) {
+}
+
+size_t CountingResource::Allocations() const {
+	return m_Allocations;
+}
+
+size_t CountingResource::Live() const {
+	return m_Live;
+}
+
+size_t CountingResource::Bytes() const {
+	return m_Bytes;
+}
+
+size_t CountingResource::Peak() const {
+	return m_Peak;
+}
+
+void* CountingResource::do_allocate(size_t bytes, size_t alignment) {
+	auto p = m_Upstream->allocate(bytes, alignment);
+	m_Allocations++;
+	m_Live++;
+	m_Bytes += bytes;
+	m_Peak = max(m_Peak, m_Bytes);
+	return p;
+}
+
+void CountingResource::do_deallocate(void* p, size_t bytes, size_t alignment) {
+	m_Upstream->deallocate(p, bytes, alignment);
+	m_Live--;
+	m_Bytes -= bytes;
+}
+
+bool CountingResource::do_is_equal(pmr::memory_resource const& other) const noexcept {
+	return this == &other;
+}
+
+HeapObject::HeapObject(uint8_t type) {
+	Type = type;
+}
+
+HeapObject::HeapObject(HeapObject const& other) {
+	Type = other.Type;
+}
+
+HeapObject& HeapObject::operator=(HeapObject const&) {
+	return *this;
+}
+
+void* HeapObject::Allocate(size_t size) {
+	return Heap::CurrentResource()->allocate(size, alignof(max_align_t));
+}
+
+void HeapObject::Deallocate(void* memory, size_t size) {
+	Heap::CurrentResource()->deallocate(memory, size, alignof(max_align_t));
+}
+
+void HeapObject::Track(HeapObject* object) {
+	if (auto heap = t_CurrentHeap) {
+		object->Pooled = true;
+		heap->Add(object);
+	}
+}
+
+void HeapObject::Free(HeapObject* object) {
+	auto heap = object->Owner;
+	auto pooled = object->Pooled;
+	if (heap)
+		heap->Remove(object);
+
+	size_t size = 0;
+	switch (object->Type) {
+		case Value::TypeFunction:
+			size = sizeof(Function);
+			static_cast<Function*>(object)->~Function();
+			break;
+		case Value::TypeArray:
+			size = sizeof(ArrayValue);
+			static_cast<ArrayValue*>(object)->~ArrayValue();
+			break;
+		case Value::TypeDictionary:
+			size = sizeof(DictionaryValue);
+			static_cast<DictionaryValue*>(object)->~DictionaryValue();
+			break;
+		case Value::TypeUserObject:
+		{
+			auto user = static_cast<UserObject*>(object);
+			size = sizeof(UserObject) + user->FieldCount() * sizeof(Value);
+			user->~UserObject();
+			break;
+		}
+		default: assert(false);
+	}
+
+	//
+	// an object of the pools of a heap that is gone stays allocated, along with the pools (see ~Heap)
+	//
+	if (!pooled)
+		pmr::new_delete_resource()->deallocate(object, size, alignof(max_align_t));
+	else if (heap)
+		heap->Resource()->deallocate(object, size, alignof(max_align_t));
+}
+
+Heap::LimitedResource::LimitedResource(Heap& heap, pmr::memory_resource* upstream) : CountingResource(upstream), m_Heap(heap) {
+}
+
+void* Heap::LimitedResource::do_allocate(size_t bytes, size_t alignment) {
+	if (Limit && Bytes() + bytes > Limit) {
+		//
+		// cycles no longer reachable may be what holds the memory
+		//
+		if (m_Heap.m_Options.Enabled)
+			m_Heap.Collect();
+		if (Bytes() + bytes > Limit)
+			throw RuntimeError(ErrorType::OutOfMemory, nullptr, format("memory limit of {} bytes exceeded", Limit));
+	}
+	return CountingResource::do_allocate(bytes, alignment);
+}
+
+Heap::Pools::Pools(Heap& heap) : System(pmr::new_delete_resource()), Pool(&System), Requests(heap, &Pool) {
+}
+
+Heap::Heap(HeapOptions options) : m_Pools(make_unique<Pools>(*this)), m_Options(options), m_Previous(t_CurrentHeap) {
+	t_CurrentHeap = this;
+}
+
+Heap::~Heap() {
+	//
+	// cycles left over are freed, objects still referenced from outside outlive the heap untracked
+	//
+	if (m_Options.Enabled)
+		Collect();
+	for (auto& generation : m_Generations) {
+		while (generation.First)
+			Remove(generation.First);
+	}
+	if (t_CurrentHeap == this)
+		t_CurrentHeap = m_Previous;
+
+	//
+	// memory of the pools still in use (by objects or captures that outlive the interpreter) is never released
+	//
+	if (m_Pools->Requests.Live() != 0)
+		m_Pools.release();
+}
+
+Heap* Heap::Current() {
+	return t_CurrentHeap;
+}
+
+pmr::memory_resource* Heap::CurrentResource() {
+	return t_CurrentHeap ? t_CurrentHeap->Resource() : pmr::new_delete_resource();
+}
+
+pmr::memory_resource* Heap::Resource() {
+	return &m_Pools->Requests;
+}
+
+MemoryStats Heap::Memory() const {
+	return MemoryStats{
+		.Allocations = m_Pools->Requests.Allocations(),
+		.SystemAllocations = m_Pools->System.Allocations(),
+		.SystemBytes = m_Pools->System.Bytes(),
+		.Used = m_Pools->Requests.Bytes(),
+		.Peak = m_Pools->Requests.Peak(),
+		.Limit = m_Pools->Requests.Limit,
+	};
+}
+
+void Heap::SetMemoryLimit(size_t bytes) {
+	m_Pools->Requests.Limit = bytes;
+}
+
+HeapOptions& Heap::Options() {
+	return m_Options;
+}
+
+HeapStats const& Heap::Stats() const {
+	return m_Stats;
+}
+
+size_t Heap::ObjectCount() const {
+	return m_Generations[Young].Count + m_Generations[Old].Count;
+}
+
+void Heap::Add(HeapObject* object) {
+	//
+	// collecting before the object is linked, it is not traced while it may still be incomplete
+	//
+	if (m_Options.Enabled && !m_Collecting && m_Generations[Young].Count >= m_Options.NurserySize) {
+		auto threshold = max(m_OldAfterFull, m_Options.NurserySize) * m_Options.GrowthFactor;
+		Collect(m_Generations[Old].Count > threshold);
+	}
+	object->Owner = this;
+	Link(object, Young);
+}
+
+void Heap::Remove(HeapObject* object) {
+	Unlink(object);
+	object->Owner = nullptr;
+}
+
+void Heap::Link(HeapObject* object, GenerationIndex generation) {
+	auto& list = m_Generations[generation];
+	object->Generation = generation;
+	object->Prev = nullptr;
+	object->Next = list.First;
+	if (list.First)
+		list.First->Prev = object;
+	list.First = object;
+	list.Count++;
+}
+
+void Heap::Unlink(HeapObject* object) {
+	auto& list = m_Generations[object->Generation];
+	if (object->Prev)
+		object->Prev->Next = object->Next;
+	else
+		list.First = object->Next;
+	if (object->Next)
+		object->Next->Prev = object->Prev;
+	object->Prev = object->Next = nullptr;
+	list.Count--;
+}
+
+void Heap::Collect(bool full) {
+	if (m_Collecting)
+		return;
+
+	auto start = chrono::steady_clock::now();
+	m_Collecting = true;
+	CollectGenerations(full ? Old : Young);
+	m_Collecting = false;
+	if (full) {
+		m_OldAfterFull = m_Generations[Old].Count;
+		m_Stats.FullCollections++;
+	}
+
+	auto pause = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+	m_Stats.Collections++;
+	m_Stats.LastPause = pause;
+	m_Stats.MaxPause = max(m_Stats.MaxPause, pause);
+	m_Stats.TotalPause += pause;
+}
+
+void Heap::CollectGenerations(GenerationIndex oldest) {
+	auto collected = [&](HeapObject* object) {
+		return object && object->Owner == this && object->Generation <= oldest;
+	};
+
+	vector<HeapObject*> objects;
+	for (int g = 0; g <= oldest; g++) {
+		for (auto object = m_Generations[g].First; object; object = object->Next) {
+			object->GcRefs = object->Refs;
+			object->Marked = false;
+			objects.push_back(object);
+		}
+	}
+
+	//
+	// discount the references among the collected objects (through upvalues, for functions): what is left are
+	// the references from outside, which make an object a root; an upvalue is a root if it is held by anything
+	// but collected functions (a frame, or a function of an older generation)
+	//
+	struct UpvalueState {
+		long Refs;
+		bool Marked;
+	};
+	unordered_map<Upvalue const*, UpvalueState> upvalues;
+	for (auto object : objects) {
+		ForEachReference(object, [&](Value const& value) {
+			if (auto referent = value.Referent(); collected(referent))
+				referent->GcRefs--;
+		}, [&](shared_ptr<Upvalue> const& up) {
+			auto [it, added] = upvalues.try_emplace(up.get(), UpvalueState{ up.use_count(), false });
+			it->second.Refs--;
+			if (auto referent = ClosedReferent(up.get()); added && collected(referent))
+				referent->GcRefs--;
+		});
+	}
+
+	//
+	// mark what the roots reach
+	//
+	vector<HeapObject*> pending;
+	auto reach = [&](HeapObject* object) {
+		if (collected(object) && !object->Marked) {
+			object->Marked = true;
+			pending.push_back(object);
+		}
+	};
+	auto reachUpvalue = [&](Upvalue const* up) {
+		auto& state = upvalues[up];
+		if (!state.Marked) {
+			state.Marked = true;
+			reach(ClosedReferent(up));
+		}
+	};
+	for (auto object : objects) {
+		if (object->GcRefs > 0)
+			reach(object);
+	}
+	for (auto& [up, state] : upvalues) {
+		if (state.Refs > 0)
+			reachUpvalue(up);
+	}
+	while (!pending.empty()) {
+		auto object = pending.back();
+		pending.pop_back();
+		ForEachReference(object, [&](Value const& value) {
+			reach(value.Referent());
+		}, [&](shared_ptr<Upvalue> const& up) {
+			reachUpvalue(up.get());
+		});
+	}
+
+	//
+	// the survivors of the young generation get older; the garbage is kept alive while its references are
+	// dropped, which frees it (and whatever only it referenced) by reference counting
+	//
+	vector<HeapObject*> garbage;
+	for (auto object : objects) {
+		if (!object->Marked) {
+			object->Refs++;
+			m_Stats.BytesCollected += ByteSize(object);
+			garbage.push_back(object);
+		}
+		else if (object->Generation == Young) {
+			Unlink(object);
+			Link(object, Old);
+		}
+	}
+	for (auto object : garbage)
+		ClearReferences(object);
+	for (auto object : garbage) {
+		if (--object->Refs == 0)
+			HeapObject::Free(object);
+	}
+	m_Stats.ObjectsCollected += garbage.size();
+}
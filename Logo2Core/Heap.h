@@ -0,0 +1,139 @@
+#pragma once
+
+#include <chrono>
+#include <memory_resource>
+#include "Value.h"
+
+namespace Logo2 {
+	struct HeapOptions {
+		bool Enabled{ true };
+		size_t NurserySize{ 1000 };		// objects created between two collections of the young generation
+		double GrowthFactor{ 2.0 };		// the old generation grows by this factor since the last full collection before the next one
+	};
+
+	struct HeapStats {
+		size_t Collections{ 0 };		// all collections, including full ones
+		size_t FullCollections{ 0 };
+		size_t ObjectsCollected{ 0 };
+		size_t BytesCollected{ 0 };
+		std::chrono::nanoseconds LastPause{};
+		std::chrono::nanoseconds MaxPause{};
+		std::chrono::nanoseconds TotalPause{};
+	};
+
+	struct MemoryStats {
+		size_t Allocations{ 0 };			// served by the pools
+		size_t SystemAllocations{ 0 };		// passed on by the pools to the system allocator
+		size_t SystemBytes{ 0 };			// held from the system allocator
+		size_t Used{ 0 };					// allocated from the pools and not freed yet
+		size_t Peak{ 0 };					// the most Used has been
+		size_t Limit{ 0 };					// Used may not go over, 0 for no limit
+	};
+
+	//
+	// memory resource forwarding to another one, counting what goes through
+	//
+	class CountingResource : public std::pmr::memory_resource {
+	public:
+		explicit CountingResource(std::pmr::memory_resource* upstream);
+
+		size_t Allocations() const;		// since creation
+		size_t Live() const;			// allocations not deallocated yet
+		size_t Bytes() const;			// allocated and not deallocated yet
+		size_t Peak() const;			// the most Bytes has been
+
+	protected:
+		void* do_allocate(size_t bytes, size_t alignment) override;
+		void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+		bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override;
+
+	private:
+		std::pmr::memory_resource* m_Upstream;
+		size_t m_Allocations{ 0 };
+		size_t m_Live{ 0 };
+		size_t m_Bytes{ 0 };
+		size_t m_Peak{ 0 };
+	};
+
+	//
+	// the heap objects created while a heap is current (the one of the most recently created interpreter alive on the thread)
+	// objects are freed by their reference count as soon as they are unreferenced; the heap finds the ones that only remain
+	// referenced by cycles among themselves by tracing: the roots are the objects referenced from outside the heap (scopes, frames,
+	// engine stacks, natives), found by discounting the references objects hold to each other, and what they do not reach is freed
+	// objects are created in the young generation, which is collected every NurserySize objects; the survivors move to
+	// the old generation, only collected once it grew by GrowthFactor
+	// the heap also holds the size class pools the interpreter allocates its objects, scopes and captures from,
+	// so that running code reuses memory it freed instead of going back to the system allocator
+	// what is allocated from the pools (also strings, element storage, syntax trees and what the host puts there, like
+	// turtle commands) is held to an optional memory limit: a request past it collects first, then fails with OutOfMemory
+	//
+	class Heap {
+	public:
+		explicit Heap(HeapOptions options = {});
+		~Heap();
+		Heap(Heap const&) = delete;
+		Heap& operator=(Heap const&) = delete;
+
+		static Heap* Current();
+		//
+		// the pools of the current heap, or the system allocator if there is none
+		//
+		static std::pmr::memory_resource* CurrentResource();
+		std::pmr::memory_resource* Resource();
+		MemoryStats Memory() const;
+		void SetMemoryLimit(size_t bytes);		// 0 for no limit
+
+		void Collect(bool full = true);
+		HeapOptions& Options();
+		HeapStats const& Stats() const;
+		size_t ObjectCount() const;
+
+	private:
+		friend struct HeapObject;
+
+		enum GenerationIndex : uint8_t {
+			Young,
+			Old,
+			GenerationCount,
+		};
+
+		struct Generation {
+			HeapObject* First{ nullptr };
+			size_t Count{ 0 };
+		};
+
+		void Add(HeapObject* object);
+		void Remove(HeapObject* object);
+		void Link(HeapObject* object, GenerationIndex generation);
+		void Unlink(HeapObject* object);
+		void CollectGenerations(GenerationIndex oldest);
+
+		class LimitedResource : public CountingResource {
+		public:
+			LimitedResource(Heap& heap, std::pmr::memory_resource* upstream);
+
+			size_t Limit{ 0 };
+
+		private:
+			void* do_allocate(size_t bytes, size_t alignment) override;
+
+			Heap& m_Heap;
+		};
+
+		struct Pools {
+			explicit Pools(Heap& heap);
+
+			CountingResource System;		// the memory pools get from the system allocator
+			std::pmr::unsynchronized_pool_resource Pool;
+			LimitedResource Requests;		// what the pools are asked for
+		};
+
+		std::unique_ptr<Pools> m_Pools;
+		HeapOptions m_Options;
+		HeapStats m_Stats;
+		Generation m_Generations[GenerationCount];
+		size_t m_OldAfterFull{ 0 };		// old objects left by the last full collection
+		bool m_Collecting{ false };
+		Heap* m_Previous;
+	};
+}
@@ -1,5 +1,9 @@
 #include "pch.h"
 #include "Interpreter.h"
+#include "Quickening.h"
+#include "Jit.h"
+#include "ArrayValue.h"
+#include "DictionaryValue.h"
 #include <Errors.h>
 
 using namespace Logo2;
@@ -8,67 +12,163 @@ Interpreter::Interpreter() {
 	//
 	// push global scope
 	//
-	m_Scopes.push(std::make_unique<Scope>());
+	m_Scopes.push_back(std::make_unique<Scope>(m_Heap.Resource()));
+	m_ScopeDepth = 1;
 }
 
+Interpreter::~Interpreter() = default;
+
 Value Interpreter::Eval(LogoAstNode const* node) {
+	//
+	// dispatch on the node tag: a jump table and direct calls instead of two virtual calls per node (Accept, then Visit)
+	//
+	switch (node->Type()) {
+		case NodeType::ExpressionStatement: return Eval(static_cast<ExpressionStatement const*>(node)->Expr());
+		case NodeType::Statements: return Interpreter::VisitStatements(static_cast<Statements const*>(node));
+		case NodeType::Var: return Interpreter::VisitVar(static_cast<VarStatement const*>(node));
+		case NodeType::Repeat: return Interpreter::VisitRepeat(static_cast<RepeatStatement const*>(node));
+		case NodeType::While: return Interpreter::VisitWhile(static_cast<WhileStatement const*>(node));
+		case NodeType::For: return Interpreter::VisitFor(static_cast<ForStatement const*>(node));
+		case NodeType::BreakContinue: return Interpreter::VisitBreakContinue(static_cast<BreakOrContinueStatement const*>(node));
+		case NodeType::Return: return Interpreter::VisitReturn(static_cast<ReturnStatement const*>(node));
+		case NodeType::EnumDeclaration: return Interpreter::VisitEnumDeclaration(static_cast<EnumDeclaration const*>(node));
+		case NodeType::FunctionDeclaration: return Interpreter::VisitFunctionDeclaration(static_cast<FunctionDeclaration const*>(node));
+		case NodeType::Block: return Interpreter::VisitBlock(static_cast<BlockExpression const*>(node));
+		case NodeType::Assign: return Interpreter::VisitAssign(static_cast<AssignExpression const*>(node));
+		case NodeType::AssignIndex: return Interpreter::VisitAssignIndex(static_cast<AssignIndexExpression const*>(node));
+		case NodeType::AssignMember: return Interpreter::VisitAssignMember(static_cast<AssignMemberExpression const*>(node));
+		case NodeType::IfThenElse: return Interpreter::VisitIfThenElse(static_cast<IfThenElseExpression const*>(node));
+		case NodeType::Postfix: return Interpreter::VisitPostfix(static_cast<PostfixExpression const*>(node));
+		case NodeType::Binary: return Interpreter::VisitBinary(static_cast<BinaryExpression const*>(node));
+		case NodeType::Unary: return Interpreter::VisitUnary(static_cast<UnaryExpression const*>(node));
+		case NodeType::Literal: return Interpreter::VisitLiteral(static_cast<LiteralExpression const*>(node));
+		case NodeType::Name: return Interpreter::VisitName(static_cast<NameExpression const*>(node));
+		case NodeType::InvokeFunction: return Interpreter::VisitInvokeFunction(static_cast<InvokeFunctionExpression const*>(node));
+		case NodeType::AnonymousFunction: return Interpreter::VisitAnonymousFunction(static_cast<AnonymousFunctionExpression const*>(node));
+		case NodeType::Array: return Interpreter::VisitArray(static_cast<ArrayExpression const*>(node));
+		case NodeType::Dictionary: return Interpreter::VisitDictionary(static_cast<DictionaryExpression const*>(node));
+		case NodeType::Index: return Interpreter::VisitIndex(static_cast<IndexExpression const*>(node));
+		case NodeType::Member: return Interpreter::VisitMember(static_cast<MemberExpression const*>(node));
+	}
 	return node->Accept(this);
 }
 
-Value Interpreter::VisitLiteral(LiteralExpression const* expr) {
-	auto& lit = expr->Literal();
-	switch (lit.Type) {
-	case TokenType::Integer:
-		return get<0>(lit.Value);
-
-	case TokenType::Real:
-		return get<1>(lit.Value);
+Value const& Interpreter::EvalRef(LogoAstNode const* node, Value& temp) {
+	switch (node->Type()) {
+		case NodeType::Name: return LookupName(static_cast<NameExpression const*>(node));
+		case NodeType::Literal: return static_cast<LiteralExpression const*>(node)->Constant();
+		default: break;
+	}
+	temp = Eval(node);
+	return temp;
+}
+
+void Interpreter::Exec(LogoAstNode const* node) {
+	switch (node->Type()) {
+		case NodeType::ExpressionStatement: Exec(static_cast<ExpressionStatement const*>(node)->Expr()); return;
+		case NodeType::Assign: Assign(static_cast<AssignExpression const*>(node), nullptr); return;
+		case NodeType::AssignIndex: AssignIndex(static_cast<AssignIndexExpression const*>(node), nullptr); return;
+		case NodeType::AssignMember: AssignMember(static_cast<AssignMemberExpression const*>(node), nullptr); return;
+
+		case NodeType::Block:
+			for (auto& expr : static_cast<BlockExpression const*>(node)->Expressions()) {
+				Exec(expr.get());
+				if (m_Completion != Completion::Normal)
+					break;
+			}
+			return;
+
+		case NodeType::IfThenElse:
+		{
+			auto expr = static_cast<IfThenElseExpression const*>(node);
+			Value temp;
+			if (EvalRef(expr->Condition(), temp).ToBoolean())
+				ExecScoped(expr->Then());
+			else if (expr->Else())
+				ExecScoped(expr->Else());
+			return;
+		}
+		default: break;
+	}
+	Eval(node);
+}
 
-	case TokenType::String:
-		return lit.Lexeme;
+Value Interpreter::VisitLiteral(LiteralExpression const* expr) {
+	return expr->Constant();
+}
 
-	case TokenType::Keyword_True:
-		return true;
+Value Interpreter::VisitBinary(BinaryExpression const* expr) {
+	//
+	// the right operand is used as is; the left one too, unless evaluating the right one could change it
+	//
+	Value leftTemp, rightTemp;
+	auto& left = expr->Right()->IsPure() ? EvalRef(expr->Left(), leftTemp) : (leftTemp = Eval(expr->Left()));
+	auto& right = EvalRef(expr->Right(), rightTemp);
 
-	case TokenType::Keyword_False:
-		return false;
+	//
+	// a site that has settled on its operand types runs its specialized handler
+	// as long as the types still match, otherwise it falls back to the generic operators
+	//
+	auto& feedback = expr->Feedback();
+	if (feedback.Specialized) {
+		if (feedback.Matches(left.Index(), right.Index()))
+			return feedback.Specialized(left, right);
+		feedback.Deoptimize();
 	}
-	return {};
-}
+	else if (feedback.Record(left.Index(), right.Index()))
+		feedback.Specialize(Quickening::SpecializeBinary(expr->Operator().Type, left.Index(), right.Index()));
 
-Value Interpreter::VisitBinary(BinaryExpression const* expr) {
 	switch (expr->Operator().Type) {
-	case TokenType::Add: return expr->Left()->Accept(this) + expr->Right()->Accept(this);
-	case TokenType::Sub: return expr->Left()->Accept(this) - expr->Right()->Accept(this);
-	case TokenType::Mul: return expr->Left()->Accept(this) * expr->Right()->Accept(this);
-	case TokenType::Div: return expr->Left()->Accept(this) / expr->Right()->Accept(this);
-	case TokenType::Power: return expr->Left()->Accept(this).Power(expr->Right()->Accept(this));
-	case TokenType::Mod: return expr->Left()->Accept(this) % expr->Right()->Accept(this);
-	case TokenType::And: return expr->Left()->Accept(this) & expr->Right()->Accept(this);
-	case TokenType::Or: return expr->Left()->Accept(this) | expr->Right()->Accept(this);
-	case TokenType::Xor: return expr->Left()->Accept(this) ^ expr->Right()->Accept(this);
-	case TokenType::Equal: return expr->Left()->Accept(this) == expr->Right()->Accept(this);
-	case TokenType::NotEqual: return expr->Left()->Accept(this) != expr->Right()->Accept(this);;
-	case TokenType::LessThan: return expr->Left()->Accept(this) < expr->Right()->Accept(this);
-	case TokenType::LessThanOrEqual: return expr->Left()->Accept(this) <= expr->Right()->Accept(this);
-	case TokenType::GreaterThan: return expr->Left()->Accept(this) > expr->Right()->Accept(this);
-	case TokenType::GreaterThanOrEqual: return expr->Left()->Accept(this) >= expr->Right()->Accept(this);
+	case TokenType::Add: return left + right;
+	case TokenType::Sub: return left - right;
+	case TokenType::Mul: return left * right;
+	case TokenType::Div: return left / right;
+	case TokenType::Power: return left.Power(right);
+	case TokenType::Mod: return left % right;
+	case TokenType::And: return left & right;
+	case TokenType::Or: return left | right;
+	case TokenType::Xor: return left ^ right;
+	case TokenType::Equal: return left == right;
+	case TokenType::NotEqual: return left != right;
+	case TokenType::LessThan: return left < right;
+	case TokenType::LessThanOrEqual: return left <= right;
+	case TokenType::GreaterThan: return left > right;
+	case TokenType::GreaterThanOrEqual: return left >= right;
+	default: break;
 	}
-	return Value();
+	throw RuntimeError(ErrorType::UndefinedOperator, expr);
 }
 
 Value Interpreter::VisitUnary(UnaryExpression const* expr) {
-	auto value = expr->Arg()->Accept(this);
+	Value temp;
+	auto& value = EvalRef(expr->Arg(), temp);
+	auto& feedback = expr->Feedback();
+	if (feedback.Specialized) {
+		if (feedback.Matches(value.Index()))
+			return feedback.Specialized(value);
+		feedback.Deoptimize();
+	}
+	else if (feedback.Record(value.Index()))
+		feedback.Specialize(Quickening::SpecializeUnary(expr->Operator().Type, value.Index()));
+
 	switch (expr->Operator().Type) {
 	case TokenType::Sub: return -value;
 	case TokenType::Add: return value;
 	case TokenType::Not: return !value;
+	default: break;
 	}
 	throw RuntimeError(ErrorType::UndefinedOperator, expr->Arg());
 }
 
 Value Interpreter::VisitName(NameExpression const* expr) {
-	auto v = FindVariable(expr->Name());
+	return LookupName(expr);
+}
+
+Value& Interpreter::LookupName(NameExpression const* expr) {
+	if (expr->Slot().IsResolved())
+		return m_Frame->Local(expr->Slot());
+
+	auto v = FindVariable(expr->Id());
 	if (v)
 		return v->VarValue;
 	throw RuntimeError(ErrorType::UndefinedSymbol, expr);
@@ -77,24 +177,48 @@ Value Interpreter::VisitName(NameExpression const* expr) {
 Value Interpreter::VisitBlock(BlockExpression const* expr) {
 	Value result;
 	//    PushScope();
-	for (auto expr : expr->Expressions()) {
-		result = Eval(expr);
+	for (auto& expr : expr->Expressions()) {
+		result = Eval(expr.get());
+		if (m_Completion != Completion::Normal)
+			break;
 	}
 	//    PopScope();
 	return result;
 }
 
 Value Interpreter::VisitVar(VarStatement const* expr) {
-	auto value = expr->Init() ? expr->Init()->Accept(this) : Value();
+	auto value = expr->Init() ? Eval(expr->Init()) : Value();
+	if (expr->Slot() >= 0) {
+		auto slot = &m_Frame->Slots[expr->Slot()];
+		m_Stack.Redeclare(slot);
+		*slot = std::move(value);
+		return Value();
+	}
 	Variable var;
 	var.Flags = expr->IsConst() ? VariableFlags::Const : VariableFlags::None;
 	var.VarValue = std::move(value);
-	AddVariable(expr->Name(), std::move(var));
+	AddVariable(expr->Id(), std::move(var));
 	return Value();
 }
 
 Value Interpreter::VisitAssign(AssignExpression const* expr) {
-	auto v = FindVariable(expr->Variable());
+	Value result;
+	Assign(expr, &result);
+	return result;
+}
+
+void Interpreter::Assign(AssignExpression const* expr, Value* result) {
+	if (expr->Slot().IsResolved()) {
+		//
+		// the parser has already rejected assignments to const locals
+		//
+		auto value = Eval(expr->Value());
+		auto& target = m_Frame->Local(expr->Slot()) = std::move(value);
+		if (result)
+			*result = target;
+		return;
+	}
+	auto v = FindVariable(expr->Id());
 	if (v) {
 		if ((v->Flags & VariableFlags::Const) == VariableFlags::Const) {
 			//
@@ -103,7 +227,9 @@ Value Interpreter::VisitAssign(AssignExpression const* expr) {
 			throw RuntimeError(ErrorType::CannotAssignConst, expr);
 		}
 		v->VarValue = Eval(expr->Value());
-		return v->VarValue;
+		if (result)
+			*result = v->VarValue;
+		return;
 	}
 	throw RuntimeError(ErrorType::UndefinedSymbol, expr);
 }
@@ -112,55 +238,137 @@ Value Interpreter::VisitPostfix(PostfixExpression const* expr) {
 	return Value();
 }
 
-Value Interpreter::InvokeFunction(Function const& f, InvokeFunctionExpression const* expr) {
+Value Interpreter::InvokeFunction(Function const& f, InvokeFunctionExpression const* expr, Value const* callee) {
 	if (f.ArgCount != expr->Arguments().size())
 		throw RuntimeError(ErrorType::ArgumentCountMismatch, expr);
 
-	std::vector<Value> args;
-	for (auto& arg : expr->Arguments()) {
-		args.push_back(arg->Accept(this));
+	if (f.Code && expr->IsTailCall()) {
+		//
+		// arguments are evaluated on top of the running frame, the enclosing
+		// RunBody moves them down into it and runs the callee there
+		//
+		auto args = m_Stack.Allocate((int)expr->Arguments().size());
+		for (auto& arg : expr->Arguments())
+			*args++ = Eval(arg.get());
+		SetTailCallee(f, callee);
+		return {};
+	}
+
+	if (f.IsNative()) {
+		//
+		// arguments are evaluated onto the value stack and passed as a view
+		//
+		auto count = expr->Arguments().size();
+		CallScope call(*this, Frame{ m_Stack.Allocate((int)count) });
+		int i = 0;
+		for (auto& arg : expr->Arguments())
+			call.Callee.Slots[i++] = Eval(arg.get());
+		return CallNative(f, { call.Callee.Slots, count });
 	}
-	if (f.NativeCode)
-		return f.NativeCode(*this, args);
 	else if (f.Code) {
 		//
-		// bind arguments
+		// arguments are evaluated (in the caller's frame) straight into the new frame's slots;
+		// a function value is held for the call, the variable it came from may be assigned over
 		//
-		assert(f.ArgCount == args.size());
-		auto scopes = m_Scopes.size();
-		if (f.Environment)
-			m_Scopes.push(f.Environment->Clone(m_Scopes.top().get()));
-		PushScope();
-		for (int i = 0; i < f.ArgCount; i++) {
-			Variable v;
-			v.Flags = VariableFlags::None;
-			v.VarValue = std::move(args[i]);
-			AddVariable(f.Parameters[i], std::move(v));
-		}
-
-		Value result;
-		try {
-			result = Eval(f.Code);
-		}
-		catch (Return const& ret) {
-			result = ret.ReturnValue->Accept(this);
-		}
-		while (m_Scopes.size() > scopes)
-			PopScope();
-		return result;
+		Value keep = callee ? *callee : Value();
+		CallScope call(*this, Frame{ m_Stack.Allocate(f.FrameSize), &f.Upvalues });
+		int i = 0;
+		for (auto& arg : expr->Arguments())
+			call.Callee.Slots[i++] = Eval(arg.get());
+		call.Enter();
+		return RunBody(f, call);
 	}
 	assert(false);
 	return {};
 }
 
+Value Interpreter::Call(Function const& f, std::span<const Value> args) {
+	if (f.ArgCount != (int)args.size())
+		throw RuntimeError(ErrorType::ArgumentCountMismatch);
+
+	if (f.IsNative())
+		return CallNative(f, args);
+	if (!f.Code)
+		throw RuntimeError(ErrorType::NotCallable);
+
+	CallScope call(*this, Frame{ m_Stack.Allocate(f.FrameSize), &f.Upvalues });
+	std::copy(args.begin(), args.end(), call.Callee.Slots);
+	call.Enter();
+	return RunBody(f, call);
+}
+
+Value Interpreter::TailCall(Function const& f, std::span<const Value> args, Value const* callee) {
+	//
+	// as Call, except that a user function called from a function body is left to the enclosing RunBody
+	//
+	if (f.IsNative() || !f.Code || !m_Frame)
+		return Call(f, args);
+	if (f.ArgCount != (int)args.size())
+		throw RuntimeError(ErrorType::ArgumentCountMismatch);
+
+	std::copy(args.begin(), args.end(), m_Stack.Allocate((int)args.size()));
+	SetTailCallee(f, callee);
+	return {};
+}
+
+void Interpreter::SetTailCallee(Function const& f, Value const* callee) {
+	m_TailCallee = &f;
+	if (callee)
+		m_TailCalleeValue = *callee;
+	m_Completion = Completion::TailCall;
+}
+
+Value Interpreter::RunBody(Function const& f, CallScope& call) {
+	auto result = Execute(f);
+	Value current;
+	while (m_Completion == Completion::TailCall) {
+		//
+		// the frame is reused for each call in tail position, so tail recursion runs in constant space
+		//
+		m_Completion = Completion::Normal;
+		auto next = m_TailCallee;
+		current = std::exchange(m_TailCalleeValue, {});
+		m_Stack.Reuse(call.Callee.Slots, next->ArgCount, next->FrameSize);
+		call.Callee.Upvalues = &next->Upvalues;
+		result = Execute(*next);
+	}
+	if (m_Completion == Completion::Return) {
+		m_Completion = Completion::Normal;
+		result = std::move(m_ReturnValue);
+	}
+	return result;
+}
+
+Value Interpreter::Execute(Function const& f) {
+	//
+	// runs the body of f in the current frame, natively once it is hot
+	//
+	if (m_Jit) {
+		if (auto code = m_Jit->OnCall(f.Code, f.FrameSize))
+			return m_Jit->Run(*code, m_Frame);
+	}
+	return Eval(f.Code);
+}
+
 Value Interpreter::VisitInvokeFunction(InvokeFunctionExpression const* expr) {
-	if (auto it = m_Functions.find(expr->Name()); it != m_Functions.end()) {
-		return InvokeFunction(it->second, expr);
+	if (expr->Slot().IsResolved()) {
+		//
+		// a local variable shadows functions of the same name
+		//
+		auto& local = m_Frame->Local(expr->Slot());
+		if (local.IsFunction())
+			return InvokeFunction(*local.Func(), expr, &local);
+		throw RuntimeError(ErrorType::NotCallable, expr);
 	}
-	auto var = FindVariable(expr->Name());
+	if (auto f = FindFunction(expr->Id(), expr->Cache()); f)
+		return InvokeFunction(*f, expr);
+	if (expr->IsBound())
+		throw RuntimeError(ErrorType::UndefinedFunction, expr);
+
+	auto var = FindVariable(expr->Id());
 	if (var) {
 		if (var->VarValue.IsFunction())
-			return InvokeFunction(*(var->VarValue.Func()), expr);
+			return InvokeFunction(*(var->VarValue.Func()), expr, &var->VarValue);
 		throw RuntimeError(ErrorType::NotCallable, expr);
 	}
 	throw RuntimeError(ErrorType::UndefinedFunction);
@@ -172,163 +380,500 @@ Value Interpreter::VisitRepeat(RepeatStatement const* expr) {
 		throw RuntimeError(ErrorType::TypeMismatch, expr->Count());
 
 	auto n = count.Integer();
-	PushScope();
+	if (m_Jit && n > 0) {
+		if (auto code = m_Jit->OnLoop(expr, n, !m_Frame)) {
+			bool completed;
+			auto result = m_Jit->RunLoop(*code, m_Frame, n, completed);
+			if (!completed) {
+				m_ReturnValue = std::move(result);
+				m_Completion = Completion::Return;
+			}
+			return {};
+		}
+	}
 	while (n-- > 0) {
-		Eval(expr->Block());
-		if (m_LoopResult == LoopResult::Break) {
-			m_LoopResult = LoopResult::None;
+		ExecScoped(expr->Block());
+		if (ExitLoop())
 			break;
-		}
-		if (m_LoopResult == LoopResult::Continue) {
-			m_LoopResult = LoopResult::None;
-			continue;
-		}
 	}
-	PopScope();
 	return {};     // repeat has no return value
 }
 
 Value Interpreter::VisitWhile(WhileStatement const* stmt) {
-	while (Eval(stmt->Condition()).ToBoolean()) {
-		PushScope();
-		Eval(stmt->Body());
-		if (m_LoopResult == LoopResult::Break) {
-			m_LoopResult = LoopResult::None;
+	Value temp;
+	while (EvalRef(stmt->Condition(), temp).ToBoolean()) {
+		ExecScoped(stmt->Body());
+		if (ExitLoop())
 			break;
-		}
-		if (m_LoopResult == LoopResult::Continue) {
-			m_LoopResult = LoopResult::None;
-			continue;
-		}
 	}
-	PopScope();
 	return Value();
 }
 
 Value Interpreter::VisitIfThenElse(IfThenElseExpression const* expr) {
-	Value result;
-	if (Eval(expr->Condition()).ToBoolean()) {
-		PushScope();
-		result = Eval(expr->Then());
-		PopScope();
-	}
-	else if (expr->Else()) {
-		PushScope();
-		result = Eval(expr->Else());
-		PopScope();
-	}
+	Value temp;
+	if (EvalRef(expr->Condition(), temp).ToBoolean())
+		return EvalScoped(expr->Then());
+	if (expr->Else())
+		return EvalScoped(expr->Else());
+	return Value();
+}
+
+Value Interpreter::EvalScoped(LogoAstNode const* node) {
+	//
+	// inside a function every variable lives in a frame slot,
+	// only top level blocks need a scope of their own
+	//
+	if (m_Frame)
+		return Eval(node);
+
+	PushScope();
+	auto result = Eval(node);
+	PopScope();
 	return result;
 }
 
+void Interpreter::ExecScoped(LogoAstNode const* node) {
+	if (m_Frame) {
+		Exec(node);
+		return;
+	}
+
+	PushScope();
+	Exec(node);
+	PopScope();
+}
+
 Value Interpreter::VisitFunctionDeclaration(FunctionDeclaration const* decl) {
 	Function f;
 	f.ArgCount = (int)decl->Parameters().size();
 	f.Code = decl->Body();
 	f.Parameters = decl->Parameters();
-	m_Functions.try_emplace(decl->Name(), std::move(f));
+	f.FrameSize = decl->FrameSize();
+	f.Upvalues = m_Stack.CaptureAll(m_Frame, decl->Captures(), CurrentScope());
+	AddFunction(decl->Id(), std::move(f));
 
 	return Value();
 }
 
 Value Interpreter::VisitReturn(ReturnStatement const* stmt) {
-	throw Return(stmt->ReturnValue());
+	auto value = stmt->ReturnValue() ? Eval(stmt->ReturnValue()) : Value();
+	if (m_Completion == Completion::TailCall)
+		return {};		// the call itself is still to be made
+	m_ReturnValue = std::move(value);
+	m_Completion = Completion::Return;
+	return {};
 }
 
 Value Interpreter::VisitBreakContinue(BreakOrContinueStatement const* stmt) {
-	if (stmt->IsContinue())
-		m_LoopResult = LoopResult::Continue;
-	else
-		m_LoopResult = LoopResult::Break;
+	m_Completion = stmt->IsContinue() ? Completion::Continue : Completion::Break;
 	return {};
 }
 
+bool Interpreter::ExitLoop() {
+	switch (m_Completion) {
+		case Completion::Break:
+			m_Completion = Completion::Normal;
+			return true;
+
+		case Completion::Continue:
+			m_Completion = Completion::Normal;
+			return false;
+
+		case Completion::Return:
+		case Completion::TailCall:
+			return true;
+
+		case Completion::Normal:
+			break;
+	}
+	return false;
+}
+
 Value Interpreter::VisitFor(ForStatement const* stmt) {
-	for (Eval(stmt->Init()); Eval(stmt->While()).ToBoolean(); Eval(stmt->Inc())) {
-		Eval(stmt->Body());
-		if (m_LoopResult == LoopResult::Break) {
-			m_LoopResult = LoopResult::None;
+	//
+	// as the parser scopes it: the init variable in a scope of its own for the whole loop,
+	// the body in a fresh one each time around, like the bodies of repeat and while
+	//
+	if (!m_Frame)
+		PushScope();
+	Value temp;
+	for (Exec(stmt->Init()); EvalRef(stmt->While(), temp).ToBoolean(); Exec(stmt->Inc())) {
+		ExecScoped(stmt->Body());
+		if (ExitLoop())
 			break;
-		}
-		if (m_LoopResult == LoopResult::Continue) {
-			m_LoopResult = LoopResult::None;
-			continue;
-		}
 	}
+	if (!m_Frame)
+		PopScope();
 	return {};
 }
 
 Value Interpreter::VisitStatements(Statements const* stmts) {
+	//
+	// the value of the script is the one of its last statement
+	//
 	Value result;
-	for (auto& stmt : stmts->Get())
-		result = Eval(stmt.get());
+	auto& list = stmts->Get();
+	for (size_t i = 0; i < list.size(); i++) {
+		if (i + 1 < list.size())
+			Exec(list[i].get());
+		else
+			result = Eval(list[i].get());
+		if (m_Completion == Completion::Return) {
+			//
+			// return at the top level ends the script
+			//
+			m_Completion = Completion::Normal;
+			return std::move(m_ReturnValue);
+		}
+	}
 	return result;
 }
 
 Value Interpreter::VisitAnonymousFunction(AnonymousFunctionExpression const* func) {
-	auto f = std::make_shared<Function>();
+	auto f = MakeRef<Function>();
 	f->ArgCount = (int)func->Args().size();
 	f->Code = func->Body();
 	f->Parameters = func->Args();
-	f->Environment = m_Scopes.top()->Clone();
+	f->FrameSize = func->FrameSize();
+	f->Upvalues = m_Stack.CaptureAll(m_Frame, func->Captures(), CurrentScope());
 
-	return Value(f);
+	return Value(std::move(f));
 }
 
 bool Interpreter::AddNativeFunction(std::string name, int arity, NativeFunction nf) {
 	Function f;
 	f.ArgCount = arity;
 	f.NativeCode = nf;
-	return m_Functions.insert({ std::move(name), std::move(f) }).second;
+	return AddFunction(AtomTable::Intern(name), std::move(f));
 }
 
-bool Interpreter::AddVariable(std::string name, Variable var) {
-	return m_Scopes.top()->AddVariable(std::move(name), std::move(var));
+bool Interpreter::AddNativeFunction(std::string name, int arity, NativeCall nc, void* context) {
+	Function f;
+	f.ArgCount = arity;
+	f.Native = nc;
+	f.Context = context;
+	return AddFunction(AtomTable::Intern(name), std::move(f));
 }
 
-Variable const* Interpreter::FindVariable(std::string const& name) const {
-	return m_Scopes.top()->FindVariable(name);
+Value Interpreter::CallNative(Function const& f, std::span<const Value> args) {
+	assert(f.IsNative());
+	if (f.Native)
+		return f.Native(*this, f.Context, args);
+
+	//
+	// a std::function native gets its own copy of the arguments, in a vector kept for its nesting level
+	// (a native may call back into code calling natives) so its capacity is reused by the next call
+	//
+	struct Nesting {
+		Interpreter& Inter;
+		std::vector<Value>& Args;
+
+		~Nesting() {
+			Args.clear();
+			Inter.m_NativeDepth--;
+		}
+	};
+
+	if (m_NativeDepth == m_NativeArgs.size())
+		m_NativeArgs.emplace_back();
+	Nesting nesting{ *this, m_NativeArgs[m_NativeDepth++] };
+	nesting.Args.assign(args.begin(), args.end());
+	return f.NativeCode(*this, nesting.Args);
+}
+
+bool Interpreter::AddFunction(Atom name, Function f) {
+	if (!m_Functions.TryEmplace(name, std::move(f)).second)
+		return false;
+	m_FunctionEpoch++;
+	return true;
+}
+
+Function const* Interpreter::FindFunction(Atom name) const {
+	return m_Functions.Find(name);
 }
 
-Variable* Interpreter::FindVariable(std::string const& name) {
-	return m_Scopes.top()->FindVariable(name);
+Function const* Interpreter::FindFunction(Atom name, CallCache& cache) const {
+	if (cache.Owner != this || cache.Epoch != m_FunctionEpoch) {
+		cache.Target = FindFunction(name);
+		cache.Owner = this;
+		cache.Epoch = m_FunctionEpoch;
+	}
+	return cache.Target;
+}
+
+bool Interpreter::AddVariable(Atom name, Variable var) {
+	return CurrentScope()->AddVariable(name, std::move(var));
+}
+
+Variable const* Interpreter::FindVariable(Atom name) const {
+	return CurrentScope()->FindVariable(name);
+}
+
+Variable* Interpreter::FindVariable(Atom name) {
+	return CurrentScope()->FindVariable(name);
 }
 
 void Interpreter::PushScope() {
-	m_Scopes.push(std::make_unique<Scope>(m_Scopes.top().get()));
+	//
+	// a scope pushed at a given depth always has the same parent, so it can be reused as is
+	//
+	if (m_ScopeDepth == m_Scopes.size())
+		m_Scopes.push_back(std::make_unique<Scope>(m_Heap.Resource(), CurrentScope()));
+	m_ScopeDepth++;
 }
 
 void Interpreter::PopScope() {
-	m_Scopes.pop();
+	assert(m_ScopeDepth > 1);
+	m_Scopes[--m_ScopeDepth]->Clear();
 }
 
-Scope::Scope(Scope* parent) : m_Parent(parent) {
+size_t Interpreter::ScopeDepth() const {
+	return m_ScopeDepth;
 }
 
-bool Scope::AddVariable(std::string name, Variable var) {
-	return m_Variables.insert({ std::move(name), std::move(var) }).second;
+Scope* Interpreter::CurrentScope() const {
+	return m_Scopes[m_ScopeDepth - 1].get();
 }
 
-Variable const* Scope::FindVariable(std::string const& name) const {
-	if (auto it = m_Variables.find(name); it != m_Variables.end())
-		return &it->second;
+ValueStack& Interpreter::Stack() {
+	return m_Stack;
+}
 
-	return m_Parent ? m_Parent->FindVariable(name) : nullptr;
+Heap& Interpreter::GetHeap() {
+	return m_Heap;
+}
+
+void Interpreter::EnableJit(bool enable) {
+	if (!enable)
+		m_Jit.reset();
+	else if (!m_Jit && Jit::IsSupported())
+		m_Jit = std::make_unique<Jit>(*this);
+}
+
+Jit const* Interpreter::GetJit() const {
+	return m_Jit.get();
+}
+
+Interpreter::CallScope::CallScope(Interpreter& inter, Frame frame) : Inter(inter), Caller(inter.m_Frame), Callee(frame) {
+}
+
+Interpreter::CallScope::~CallScope() {
+	Inter.m_Frame = Caller;
+	Inter.m_Stack.Release(Callee.Slots);
+}
+
+void Interpreter::CallScope::Enter() {
+	Inter.m_Frame = &Callee;
+}
+
+void Upvalue::Close() {
+	Closed = std::move(*Location);
+	Location = &Closed;
+}
+
+Value& Frame::Local(LocalSlot const& slot) const {
+	if (slot.IsUpvalue)
+		return *(*Upvalues)[slot.Index]->Location;
+	return Slots[slot.Index];
+}
+
+ValueStack::ValueStack(size_t capacity) : m_Values(std::make_unique<Value[]>(capacity)) {
+	m_Top = m_Values.get();
+	m_End = m_Top + capacity;
+}
+
+Value* ValueStack::Top() const {
+	return m_Top;
+}
+
+Value* ValueStack::Allocate(int count) {
+	if (m_End - m_Top < count)
+		throw RuntimeError(ErrorType::StackOverflow);
+	auto slots = m_Top;
+	m_Top += count;
+	return slots;
+}
+
+void ValueStack::Release(Value* top) {
+	//
+	// close the upvalues of the released slots, then reset the slots so the
+	// values they hold are freed now and the next frame starts out null
+	//
+	CloseUpvalues(top);
+	while (m_Top > top)
+		*--m_Top = Value();
+}
+
+void ValueStack::Reuse(Value* slots, int count, int frameSize) {
+	//
+	// the frame at slots becomes a fresh frame of frameSize slots whose first
+	// count slots take the values on top of the stack
+	//
+	auto args = m_Top - count;
+	CloseUpvalues(slots);
+	for (int i = 0; i < count; i++)
+		slots[i] = std::move(args[i]);
+	while (m_Top > slots + count)
+		*--m_Top = Value();
+	if (m_End - m_Top < frameSize - count)
+		throw RuntimeError(ErrorType::StackOverflow);
+	m_Top = slots + frameSize;
+}
+
+void ValueStack::CloseUpvalues(Value* top) {
+	if (!m_Open.empty()) {
+		std::erase_if(m_Open, [=](auto& up) {
+			if (up->Location < top)
+				return false;
+			up->Close();
+			return true;
+		});
+	}
 }
 
-Variable* Scope::FindVariable(std::string const& name) {
-	if (auto it = m_Variables.find(name); it != m_Variables.end())
-		return &it->second;
+UpvalueList ValueStack::CaptureAll(Frame const* frame, std::vector<Capture> const& captures, Scope const* scope) {
+	//
+	// frame is null at top level, where only variables of blocks (by name) are captured
+	//
+	UpvalueList upvalues(Heap::CurrentResource());
+	upvalues.reserve(captures.size());
+	for (auto& capture : captures) {
+		if (capture.Name != Atom::None)
+			upvalues.push_back(CaptureValue(scope, capture.Name));
+		else
+			upvalues.push_back(capture.FromLocal ? CaptureSlot(frame->Slots + capture.Index) : (*frame->Upvalues)[capture.Index]);
+	}
+	return upvalues;
+}
+
+std::shared_ptr<Upvalue> ValueStack::CaptureValue(Scope const* scope, Atom name) {
+	//
+	// a variable of a top-level block lives in a scope that is gone when the closure runs,
+	// so the upvalue starts out closed over a copy of it
+	//
+	auto var = scope->FindVariable(name);
+	if (var == nullptr)
+		throw RuntimeError(ErrorType::UndefinedSymbol, nullptr, AtomTable::Name(name));
+
+	auto up = std::allocate_shared<Upvalue>(std::pmr::polymorphic_allocator<Upvalue>(Heap::CurrentResource()));
+	up->Closed = var->VarValue;
+	up->Location = &up->Closed;
+	return up;
+}
+
+void ValueStack::Redeclare(Value* slot) {
+	//
+	// a var statement executed again (e.g. in a loop) starts a new variable,
+	// closures created so far keep the previous one
+	//
+	if (m_Open.empty())
+		return;
+	for (auto it = m_Open.begin(); it != m_Open.end(); ++it) {
+		if ((*it)->Location == slot) {
+			(*it)->Close();
+			m_Open.erase(it);
+			break;
+		}
+	}
+}
+
+std::shared_ptr<Upvalue> ValueStack::CaptureSlot(Value* slot) {
+	for (auto& up : m_Open)
+		if (up->Location == slot)
+			return up;
+
+	auto up = std::allocate_shared<Upvalue>(std::pmr::polymorphic_allocator<Upvalue>(Heap::CurrentResource()));
+	up->Location = slot;
+	m_Open.push_back(up);
+	return up;
+}
+
+Scope::Scope(std::pmr::memory_resource* resource, Scope* parent) : m_Variables(resource), m_Parent(parent) {
+}
+
+void Scope::Clear() {
+	m_Variables.Clear();
+}
+
+bool Scope::AddVariable(Atom name, Variable var) {
+	return m_Variables.TryEmplace(name, std::move(var)).second;
+}
+
+Variable const* Scope::FindVariable(Atom name) const {
+	if (auto var = m_Variables.Find(name))
+		return var;
 
 	return m_Parent ? m_Parent->FindVariable(name) : nullptr;
 }
 
-std::unique_ptr<Scope> Logo2::Scope::Clone(Scope* parent) const {
-	auto scope = std::make_unique<Scope>(*this);
-	if(parent)
-		scope->m_Parent = parent;
-	return scope;
+Variable* Scope::FindVariable(Atom name) {
+	if (auto var = m_Variables.Find(name))
+		return var;
+
+	return m_Parent ? m_Parent->FindVariable(name) : nullptr;
 }
 
 Value Logo2::Interpreter::VisitEnumDeclaration(EnumDeclaration const* decl) {
 	return {};
 }
+
+Value Interpreter::VisitArray(ArrayExpression const* expr) {
+	std::vector<Value> values;
+	values.reserve(expr->Elements().size());
+	for (auto& element : expr->Elements())
+		values.push_back(Eval(element.get()));
+	return Value(MakeRef<ArrayValue>(std::move(values)));
+}
+
+Value Interpreter::VisitDictionary(DictionaryExpression const* expr) {
+	auto dictionary = MakeRef<DictionaryValue>(expr->Entries().size());
+	for (auto& [key, value] : expr->Entries()) {
+		auto k = Eval(key.get());
+		dictionary->Set(k, Eval(value.get()));
+	}
+	return Value(std::move(dictionary));
+}
+
+Value Interpreter::VisitIndex(IndexExpression const* expr) {
+	Value containerTemp, indexTemp;
+	auto& container = expr->Index()->IsPure() ? EvalRef(expr->Container(), containerTemp) : (containerTemp = Eval(expr->Container()));
+	return container.Element(EvalRef(expr->Index(), indexTemp));
+}
+
+Value Interpreter::VisitMember(MemberExpression const* expr) {
+	Value temp;
+	return EvalRef(expr->Object(), temp).Object()->Get(expr->Field(), expr->Cache());
+}
+
+Value Interpreter::VisitAssignMember(AssignMemberExpression const* expr) {
+	Value result;
+	AssignMember(expr, &result);
+	return result;
+}
+
+void Interpreter::AssignMember(AssignMemberExpression const* expr, Value* result) {
+	auto target = expr->Target();
+	Value objectTemp;
+	auto& object = expr->Value()->IsPure() ? EvalRef(target->Object(), objectTemp) : (objectTemp = Eval(target->Object()));
+	auto value = Eval(expr->Value());
+	if (result)
+		*result = value;
+	object.Object()->Set(target->Field(), target->Cache(), std::move(value));
+}
+
+Value Interpreter::VisitAssignIndex(AssignIndexExpression const* expr) {
+	Value result;
+	AssignIndex(expr, &result);
+	return result;
+}
+
+void Interpreter::AssignIndex(AssignIndexExpression const* expr, Value* result) {
+	Value containerTemp, indexTemp;
+	auto pure = expr->Value()->IsPure();
+	auto& container = pure && expr->Target()->Index()->IsPure() ? EvalRef(expr->Target()->Container(), containerTemp) : (containerTemp = Eval(expr->Target()->Container()));
+	auto& index = pure ? EvalRef(expr->Target()->Index(), indexTemp) : (indexTemp = Eval(expr->Target()->Index()));
+	auto value = Eval(expr->Value());
+	if (result)
+		*result = value;
+	container.SetElement(index, std::move(value));
+}
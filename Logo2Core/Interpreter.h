@@ -3,12 +3,16 @@
 #include "Logo2Ast.h"
 #include "Value.h"
 #include "Logo2Core.h"
-#include <stack>
 #include "Visitor.h"
 #include "TypeObject.h"
+#include "NativeBinding.h"
+#include "Heap.h"
+#include "FlatMap.h"
+#include <deque>
 
 namespace Logo2 {
 	class Interpreter;
+	class Jit;
 
 	enum class VariableFlags {
 		None,
@@ -22,19 +26,66 @@ namespace Logo2 {
 	};
 
 	struct Scope {
-		explicit Scope(Scope* parent = nullptr);
-		bool AddVariable(std::string name, Variable var);
-		Variable const* FindVariable(std::string const& name) const;
-		Variable* FindVariable(std::string const& name);
-		std::unique_ptr<Scope> Clone(Scope* parent = nullptr) const;
+		explicit Scope(std::pmr::memory_resource* resource, Scope* parent = nullptr);
+		bool AddVariable(Atom name, Variable var);
+		Variable const* FindVariable(Atom name) const;
+		Variable* FindVariable(Atom name);
+		void Clear();
 
 	private:
-		std::unordered_map<std::string, Variable> m_Variables;
+		FlatMap<Atom, Variable> m_Variables;
 		Scope* m_Parent;
 	};
 
-	struct Return {
-		Expression const* ReturnValue;
+	//
+	// a captured variable: points into the frame that declared it while that frame is live,
+	// owns the value once the frame is gone (closed)
+	//
+	struct Upvalue {
+		Value* Location{ nullptr };
+		Value Closed;
+
+		void Close();
+	};
+
+	//
+	// activation record of a user function, locals are addressed by the slots the parser assigned
+	// Slots is a window of the ValueStack, Upvalues are the captures of the running closure
+	//
+	struct Frame {
+		Value* Slots{ nullptr };
+		UpvalueList const* Upvalues{ nullptr };
+
+		Value& Local(LocalSlot const& slot) const;
+	};
+
+	//
+	// contiguous storage for the slots of all active frames, so entering and leaving a frame
+	// is a pointer bump; the capacity is fixed because open upvalues point into it
+	//
+	class ValueStack {
+	public:
+		static constexpr size_t DefaultCapacity = 1 << 16;
+
+		explicit ValueStack(size_t capacity = DefaultCapacity);
+
+		Value* Top() const;
+		Value* Allocate(int count);
+		void Release(Value* top);
+		void Reuse(Value* slots, int count, int frameSize);
+
+		UpvalueList CaptureAll(Frame const* frame, std::vector<Capture> const& captures, Scope const* scope);
+		std::shared_ptr<Upvalue> CaptureValue(Scope const* scope, Atom name);
+		void Redeclare(Value* slot);
+
+	private:
+		std::shared_ptr<Upvalue> CaptureSlot(Value* slot);
+		void CloseUpvalues(Value* top);
+
+		std::unique_ptr<Value[]> m_Values;
+		Value* m_Top;
+		Value* m_End;
+		std::vector<std::shared_ptr<Upvalue>> m_Open;		// upvalues pointing into live slots
 	};
 
 	struct QuitAppException {
@@ -44,6 +95,7 @@ namespace Logo2 {
 	class Interpreter : public Visitor {
 	public:
 		Interpreter();
+		~Interpreter();
 		Value Eval(LogoAstNode const* node);
 
 		Value VisitLiteral(LiteralExpression const* expr) override;
@@ -65,26 +117,132 @@ namespace Logo2 {
 		Value VisitStatements(Statements const* stmts) override;
 		Value VisitAnonymousFunction(AnonymousFunctionExpression const* func) override;
 		Value VisitEnumDeclaration(EnumDeclaration const* decl) override;
+		Value VisitArray(ArrayExpression const* expr) override;
+		Value VisitDictionary(DictionaryExpression const* expr) override;
+		Value VisitIndex(IndexExpression const* expr) override;
+		Value VisitAssignIndex(AssignIndexExpression const* expr) override;
+		Value VisitMember(MemberExpression const* expr) override;
+		Value VisitAssignMember(AssignMemberExpression const* expr) override;
 
 		bool AddNativeFunction(std::string name, int arity, NativeFunction f);
-		bool AddVariable(std::string name, Variable var);
-		Variable const* FindVariable(std::string const& name) const;
-		Variable* FindVariable(std::string const& name);
-		Value InvokeFunction(Function const& f, InvokeFunctionExpression const* expr);
+		bool AddNativeFunction(std::string name, int arity, NativeCall f, void* context);
+
+		//
+		// AddNative<&Free>("name") or AddNative<&Class::Method>("name", object)
+		//
+		template<auto F>
+		bool AddNative(std::string name) {
+			using Binder = Native::Binder<F>;
+			return AddNativeFunction(std::move(name), Binder::Arity, &Binder::Call, nullptr);
+		}
+
+		template<auto F>
+		bool AddNative(std::string name, typename Native::Binder<F>::Class* object) {
+			using Binder = Native::Binder<F>;
+			return AddNativeFunction(std::move(name), Binder::Arity, &Binder::Call, const_cast<void*>(static_cast<void const*>(object)));
+		}
+
+		Value CallNative(Function const& f, std::span<const Value> args);
+		bool AddFunction(Atom name, Function f);
+		Function const* FindFunction(Atom name) const;
+		Function const* FindFunction(Atom name, CallCache& cache) const;
+		bool AddVariable(Atom name, Variable var);
+		Variable const* FindVariable(Atom name) const;
+		Variable* FindVariable(Atom name);
+		Value InvokeFunction(Function const& f, InvokeFunctionExpression const* expr, Value const* callee = nullptr);
+		Value Call(Function const& f, std::span<const Value> args);
+		Value TailCall(Function const& f, std::span<const Value> args, Value const* callee = nullptr);
+
+		//
+		// tier hot functions and loops up to native code (where supported)
+		//
+		void EnableJit(bool enable);
+		Jit const* GetJit() const;
+
+		void PushScope();
+		void PopScope();
+		size_t ScopeDepth() const;
+		Scope* CurrentScope() const;
+		ValueStack& Stack();
+		Heap& GetHeap();
 
 	private:
-		enum class LoopResult {
-			None,
+		//
+		// how the last statement completed; anything but Normal makes the enclosing
+		// blocks stop and unwind to the loop or function that consumes it
+		//
+		enum class Completion {
+			Normal,
 			Break,
-			Continue
+			Continue,
+			Return,
+			TailCall,		// m_TailCallee is to be called in place of the running function
 		};
-		void PushScope();
-		void PopScope();
 
-		std::stack<std::unique_ptr<Scope>> m_Scopes;
-		std::unordered_map<std::string, Function> m_Functions;
-		LoopResult m_LoopResult{ LoopResult::None };
+		//
+		// makes a new frame current for the duration of a call and releases its slots,
+		// also when unwinding from an error
+		//
+		struct CallScope {
+			CallScope(Interpreter& inter, Frame frame);
+			~CallScope();
+			CallScope(CallScope const&) = delete;
+			CallScope& operator=(CallScope const&) = delete;
+
+			void Enter();
+
+			Interpreter& Inter;
+			Frame* Caller;
+			Frame Callee;
+		};
+
+		bool ExitLoop();
+		Value EvalScoped(LogoAstNode const* node);
+		void ExecScoped(LogoAstNode const* node);
+
+		//
+		// evaluation without copying values the result does not need:
+		// EvalRef refers to a variable or a literal in place (anything else is evaluated into temp), which holds until
+		// something that may assign or free it is evaluated; Exec runs a statement for its effects only, so assignments
+		// store their value without copying it out; the Assign helpers copy it to result unless it is null
+		//
+		Value const& EvalRef(LogoAstNode const* node, Value& temp);
+		void Exec(LogoAstNode const* node);
+		Value& LookupName(NameExpression const* expr);
+		void Assign(AssignExpression const* expr, Value* result);
+		void AssignIndex(AssignIndexExpression const* expr, Value* result);
+		void AssignMember(AssignMemberExpression const* expr, Value* result);
+		Value RunBody(Function const& f, CallScope& call);
+		void SetTailCallee(Function const& f, Value const* callee);
+		Value Execute(Function const& f);
+
+		//
+		// first, so that it is current while the interpreter is built and outlives everything holding its objects
+		//
+		Heap m_Heap;
+		//
+		// popped scopes are cleared and kept for reuse
+		//
+		std::vector<std::unique_ptr<Scope>> m_Scopes;
+		size_t m_ScopeDepth{ 0 };
+		ValueStack m_Stack;
+		Frame* m_Frame{ nullptr };
+		FlatMap<Atom, Function> m_Functions;
+		//
+		// bumped whenever the function table changes, invalidating the call caches filled in by this interpreter
+		//
+		uint64_t m_FunctionEpoch{ 1 };
+		Completion m_Completion{ Completion::Normal };
+		Value m_ReturnValue;
+		Function const* m_TailCallee{ nullptr };
+		Value m_TailCalleeValue;		// keeps a closure callee alive while its caller's frame is reused
 		std::unordered_map<std::string, TypeObject> m_Types;
+		std::unique_ptr<Jit> m_Jit;
+		//
+		// argument copies for std::function natives, one per nesting level, reused across calls
+		//
+		std::deque<std::vector<Value>> m_NativeArgs;
+		size_t m_NativeDepth{ 0 };
 	};
 
 	DEFINE_ENUM_FLAG_OPERATORS(Logo2::VariableFlags);
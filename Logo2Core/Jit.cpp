@@ -0,0 +1,1124 @@
+#include "pch.h"
+#include "Jit.h"
+#include "Compiler.h"
+#include "Interpreter.h"
+#include <Errors.h>
+#include "ArrayValue.h"
+#include "DictionaryValue.h"
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+using namespace Logo2;
+using namespace std;
+
+namespace Logo2 {
+	//
+	// state of a running chunk, passed to every helper; the generated code keeps it in rbx
+	//
+	struct JitContext {
+		Interpreter& Inter;
+		JitCode const& Code;
+		CodeChunk const& Chunk;
+		Frame Locals;
+		Value* Stack{ nullptr };		// the operands, a region of the JIT's operand stack
+		Value* Top{ nullptr };			// past the top operand, while a helper runs
+		Value Result{};
+		bool Completed{ false };		// ran off the end of a loop chunk
+		exception_ptr Error{};
+	};
+}
+
+namespace {
+	//
+	// what a helper returns to the generated code; helpers never throw through it,
+	// an error is kept in the context and rethrown once the native code has returned
+	//
+	enum Status : int {
+		Next,
+		Branch,			// take the instruction's jump
+		Leave,			// the chunk returned
+		Failed,
+	};
+
+	using Helper = int(*)(JitContext* context, int operand, int count, int at);
+
+	//
+	// at is the index of the instruction, an error raised without a node gets the one the instruction was compiled from
+	//
+	template<int(*F)(JitContext&, int, int)>
+	int Guarded(JitContext* context, int operand, int count, int at) noexcept {
+		context->Top = context->Stack + context->Code.Depths[at];
+		try {
+			return F(*context, operand, count);
+		}
+		catch (RuntimeError const& err) {
+			context->Error = err.Node ? current_exception() : make_exception_ptr(RuntimeError(err.Error, context->Chunk.Nodes[at], err.ErrorText));
+			return Failed;
+		}
+		catch (...) {
+			context->Error = current_exception();
+			return Failed;
+		}
+	}
+
+	//
+	// the operand stack as the helpers see it; slots above the top hold no references
+	// (the generated code stores integers, booleans and reals there without releasing what they held)
+	//
+	void Push(JitContext& ctx, Value v) {
+		*ctx.Top++ = move(v);
+	}
+
+	Value Pop(JitContext& ctx) {
+		return move(*--ctx.Top);
+	}
+
+	Value& Back(JitContext& ctx) {
+		return ctx.Top[-1];
+	}
+
+	void Drop(JitContext& ctx, Value* top) {
+		while (ctx.Top > top)
+			*--ctx.Top = Value();
+	}
+
+	int LoadConst(JitContext& ctx, int operand, int) {
+		Push(ctx, ctx.Chunk.Constants[operand]);
+		return Next;
+	}
+
+	int LoadNull(JitContext& ctx, int, int) {
+		Push(ctx, Value());
+		return Next;
+	}
+
+	template<bool B>
+	int LoadBoolean(JitContext& ctx, int, int) {
+		Push(ctx, B);
+		return Next;
+	}
+
+	int PopValue(JitContext& ctx, int, int) {
+		Drop(ctx, ctx.Top - 1);
+		return Next;
+	}
+
+	int LoadName(JitContext& ctx, int operand, int) {
+		auto& name = ctx.Chunk.Names[operand];
+		auto v = ctx.Inter.FindVariable(name);
+		if (!v)
+			throw RuntimeError(ErrorType::UndefinedSymbol, nullptr, AtomTable::Name(name));
+		Push(ctx, v->VarValue);
+		return Next;
+	}
+
+	int StoreName(JitContext& ctx, int operand, int) {
+		auto& name = ctx.Chunk.Names[operand];
+		auto v = ctx.Inter.FindVariable(name);
+		if (!v)
+			throw RuntimeError(ErrorType::UndefinedSymbol, nullptr, AtomTable::Name(name));
+		if ((v->Flags & VariableFlags::Const) == VariableFlags::Const)
+			throw RuntimeError(ErrorType::CannotAssignConst, nullptr, AtomTable::Name(name));
+		v->VarValue = Back(ctx);
+		return Next;
+	}
+
+	int DefineVar(JitContext& ctx, int operand, int count) {
+		Variable var;
+		var.Flags = count ? VariableFlags::Const : VariableFlags::None;
+		var.VarValue = Pop(ctx);
+		ctx.Inter.AddVariable(ctx.Chunk.Names[operand], move(var));
+		return Next;
+	}
+
+	int LoadLocal(JitContext& ctx, int operand, int) {
+		Push(ctx, ctx.Locals.Slots[operand]);
+		return Next;
+	}
+
+	int StoreLocal(JitContext& ctx, int operand, int) {
+		ctx.Locals.Slots[operand] = Back(ctx);
+		return Next;
+	}
+
+	int DefineLocal(JitContext& ctx, int operand, int) {
+		ctx.Inter.Stack().Redeclare(&ctx.Locals.Slots[operand]);
+		ctx.Locals.Slots[operand] = Pop(ctx);
+		return Next;
+	}
+
+	int LoadUpvalue(JitContext& ctx, int operand, int) {
+		Push(ctx, *(*ctx.Locals.Upvalues)[operand]->Location);
+		return Next;
+	}
+
+	int StoreUpvalue(JitContext& ctx, int operand, int) {
+		*(*ctx.Locals.Upvalues)[operand]->Location = Back(ctx);
+		return Next;
+	}
+
+	template<OpCode Op>
+	Value Apply(Value const& left, Value const& right) {
+		if constexpr (Op == OpCode::Add) return left + right;
+		else if constexpr (Op == OpCode::Sub) return left - right;
+		else if constexpr (Op == OpCode::Mul) return left * right;
+		else if constexpr (Op == OpCode::Div) return left / right;
+		else if constexpr (Op == OpCode::Mod) return left % right;
+		else if constexpr (Op == OpCode::Power) return left.Power(right);
+		else if constexpr (Op == OpCode::And) return left & right;
+		else if constexpr (Op == OpCode::Or) return left | right;
+		else if constexpr (Op == OpCode::Xor) return left ^ right;
+		else if constexpr (Op == OpCode::Equal) return left == right;
+		else if constexpr (Op == OpCode::NotEqual) return left != right;
+		else if constexpr (Op == OpCode::Less) return left < right;
+		else if constexpr (Op == OpCode::LessEqual) return left <= right;
+		else if constexpr (Op == OpCode::Greater) return left > right;
+		else if constexpr (Op == OpCode::GreaterEqual) return left >= right;
+	}
+
+	template<OpCode Op>
+	int Binary(JitContext& ctx, int, int) {
+		auto right = Pop(ctx);
+		auto& left = Back(ctx);
+		left = Apply<Op>(left, right);
+		return Next;
+	}
+
+	int Neg(JitContext& ctx, int, int) {
+		Back(ctx) = -Back(ctx);
+		return Next;
+	}
+
+	int Not(JitContext& ctx, int, int) {
+		Back(ctx) = !Back(ctx);
+		return Next;
+	}
+
+	int JumpIfFalse(JitContext& ctx, int, int) {
+		return Pop(ctx).ToBoolean() ? Next : Branch;
+	}
+
+	int RepeatInit(JitContext& ctx, int, int) {
+		if (!Back(ctx).IsInteger())
+			throw RuntimeError(ErrorType::TypeMismatch);
+		return Next;
+	}
+
+	int RepeatNext(JitContext& ctx, int, int) {
+		auto& count = Back(ctx);
+		auto n = count.Integer();
+		if (n <= 0)
+			return Branch;
+		count = n - 1;
+		return Next;
+	}
+
+	int PushScope(JitContext& ctx, int, int) {
+		ctx.Inter.PushScope();
+		return Next;
+	}
+
+	int PopScope(JitContext& ctx, int, int) {
+		ctx.Inter.PopScope();
+		return Next;
+	}
+
+	Function const* FindCallee(JitContext& ctx, int index, Value const*& holder) {
+		//
+		// same lookup as VirtualMachine::FindCallee, holder is the variable a function value came from
+		//
+		auto& name = ctx.Chunk.Names[index];
+		holder = nullptr;
+		if (auto f = ctx.Inter.FindFunction(name, ctx.Chunk.Callees[index]); f)
+			return f;
+
+		auto var = ctx.Inter.FindVariable(name);
+		if (var) {
+			if (var->VarValue.IsFunction()) {
+				holder = &var->VarValue;
+				return var->VarValue.Func();
+			}
+			throw RuntimeError(ErrorType::NotCallable, nullptr, AtomTable::Name(name));
+		}
+		throw RuntimeError(ErrorType::UndefinedFunction, nullptr, AtomTable::Name(name));
+	}
+
+	//
+	// a call in tail position (followed by Return in a function body) leaves a user function
+	// to the interpreter, which runs it in the frame of the returning function
+	//
+	template<bool Tail>
+	int Invoke(JitContext& ctx, Function const& callee, int argCount, bool popCallee, Value const* holder) {
+		auto first = ctx.Top - argCount;
+		span<const Value> args{ first, (size_t)argCount };
+		Value keep = holder ? *holder : Value();		// the variable may be assigned over while the callee runs
+		auto result = Tail ? ctx.Inter.TailCall(callee, args, holder) : ctx.Inter.Call(callee, args);
+		Drop(ctx, popCallee ? first - 1 : first);
+		Push(ctx, move(result));
+		return Next;
+	}
+
+	template<bool Tail>
+	int Call(JitContext& ctx, int operand, int count) {
+		Value const* holder;
+		auto callee = FindCallee(ctx, operand, holder);
+		return Invoke<Tail>(ctx, *callee, count, false, holder);
+	}
+
+	template<bool Tail>
+	int CallValue(JitContext& ctx, int, int count) {
+		//
+		// the function value stays on the stack, below the arguments, for the duration of the call
+		//
+		auto& value = ctx.Top[-count - 1];
+		if (!value.IsFunction())
+			throw RuntimeError(ErrorType::NotCallable);
+		return Invoke<Tail>(ctx, *value.Func(), count, true, &value);
+	}
+
+	template<bool Tail, bool Local>
+	int CallWith(JitContext& ctx, int operand, int count) {
+		Value const* holder;
+		auto callee = FindCallee(ctx, operand, holder);
+		Push(ctx, Local ? ctx.Locals.Slots[count] : ctx.Chunk.Constants[count]);
+		return Invoke<Tail>(ctx, *callee, 1, false, holder);
+	}
+
+	template<bool Add>
+	int LocalConst(JitContext& ctx, int operand, int count) {
+		auto& local = ctx.Locals.Slots[count];
+		auto& constant = ctx.Chunk.Constants[operand];
+		Push(ctx, Add ? local + constant : local - constant);
+		return Next;
+	}
+
+	int Return(JitContext& ctx, int, int count) {
+		ctx.Result = Pop(ctx);
+		ctx.Completed = count != 0;
+		return Leave;
+	}
+
+	Ref<Function> MakeFunction(JitContext& ctx, shared_ptr<CodeChunk> const& proto) {
+		//
+		// same as VirtualMachine::MakeFunction, the function runs on either engine
+		//
+		auto f = MakeRef<Function>();
+		f->ArgCount = (int)proto->Parameters.size();
+		f->Code = proto->Body;
+		f->Parameters = proto->Parameters;
+		f->Chunk = proto;
+		f->FrameSize = proto->FrameSize;
+		f->Upvalues = ctx.Inter.Stack().CaptureAll(ctx.Locals.Slots ? &ctx.Locals : nullptr, proto->Captures, ctx.Inter.CurrentScope());
+		return f;
+	}
+
+	int DefineFunction(JitContext& ctx, int operand, int) {
+		auto& proto = ctx.Chunk.Functions[operand];
+		ctx.Inter.AddFunction(proto->Name, move(*MakeFunction(ctx, proto)));
+		return Next;
+	}
+
+	int MakeClosure(JitContext& ctx, int operand, int) {
+		Push(ctx, MakeFunction(ctx, ctx.Chunk.Functions[operand]));
+		return Next;
+	}
+
+	int MakeArray(JitContext& ctx, int, int count) {
+		auto first = ctx.Top - count;
+		auto array = MakeRef<ArrayValue>(vector<Value>(make_move_iterator(first), make_move_iterator(ctx.Top)));
+		Drop(ctx, first);
+		Push(ctx, move(array));
+		return Next;
+	}
+
+	int MakeDictionary(JitContext& ctx, int, int count) {
+		auto first = ctx.Top - 2 * count;
+		auto dictionary = MakeRef<DictionaryValue>(count);
+		for (auto p = first; p < ctx.Top; p += 2)
+			dictionary->Set(p[0], move(p[1]));
+		Drop(ctx, first);
+		Push(ctx, move(dictionary));
+		return Next;
+	}
+
+	int LoadIndex(JitContext& ctx, int, int) {
+		auto index = Pop(ctx);
+		auto& container = Back(ctx);
+		container = container.Element(index);
+		return Next;
+	}
+
+	int LoadField(JitContext& ctx, int operand, int) {
+		auto& site = ctx.Chunk.FieldSites[operand];
+		auto& object = Back(ctx);
+		Value field = object.Object()->Get(site.Name, site.Cache);		// copied before the object may be released
+		object = move(field);
+		return Next;
+	}
+
+	int StoreField(JitContext& ctx, int operand, int) {
+		auto& site = ctx.Chunk.FieldSites[operand];
+		auto value = Pop(ctx);
+		Back(ctx).Object()->Set(site.Name, site.Cache, value);
+		Back(ctx) = move(value);
+		return Next;
+	}
+
+	int StoreIndex(JitContext& ctx, int, int) {
+		auto value = Pop(ctx);
+		auto index = Pop(ctx);
+		Back(ctx).SetElement(index, value);
+		Back(ctx) = move(value);
+		return Next;
+	}
+
+	template<bool Tail>
+	Helper CallHelperFor(OpCode code) {
+		switch (code) {
+			case OpCode::Call: return &Guarded<Call<Tail>>;
+			case OpCode::CallValue: return &Guarded<CallValue<Tail>>;
+			case OpCode::CallWithLocal: return &Guarded<CallWith<Tail, true>>;
+			case OpCode::CallWithConst: return &Guarded<CallWith<Tail, false>>;
+			default: break;
+		}
+		return nullptr;
+	}
+
+	Helper HelperFor(OpCode code) {
+		if (auto helper = CallHelperFor<false>(code))
+			return helper;
+
+		switch (code) {
+			case OpCode::LoadConst: return &Guarded<LoadConst>;
+			case OpCode::LoadNull: return &Guarded<LoadNull>;
+			case OpCode::LoadTrue: return &Guarded<LoadBoolean<true>>;
+			case OpCode::LoadFalse: return &Guarded<LoadBoolean<false>>;
+			case OpCode::Pop: return &Guarded<PopValue>;
+			case OpCode::LoadName: return &Guarded<LoadName>;
+			case OpCode::StoreName: return &Guarded<StoreName>;
+			case OpCode::DefineVar: return &Guarded<DefineVar>;
+			case OpCode::LoadLocal: return &Guarded<LoadLocal>;
+			case OpCode::StoreLocal: return &Guarded<StoreLocal>;
+			case OpCode::DefineLocal: return &Guarded<DefineLocal>;
+			case OpCode::LoadUpvalue: return &Guarded<LoadUpvalue>;
+			case OpCode::StoreUpvalue: return &Guarded<StoreUpvalue>;
+			case OpCode::Add: return &Guarded<Binary<OpCode::Add>>;
+			case OpCode::Sub: return &Guarded<Binary<OpCode::Sub>>;
+			case OpCode::Mul: return &Guarded<Binary<OpCode::Mul>>;
+			case OpCode::Div: return &Guarded<Binary<OpCode::Div>>;
+			case OpCode::Mod: return &Guarded<Binary<OpCode::Mod>>;
+			case OpCode::Power: return &Guarded<Binary<OpCode::Power>>;
+			case OpCode::And: return &Guarded<Binary<OpCode::And>>;
+			case OpCode::Or: return &Guarded<Binary<OpCode::Or>>;
+			case OpCode::Xor: return &Guarded<Binary<OpCode::Xor>>;
+			case OpCode::Equal: return &Guarded<Binary<OpCode::Equal>>;
+			case OpCode::NotEqual: return &Guarded<Binary<OpCode::NotEqual>>;
+			case OpCode::Less: return &Guarded<Binary<OpCode::Less>>;
+			case OpCode::LessEqual: return &Guarded<Binary<OpCode::LessEqual>>;
+			case OpCode::Greater: return &Guarded<Binary<OpCode::Greater>>;
+			case OpCode::GreaterEqual: return &Guarded<Binary<OpCode::GreaterEqual>>;
+			case OpCode::Neg: return &Guarded<Neg>;
+			case OpCode::Not: return &Guarded<Not>;
+			case OpCode::JumpIfFalse: return &Guarded<JumpIfFalse>;
+			case OpCode::RepeatInit: return &Guarded<RepeatInit>;
+			case OpCode::RepeatNext: return &Guarded<RepeatNext>;
+			case OpCode::PushScope: return &Guarded<PushScope>;
+			case OpCode::PopScope: return &Guarded<PopScope>;
+			case OpCode::Return: return &Guarded<Return>;
+			case OpCode::DefineFunction: return &Guarded<DefineFunction>;
+			case OpCode::MakeClosure: return &Guarded<MakeClosure>;
+			case OpCode::MakeArray: return &Guarded<MakeArray>;
+			case OpCode::MakeDictionary: return &Guarded<MakeDictionary>;
+			case OpCode::LoadIndex: return &Guarded<LoadIndex>;
+			case OpCode::StoreIndex: return &Guarded<StoreIndex>;
+			case OpCode::LoadField: return &Guarded<LoadField>;
+			case OpCode::StoreField: return &Guarded<StoreField>;
+			case OpCode::AddLocalConst: return &Guarded<LocalConst<true>>;
+			case OpCode::SubLocalConst: return &Guarded<LocalConst<false>>;
+			default: break;
+		}
+		return nullptr;
+	}
+
+	//
+	// emits the x86-64 code of a chunk, which keeps the context in rbx, its operands in r12 and the slots of the frame in r13:
+	//   prologue:  push rbx; push r12; push r13; [sub rsp, 32]; mov rbx, <arg0>; mov r12, <arg1>; mov r13, <arg2>
+	//   an instruction calls its helper:  mov <arg0>, rbx; mov <arg1>, operand; mov <arg2>, count; mov <arg3>, index; mov rax, helper; call rax
+	//     followed by:  test eax, eax; jnz exit
+	//     or, if it may jump:  cmp eax, 1; je target; ja exit
+	//   Jump is a plain jmp, Nop emits nothing
+	//   exit:  [add rsp, 32]; pop r13; pop r12; pop rbx; ret		(eax holds the status)
+	// the depth of the operand stack before each instruction is known here, so each operand is at a fixed offset from r12;
+	// with the NaN-boxed layout the common instructions run inline on integers, booleans and values holding no reference,
+	// and call their helper for anything else; a comparison followed by JumpIfFalse becomes a compare and a branch
+	// the Windows x64 convention passes arguments in rcx, rdx, r8, r9 and needs 32 bytes of shadow space,
+	// the System V one passes them in rdi, rsi, rdx, rcx
+	//
+	class Assembler {
+	public:
+		Assembler(CodeChunk const& chunk, bool body) : m_Chunk(chunk), m_Body(body) {
+		}
+
+		vector<uint8_t> Assemble() {
+			auto& code = m_Chunk.Code;
+			ComputeDepths();
+			//
+			// a label per instruction, the last one is the exit
+			//
+			m_Labels.assign(code.size() + 1, 0);
+			vector<bool> targets(code.size() + 1);
+			for (auto& inst : code)
+				if (IsJump(inst.Code))
+					targets[inst.Operand] = true;
+
+			Byte(0x53);								// push rbx
+			Bytes({ 0x41, 0x54 });					// push r12
+			Bytes({ 0x41, 0x55 });					// push r13
+#ifdef _WIN32
+			Bytes({ 0x48, 0x83, 0xEC, 0x20 });		// sub rsp, 32
+			Bytes({ 0x48, 0x89, 0xCB });			// mov rbx, rcx
+			Bytes({ 0x49, 0x89, 0xD4 });			// mov r12, rdx
+			Bytes({ 0x4D, 0x89, 0xC5 });			// mov r13, r8
+#else
+			Bytes({ 0x48, 0x89, 0xFB });			// mov rbx, rdi
+			Bytes({ 0x49, 0x89, 0xF4 });			// mov r12, rsi
+			Bytes({ 0x49, 0x89, 0xD5 });			// mov r13, rdx
+#endif
+			for (size_t i = 0; i < code.size(); i++) {
+				Bind(int(i));
+				auto& inst = code[i];
+				switch (inst.Code) {
+					case OpCode::Nop:
+						break;
+
+					case OpCode::Jump:
+						Jump(inst.Operand);
+						break;
+
+					default:
+						if (IsCompare(inst.Code) && i + 1 < code.size() && code[i + 1].Code == OpCode::JumpIfFalse && !targets[i + 1]) {
+							CompareAndBranch(i);
+							Bind(int(++i));
+						}
+						else if (!Inline(i))
+							CallHelper(i);
+						break;
+				}
+			}
+
+			Bind(int(code.size()));
+#ifdef _WIN32
+			Bytes({ 0x48, 0x83, 0xC4, 0x20 });		// add rsp, 32
+#endif
+			Bytes({ 0x41, 0x5D });					// pop r13
+			Bytes({ 0x41, 0x5C });					// pop r12
+			Byte(0x5B);								// pop rbx
+			Byte(0xC3);								// ret
+
+			for (auto& [at, label] : m_Fixups) {
+				auto rel = int32_t(m_Labels[label] - (at + 4));
+				memcpy(m_Code.data() + at, &rel, sizeof(rel));
+			}
+			return move(m_Code);
+		}
+
+		//
+		// the operand stack depth before each instruction, and the deepest it gets
+		//
+		vector<int> const& Depths() const {
+			return m_Depths;
+		}
+
+		int StackSize() const {
+			return m_StackSize;
+		}
+
+	private:
+		enum Register {
+			Rax = 0, Rcx = 1, Rdx = 2, R12 = 12, R13 = 13,
+		};
+
+		enum Condition : uint8_t {
+			Overflow = 0x0, AboveEqual = 0x3, Equal = 0x4, NotEqual = 0x5, Above = 0x7,
+			Less = 0xC, GreaterEqual = 0xD, LessEqual = 0xE, Greater = 0xF,
+		};
+
+		static bool IsJump(OpCode code) {
+			return code == OpCode::Jump || code == OpCode::JumpIfFalse || code == OpCode::RepeatNext;
+		}
+
+		static bool IsCompare(OpCode code) {
+			return code >= OpCode::Equal && code <= OpCode::GreaterEqual;
+		}
+
+		//
+		// net change of the operand stack depth, the compiler's view: every node leaves one value, so a Return
+		// (or a Jump out of a loop) is followed by code that accounts for the value of its statement
+		//
+		static int Effect(Instruction const& inst) {
+			switch (inst.Code) {
+				case OpCode::LoadConst:
+				case OpCode::LoadNull:
+				case OpCode::LoadTrue:
+				case OpCode::LoadFalse:
+				case OpCode::LoadName:
+				case OpCode::LoadLocal:
+				case OpCode::LoadUpvalue:
+				case OpCode::MakeClosure:
+				case OpCode::AddLocalConst:
+				case OpCode::SubLocalConst:
+				case OpCode::CallWithLocal:
+				case OpCode::CallWithConst:
+					return 1;
+
+				case OpCode::Pop:
+				case OpCode::DefineVar:
+				case OpCode::DefineLocal:
+				case OpCode::Add:
+				case OpCode::Sub:
+				case OpCode::Mul:
+				case OpCode::Div:
+				case OpCode::Mod:
+				case OpCode::Power:
+				case OpCode::And:
+				case OpCode::Or:
+				case OpCode::Xor:
+				case OpCode::Equal:
+				case OpCode::NotEqual:
+				case OpCode::Less:
+				case OpCode::LessEqual:
+				case OpCode::Greater:
+				case OpCode::GreaterEqual:
+				case OpCode::JumpIfFalse:
+				case OpCode::LoadIndex:
+				case OpCode::StoreField:
+					return -1;
+
+				case OpCode::StoreIndex: return -2;
+				case OpCode::Call: return 1 - inst.Count;
+				case OpCode::CallValue: return -inst.Count;
+				case OpCode::TailCall: return inst.Operand < 0 ? -inst.Count : 1 - inst.Count;
+				case OpCode::MakeArray: return 1 - inst.Count;
+				case OpCode::MakeDictionary: return 1 - 2 * inst.Count;
+				default: break;
+			}
+			return 0;
+		}
+
+		static int DepthAfterJump(Instruction const& inst, int depth) {
+			return inst.Code == OpCode::JumpIfFalse ? depth - 1 : depth;
+		}
+
+		void ComputeDepths() {
+			//
+			// a loop chunk starts with its remaining count on the stack; the code after a Jump (the else of an if)
+			// starts at the depth of the jumps to it; the code is not compiled if a jump would land at another depth
+			//
+			auto& code = m_Chunk.Code;
+			vector<int> incoming(code.size() + 1, -1);
+			m_Depths.resize(code.size() + 1);
+			m_Depths[0] = m_StackSize = m_Body ? 0 : 1;
+			for (size_t i = 0; i < code.size(); i++) {
+				auto& inst = code[i];
+				if (IsJump(inst.Code) && inst.Operand > int(i))
+					incoming[inst.Operand] = DepthAfterJump(inst, m_Depths[i]);
+				m_Depths[i + 1] = inst.Code == OpCode::Jump && incoming[i + 1] >= 0 ? incoming[i + 1] : m_Depths[i] + Effect(inst);
+				if (m_Depths[i + 1] < 0)
+					throw RuntimeError(ErrorType::UndefinedOperator);
+				m_StackSize = max(m_StackSize, m_Depths[i + 1]);
+			}
+			for (size_t i = 0; i < code.size(); i++) {
+				auto& inst = code[i];
+				if (IsJump(inst.Code) && m_Depths[inst.Operand] != DepthAfterJump(inst, m_Depths[i]))
+					throw RuntimeError(ErrorType::UndefinedOperator);
+			}
+			//
+			// CallWith pushes its argument before the call replaces it with the result
+			//
+			m_StackSize++;
+		}
+
+		bool IsTailCall(size_t i) const {
+			auto& code = m_Chunk.Code;
+			return m_Body && i + 1 < code.size() && code[i + 1].Code == OpCode::Return && code[i + 1].Count == 0;
+		}
+
+		//
+		// offset of the operand n from the top before instruction i (0 is the top one)
+		//
+		int32_t Operand(size_t i, int n) const {
+			return (m_Depths[i] - 1 - n) * (int32_t)sizeof(Value);
+		}
+
+#ifdef LOGO2_NANBOX_VALUE
+		bool Inline(size_t i) {
+			auto& inst = m_Chunk.Code[i];
+			auto slow = NewLabel(), done = NewLabel();
+			auto push = m_Depths[i] * (int32_t)sizeof(Value);
+			switch (inst.Code) {
+				case OpCode::LoadConst:
+				{
+					auto& constant = m_Chunk.Constants[inst.Operand];
+					if (constant.Bits() >= Value::CellBits())
+						return false;
+					MovImm(Rax, constant.Bits());
+					Store(R12, push, Rax);
+					return true;
+				}
+
+				case OpCode::LoadNull:
+				case OpCode::LoadTrue:
+				case OpCode::LoadFalse:
+					MovImm(Rax, (inst.Code == OpCode::LoadNull ? Value() : Value(inst.Code == OpCode::LoadTrue)).Bits());
+					Store(R12, push, Rax);
+					return true;
+
+				case OpCode::LoadLocal:
+					Load(Rax, R13, inst.Operand * (int32_t)sizeof(Value));
+					JumpIfCell(Rax, slow);
+					Store(R12, push, Rax);
+					break;
+
+				case OpCode::StoreLocal:
+					Load(Rax, R12, Operand(i, 0));
+					Load(Rcx, R13, inst.Operand * (int32_t)sizeof(Value));
+					JumpIfCell(Rax, slow);
+					JumpIfCell(Rcx, slow);
+					Store(R13, inst.Operand * (int32_t)sizeof(Value), Rax);
+					break;
+
+				case OpCode::Pop:
+					Load(Rax, R12, Operand(i, 0));
+					JumpIfCell(Rax, slow);
+					break;
+
+				case OpCode::Add:
+				case OpCode::Sub:
+					Load(Rax, R12, Operand(i, 1));
+					Load(Rcx, R12, Operand(i, 0));
+					JumpUnlessTag(Rax, Value::IntegerBits(), slow);
+					JumpUnlessTag(Rcx, Value::IntegerBits(), slow);
+					Bytes({ 0x48, 0xC1, 0xE1, 0x10 });		// shl rcx, 16
+					ArithmeticAndBox(inst.Code == OpCode::Add, slow);
+					Store(R12, Operand(i, 1), Rax);
+					break;
+
+				case OpCode::AddLocalConst:
+				case OpCode::SubLocalConst:
+				{
+					//
+					// Count is the slot of the local, Operand the constant
+					//
+					auto& constant = m_Chunk.Constants[inst.Operand];
+					if ((constant.Bits() >> 48) != (Value::IntegerBits() >> 48))
+						return false;
+					Load(Rax, R13, inst.Count * (int32_t)sizeof(Value));
+					JumpUnlessTag(Rax, Value::IntegerBits(), slow);
+					MovImm(Rcx, uint64_t(constant.Integer()) << 16);
+					ArithmeticAndBox(inst.Code == OpCode::AddLocalConst, slow);
+					Store(R12, push, Rax);
+					break;
+				}
+
+				case OpCode::Equal:
+				case OpCode::NotEqual:
+				case OpCode::Less:
+				case OpCode::LessEqual:
+				case OpCode::Greater:
+				case OpCode::GreaterEqual:
+					CompareIntegers(i, slow);
+					Bytes({ 0x0F, uint8_t(0x90 | ConditionOf(inst.Code)), 0xC2 });		// setcc dl
+					Bytes({ 0x0F, 0xB6, 0xD2 });			// movzx edx, dl
+					MovImm(Rax, Value::BooleanBits());
+					Bytes({ 0x48, 0x09, 0xD0 });			// or rax, rdx
+					Store(R12, Operand(i, 1), Rax);
+					break;
+
+				case OpCode::JumpIfFalse:
+					Load(Rax, R12, Operand(i, 0));
+					JumpUnlessTag(Rax, Value::BooleanBits(), slow);
+					Bytes({ 0x85, 0xC0 });					// test eax, eax
+					JumpIf(Equal, inst.Operand);
+					break;
+
+				case OpCode::RepeatNext:
+					Load(Rax, R12, Operand(i, 0));
+					JumpUnlessTag(Rax, Value::IntegerBits(), slow);
+					Bytes({ 0x48, 0xC1, 0xE0, 0x10 });		// shl rax, 16
+					Bytes({ 0x48, 0x85, 0xC0 });			// test rax, rax
+					JumpIf(LessEqual, inst.Operand);
+					Bytes({ 0x48, 0x2D });					// sub rax, 1 << 16
+					Imm32(1 << 16);
+					Box(Value::IntegerBits());
+					Store(R12, Operand(i, 0), Rax);
+					break;
+
+				default:
+					return false;
+			}
+			Jump(done);
+			Bind(slow);
+			CallHelper(i);
+			Bind(done);
+			return true;
+		}
+
+		void CompareAndBranch(size_t i) {
+			//
+			// a comparison of two integers jumps on the flags, anything else runs both helpers
+			//
+			auto& code = m_Chunk.Code;
+			auto slow = NewLabel();
+			CompareIntegers(i, slow);
+			JumpIf(Condition(ConditionOf(code[i].Code) ^ 1), code[i + 1].Operand);
+			Jump(int(i + 2));
+			Bind(slow);
+			CallHelper(i);
+			CallHelper(i + 1);
+		}
+
+		void CompareIntegers(size_t i, int slow) {
+			Load(Rax, R12, Operand(i, 1));
+			Load(Rcx, R12, Operand(i, 0));
+			JumpUnlessTag(Rax, Value::IntegerBits(), slow);
+			JumpUnlessTag(Rcx, Value::IntegerBits(), slow);
+			//
+			// the payloads moved to the top bits compare as the integers do
+			//
+			Bytes({ 0x48, 0xC1, 0xE0, 0x10 });		// shl rax, 16
+			Bytes({ 0x48, 0xC1, 0xE1, 0x10 });		// shl rcx, 16
+			Bytes({ 0x48, 0x39, 0xC8 });			// cmp rax, rcx
+		}
+
+		static Condition ConditionOf(OpCode code) {
+			switch (code) {
+				case OpCode::Equal: return Equal;
+				case OpCode::NotEqual: return NotEqual;
+				case OpCode::Less: return Less;
+				case OpCode::LessEqual: return LessEqual;
+				case OpCode::Greater: return Greater;
+				default: break;
+			}
+			return GreaterEqual;
+		}
+
+		void ArithmeticAndBox(bool add, int slow) {
+			//
+			// rax holds an integer value, rcx the other integer in its top 48 bits: with both payloads in the top bits
+			// the 64 bit operation overflows exactly when the 48 bit one does, which the helper handles (as a big integer)
+			//
+			Bytes({ 0x48, 0xC1, 0xE0, 0x10 });		// shl rax, 16
+			Bytes({ 0x48, add ? uint8_t(0x01) : uint8_t(0x29), 0xC8 });		// add / sub rax, rcx
+			JumpIf(Overflow, slow);
+			Box(Value::IntegerBits());
+		}
+
+		void Box(uint64_t tag) {
+			//
+			// rax holds a payload in its top 48 bits
+			//
+			Bytes({ 0x48, 0xC1, 0xE8, 0x10 });		// shr rax, 16
+			MovImm(Rdx, tag);
+			Bytes({ 0x48, 0x09, 0xD0 });			// or rax, rdx
+		}
+
+		void JumpUnlessTag(Register reg, uint64_t tag, int label) {
+			Bytes({ 0x48, 0x89, uint8_t(0xC2 | reg << 3) });		// mov rdx, reg
+			Bytes({ 0x48, 0xC1, 0xEA, 0x30 });		// shr rdx, 48
+			Bytes({ 0x81, 0xFA });					// cmp edx, tag
+			Imm32(int32_t(tag >> 48));
+			JumpIf(NotEqual, label);
+		}
+
+		void JumpIfCell(Register reg, int label) {
+			MovImm(Rdx, Value::CellBits());
+			Bytes({ 0x48, 0x39, uint8_t(0xD0 | reg) });		// cmp reg, rdx
+			JumpIf(AboveEqual, label);
+		}
+#else
+		bool Inline(size_t) {
+			return false;
+		}
+
+		void CompareAndBranch(size_t i) {
+			CallHelper(i);
+			CallHelper(i + 1);
+		}
+#endif
+
+		void CallHelper(size_t i) {
+			//
+			// TailCall is the call it stands for, left to the interpreter only in a function body
+			//
+			auto& inst = m_Chunk.Code[i];
+			auto op = inst.Code == OpCode::TailCall ? (inst.Operand < 0 ? OpCode::CallValue : OpCode::Call) : inst.Code;
+			auto helper = IsTailCall(i) ? CallHelperFor<true>(op) : nullptr;
+			if (!helper)
+				helper = HelperFor(op);
+			if (!helper)
+				throw RuntimeError(ErrorType::UndefinedOperator);
+#ifdef _WIN32
+			Bytes({ 0x48, 0x89, 0xD9 });			// mov rcx, rbx
+			Byte(0xBA);								// mov edx, operand
+			Imm32(inst.Operand);
+			Bytes({ 0x41, 0xB8 });					// mov r8d, count
+			Imm32(inst.Count);
+			Bytes({ 0x41, 0xB9 });					// mov r9d, index
+			Imm32((int32_t)i);
+#else
+			Bytes({ 0x48, 0x89, 0xDF });			// mov rdi, rbx
+			Byte(0xBE);								// mov esi, operand
+			Imm32(inst.Operand);
+			Byte(0xBA);								// mov edx, count
+			Imm32(inst.Count);
+			Byte(0xB9);								// mov ecx, index
+			Imm32((int32_t)i);
+#endif
+			MovImm(Rax, reinterpret_cast<uint64_t>(helper));
+			Bytes({ 0xFF, 0xD0 });					// call rax
+			if (inst.Code == OpCode::JumpIfFalse || inst.Code == OpCode::RepeatNext) {
+				Bytes({ 0x83, 0xF8, 0x01 });		// cmp eax, 1
+				JumpIf(Equal, inst.Operand);
+				JumpIf(Above, Exit());
+			}
+			else {
+				Bytes({ 0x85, 0xC0 });				// test eax, eax
+				JumpIf(NotEqual, Exit());
+			}
+		}
+
+		void Load(Register reg, Register base, int32_t offset) {
+			Access(0x8B, reg, base, offset);		// mov reg, [base + offset]
+		}
+
+		void Store(Register base, int32_t offset, Register reg) {
+			Access(0x89, reg, base, offset);		// mov [base + offset], reg
+		}
+
+		void Access(uint8_t opcode, Register reg, Register base, int32_t offset) {
+			Byte(uint8_t(0x48 | (reg >> 3) << 2 | base >> 3));
+			Byte(opcode);
+			Byte(uint8_t(0x80 | (reg & 7) << 3 | (base & 7)));
+			if ((base & 7) == 4)
+				Byte(0x24);							// r12 as a base takes a SIB byte
+			Imm32(offset);
+		}
+
+		void MovImm(Register reg, uint64_t value) {
+			Bytes({ 0x48, uint8_t(0xB8 | reg) });	// mov reg, imm64
+			for (int i = 0; i < 8; i++)
+				Byte(uint8_t(value >> (i * 8)));
+		}
+
+		int Exit() const {
+			return int(m_Chunk.Code.size());
+		}
+
+		int NewLabel() {
+			m_Labels.push_back(0);
+			return int(m_Labels.size() - 1);
+		}
+
+		void Bind(int label) {
+			m_Labels[label] = m_Code.size();
+		}
+
+		void Jump(int label) {
+			Byte(0xE9);
+			Fixup(label);
+		}
+
+		void JumpIf(Condition condition, int label) {
+			Bytes({ 0x0F, uint8_t(0x80 | condition) });
+			Fixup(label);
+		}
+
+		void Fixup(int label) {
+			m_Fixups.push_back({ m_Code.size(), label });
+			Imm32(0);
+		}
+
+		void Byte(uint8_t b) {
+			m_Code.push_back(b);
+		}
+
+		void Bytes(initializer_list<uint8_t> bytes) {
+			m_Code.insert(m_Code.end(), bytes);
+		}
+
+		void Imm32(int32_t value) {
+			for (int i = 0; i < 4; i++)
+				Byte(uint8_t(value >> (i * 8)));
+		}
+
+		CodeChunk const& m_Chunk;
+		bool m_Body;
+		vector<int> m_Depths;
+		int m_StackSize{ 0 };
+		vector<uint8_t> m_Code;
+		vector<size_t> m_Labels;				// code offsets, one per instruction, the exit and the local labels
+		vector<pair<size_t, int>> m_Fixups;		// rel32 to patch, label it jumps to
+	};
+
+	void* MapExecutable(vector<uint8_t> const& code) {
+		//
+		// the pages are written first and made executable (and read only) after
+		//
+#ifdef _WIN32
+		auto p = ::VirtualAlloc(nullptr, code.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (!p)
+			return nullptr;
+		memcpy(p, code.data(), code.size());
+		DWORD old;
+		if (!::VirtualProtect(p, code.size(), PAGE_EXECUTE_READ, &old)) {
+			::VirtualFree(p, 0, MEM_RELEASE);
+			return nullptr;
+		}
+		::FlushInstructionCache(::GetCurrentProcess(), p, code.size());
+#else
+		auto p = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return nullptr;
+		memcpy(p, code.data(), code.size());
+		if (mprotect(p, code.size(), PROT_READ | PROT_EXEC) != 0) {
+			munmap(p, code.size());
+			return nullptr;
+		}
+#endif
+		return p;
+	}
+
+	void Unmap(void* p, size_t size) {
+#ifdef _WIN32
+		::VirtualFree(p, 0, MEM_RELEASE);
+#else
+		munmap(p, size);
+#endif
+	}
+}
+
+JitCode::~JitCode() {
+	if (Code)
+		Unmap(reinterpret_cast<void*>(Code), Size);
+}
+
+Jit::Jit(Interpreter& inter) : m_Interpreter(inter), m_Operands(make_unique<Value[]>(OperandCapacity)) {
+	m_OperandTop = m_Operands.get();
+	m_OperandEnd = m_OperandTop + OperandCapacity;
+}
+
+Jit::~Jit() = default;
+
+bool Jit::IsSupported() {
+#ifdef LOGO2_JIT_X64
+	return true;
+#else
+	return false;
+#endif
+}
+
+JitCode const* Jit::OnCall(Expression const* body, int frameSize) {
+	auto& site = body->JitState();
+	if (site.Code)
+		return site.Code.get();
+	if (++site.Count < CallThreshold)
+		return nullptr;
+
+	auto code = Tier(site, true, [=]() { return Compiler().CompileBody(body, frameSize); });
+	if (code)
+		m_Functions++;
+	return code;
+}
+
+JitCode const* Jit::OnLoop(RepeatStatement const* loop, long long count, bool topLevel) {
+	auto& site = loop->JitState();
+	if (site.Code)
+		return site.Code.get();
+	site.Count += count;
+	if (site.Count < LoopThreshold)
+		return nullptr;
+
+	auto code = Tier(site, false, [=]() { return Compiler().CompileLoop(loop, topLevel); });
+	if (code)
+		m_Loops++;
+	return code;
+}
+
+JitCode const* Jit::Tier(JitSite& site, bool body, function<shared_ptr<CodeChunk>()> compile) {
+	if (site.Failed || !IsSupported())
+		return nullptr;
+
+	try {
+		auto code = make_unique<JitCode>();
+		code->Chunk = compile();
+		Assembler assembler(*code->Chunk, body);
+		auto bytes = assembler.Assemble();
+		auto p = MapExecutable(bytes);
+		if (!p) {
+			site.Failed = true;
+			return nullptr;
+		}
+		code->Code = reinterpret_cast<JitCode::Entry>(p);
+		code->Size = bytes.size();
+		code->Depths = assembler.Depths();
+		code->StackSize = assembler.StackSize();
+		site.Code = move(code);
+	}
+	catch (RuntimeError const&) {
+		//
+		// not compilable, stays on the tree walker
+		//
+		site.Failed = true;
+		return nullptr;
+	}
+	return site.Code.get();
+}
+
+Value Jit::Run(JitCode const& code, Frame const* frame) {
+	JitContext context{ .Inter = m_Interpreter, .Code = code, .Chunk = *code.Chunk, .Locals = frame ? *frame : Frame{} };
+	return Execute(context, code);
+}
+
+Value Jit::RunLoop(JitCode const& code, Frame const* frame, long long count, bool& completed) {
+	JitContext context{ .Inter = m_Interpreter, .Code = code, .Chunk = *code.Chunk, .Locals = frame ? *frame : Frame{} };
+	auto result = Execute(context, code, count);
+	completed = context.Completed;
+	return result;
+}
+
+Value Jit::Execute(JitContext& context, JitCode const& code, long long count) {
+	//
+	// the operands take StackSize values of the operand stack while the code runs, the calls it makes run above them;
+	// a loop starts out with its remaining count as the only operand
+	//
+	auto stack = m_OperandTop;
+	if (m_OperandEnd - stack < code.StackSize)
+		throw RuntimeError(ErrorType::StackOverflow);
+	m_OperandTop += code.StackSize;
+	if (code.Depths[0] > 0)
+		stack[0] = count;
+	context.Stack = stack;
+
+	auto scopes = m_Interpreter.ScopeDepth();
+	auto status = code.Code(&context, stack, context.Locals.Slots);
+	while (m_Interpreter.ScopeDepth() > scopes)
+		m_Interpreter.PopScope();
+	while (m_OperandTop > stack)
+		*--m_OperandTop = Value();
+	if (status == Failed)
+		rethrow_exception(context.Error);
+
+	assert(status == Leave);
+	return move(context.Result);
+}
+
+int Jit::CompiledFunctions() const {
+	return m_Functions;
+}
+
+int Jit::CompiledLoops() const {
+	return m_Loops;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Bytecode.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define LOGO2_JIT_X64
+#endif
+
+namespace Logo2 {
+	class Interpreter;
+	class RepeatStatement;
+	struct Frame;
+	struct JitContext;
+
+	//
+	// a chunk compiled to native code: the code runs the chunk's instructions in order, inline for integers
+	// and booleans and in a helper for the rest, with the chunk's jumps turned into native jumps
+	//
+	struct JitCode {
+		using Entry = int(*)(JitContext* context, Value* stack, Value* slots);
+
+		JitCode() = default;
+		~JitCode();
+		JitCode(JitCode const&) = delete;
+		JitCode& operator=(JitCode const&) = delete;
+
+		std::shared_ptr<CodeChunk> Chunk;
+		Entry Code{ nullptr };
+		size_t Size{ 0 };		// of the executable mapping at Code
+		std::vector<int> Depths;		// of the operand stack before each instruction
+		int StackSize{ 0 };			// operands the code needs at most
+	};
+
+	//
+	// what the JIT knows about a function body or repeat loop, kept on its node (LogoAstNode::JitState)
+	//
+	struct JitSite {
+		long long Count{ 0 };
+		bool Failed{ false };
+		std::unique_ptr<JitCode> Code;
+	};
+
+	//
+	// baseline tier of the tree interpreter: a function body called CallThreshold times, or a repeat
+	// loop that has run LoopThreshold iterations, is lowered to bytecode by the Compiler and from there
+	// to x86-64 code; integer arithmetic, comparisons and branches run inline, other Value operators,
+	// calls and natives run in the helpers (the slow paths)
+	// the tree walker remains the fallback for anything that cannot be compiled
+	//
+	class Jit {
+	public:
+		static constexpr int CallThreshold = 50;
+		static constexpr long long LoopThreshold = 1000;
+
+		explicit Jit(Interpreter& inter);
+		~Jit();
+
+		static bool IsSupported();
+
+		//
+		// count an execution and return the native code once it is hot (null before that, or if it cannot be compiled)
+		//
+		JitCode const* OnCall(Expression const* body, int frameSize);
+		JitCode const* OnLoop(RepeatStatement const* loop, long long count, bool topLevel);
+
+		//
+		// runs a body in the frame of the current call; returns its value
+		//
+		Value Run(JitCode const& code, Frame const* frame);
+		//
+		// runs count iterations of a loop, completed is false if a return statement ended it
+		//
+		Value RunLoop(JitCode const& code, Frame const* frame, long long count, bool& completed);
+
+		int CompiledFunctions() const;
+		int CompiledLoops() const;
+
+	private:
+		JitCode const* Tier(JitSite& site, bool body, std::function<std::shared_ptr<CodeChunk>()> compile);
+		Value Execute(JitContext& context, JitCode const& code, long long count = 0);
+
+		//
+		// the operands of all running chunks, preallocated so that running one allocates nothing;
+		// each takes the region above the one of the chunk that called it
+		//
+		static constexpr size_t OperandCapacity = 1 << 16;
+
+		Interpreter& m_Interpreter;
+		std::unique_ptr<Value[]> m_Operands;
+		Value* m_OperandTop;
+		Value* m_OperandEnd;
+		int m_Functions{ 0 }, m_Loops{ 0 };
+	};
+}
@@ -1,12 +1,95 @@
 #include "pch.h"
 #include "Logo2Ast.h"
 #include "Interpreter.h"
+#include "Jit.h"
 
 using namespace Logo2;
 using namespace std;
 
+namespace {
+	thread_local AstArena* t_CurrentArena;
+}
+
+AstArena::AstArena() : m_Resource(Heap::CurrentResource()) {
+}
+
+AstArena::~AstArena() {
+	for (auto& chunk : m_Chunks)
+		m_Resource->deallocate(chunk.Memory, chunk.Size, alignof(max_align_t));
+}
+
+void* AstArena::Allocate(size_t size) {
+	size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+	auto allocate = [&](size_t size) {
+		m_Chunks.reserve(m_Chunks.size() + 1);
+		auto memory = static_cast<byte*>(m_Resource->allocate(size, alignof(max_align_t)));
+		m_Chunks.push_back(Chunk{ memory, size });
+		return memory;
+	};
+
+	if (size > size_t(m_End - m_Next)) {
+		//
+		// a node larger than a chunk (never in practice) gets a chunk of its own, the current one stays in use
+		//
+		if (size > ChunkSize) {
+			m_Size += size;
+			return allocate(size);
+		}
+		m_Next = allocate(ChunkSize);
+		m_End = m_Next + ChunkSize;
+	}
+	auto p = m_Next;
+	m_Next += size;
+	m_Size += size;
+	return p;
+}
+
+size_t AstArena::Size() const {
+	return m_Size;
+}
+
+AstArena::Scope::Scope(AstArena& arena) : m_Previous(t_CurrentArena) {
+	t_CurrentArena = &arena;
+}
+
+AstArena::Scope::~Scope() {
+	t_CurrentArena = m_Previous;
+}
+
+AstArena* AstArena::Current() {
+	return t_CurrentArena;
+}
+
+LogoAstNode::LogoAstNode(NodeType type) : m_Type(type), m_InArena(t_CurrentArena != nullptr) {
+}
+
+LogoAstNode::~LogoAstNode() = default;
+
+JitSite& LogoAstNode::JitState() const {
+	if (!m_JitState)
+		m_JitState = make_unique<JitSite>();
+	return *m_JitState;
+}
+
+void* LogoAstNode::operator new(size_t size) {
+	return t_CurrentArena ? t_CurrentArena->Allocate(size) : ::operator new(size);
+}
+
+void LogoAstNode::operator delete(LogoAstNode* node, destroying_delete_t) {
+	auto inArena = node->m_InArena;
+	node->~LogoAstNode();
+	if (!inArena)
+		::operator delete(node);
+}
+
+void LogoAstNode::operator delete(void* p) {
+	if (!t_CurrentArena)
+		::operator delete(p);
+}
+
 BinaryExpression::BinaryExpression(unique_ptr<Expression> left, Token op, unique_ptr<Expression> right) 
-	: m_Left(move(left)), m_Right(move(right)), m_Operator(move(op)) {
+	: Expression(NodeType::Binary), m_Left(move(left)), m_Right(move(right)), m_Operator(move(op)) {
+	SetPure(m_Left->IsPure() && m_Right->IsPure());
 }
 
 Value BinaryExpression::Accept(Visitor* visitor) const {
@@ -29,25 +112,34 @@ Logo2::Token const& BinaryExpression::Operator() const {
 	return m_Operator;
 }
 
+BinaryFeedback& BinaryExpression::Feedback() const {
+	return m_Feedback;
+}
+
 PostfixExpression::PostfixExpression(unique_ptr<Expression> expr, Token token)
-	: m_Expr(move(expr)), m_Token(move(token)) {
+	: Expression(NodeType::Postfix), m_Expr(move(expr)), m_Token(move(token)) {
 }
 
 Value PostfixExpression::Accept(Visitor* visitor) const {
 	return visitor->VisitPostfix(this);
 }
 
-LiteralExpression::LiteralExpression(Token token) : m_Token(move(token)) {
+LiteralExpression::LiteralExpression(Token token) : Expression(NodeType::Literal), m_Token(move(token)) {
+	SetPure(true);
+	switch (m_Token.Type) {
+		case TokenType::Integer: m_Constant = get<0>(m_Token.Value); break;
+		case TokenType::Real: m_Constant = get<1>(m_Token.Value); break;
+		case TokenType::String: m_Constant = m_Token.Lexeme; break;
+		case TokenType::Keyword_True: m_Constant = true; break;
+		case TokenType::Keyword_False: m_Constant = false; break;
+		default: break;
+	}
 }
 
 Value LiteralExpression::Accept(Visitor* visitor) const {
 	return visitor->VisitLiteral(this);
 }
 
-NodeType Logo2::LiteralExpression::Type() const {
-	return NodeType::Literal;
-}
-
 string LiteralExpression::ToString() const {
 	return m_Token.Lexeme;
 }
@@ -56,7 +148,12 @@ Token const& LiteralExpression::Literal() const {
 	return m_Token;
 }
 
-NameExpression::NameExpression(string name) : m_Name(move(name)) {
+Value const& LiteralExpression::Constant() const {
+	return m_Constant;
+}
+
+NameExpression::NameExpression(Atom name, LocalSlot slot) : Expression(NodeType::Name), m_Name(name), m_Slot(slot) {
+	SetPure(true);
 }
 
 Value NameExpression::Accept(Visitor* visitor) const {
@@ -64,14 +161,23 @@ Value NameExpression::Accept(Visitor* visitor) const {
 }
 
 string const& NameExpression::Name() const {
+	return AtomTable::Name(m_Name);
+}
+
+Atom NameExpression::Id() const {
 	return m_Name;
 }
 
+LocalSlot const& NameExpression::Slot() const {
+	return m_Slot;
+}
+
 string NameExpression::ToString() const {
-	return m_Name;
+	return Name();
 }
 
-UnaryExpression::UnaryExpression(Token op, unique_ptr<Expression> arg) : m_Arg(move(arg)), m_Operator(move(op)) {
+UnaryExpression::UnaryExpression(Token op, unique_ptr<Expression> arg) : Expression(NodeType::Unary), m_Arg(move(arg)), m_Operator(move(op)) {
+	SetPure(m_Arg->IsPure());
 }
 
 Value UnaryExpression::Accept(Visitor* visitor) const {
@@ -90,6 +196,13 @@ Expression* UnaryExpression::Arg() const {
 	return m_Arg.get();
 }
 
+UnaryFeedback& UnaryExpression::Feedback() const {
+	return m_Feedback;
+}
+
+BlockExpression::BlockExpression() : Expression(NodeType::Block) {
+}
+
 void BlockExpression::Add(unique_ptr<LogoAstNode> node) {
 	m_Stmts.push_back(move(node));
 }
@@ -98,11 +211,8 @@ Value BlockExpression::Accept(Visitor* visitor) const {
 	return visitor->VisitBlock(this);
 }
 
-vector<LogoAstNode*> const BlockExpression::Expressions() const {
-	vector<LogoAstNode*> expr;
-	for (auto& e : m_Stmts)
-		expr.push_back(e.get());
-	return expr;
+vector<unique_ptr<LogoAstNode>> const& BlockExpression::Expressions() const {
+	return m_Stmts;
 }
 
 string BlockExpression::ToString() const {
@@ -112,8 +222,8 @@ string BlockExpression::ToString() const {
 	return result.substr(0, result.length() - 1);
 }
 
-VarStatement::VarStatement(string name, bool isConst, unique_ptr<Expression> init) 
-	: m_Name(move(name)), m_Init(move(init)), m_IsConst(isConst) {
+VarStatement::VarStatement(Atom name, bool isConst, unique_ptr<Expression> init, int slot) 
+	: Statement(NodeType::Var), m_Name(name), m_Init(move(init)), m_IsConst(isConst), m_Slot(slot) {
 }
 
 Value VarStatement::Accept(Visitor* visitor) const {
@@ -121,10 +231,14 @@ Value VarStatement::Accept(Visitor* visitor) const {
 }
 
 string VarStatement::ToString() const {
-	return format("{} = {};", m_Name, m_Init ? m_Init->ToString() : "");
+	return format("{} = {};", Name(), m_Init ? m_Init->ToString() : "");
 }
 
 string const& VarStatement::Name() const {
+	return AtomTable::Name(m_Name);
+}
+
+Atom VarStatement::Id() const {
 	return m_Name;
 }
 
@@ -136,8 +250,12 @@ bool VarStatement::IsConst() const {
 	return m_IsConst;
 }
 
-AssignExpression::AssignExpression(string name, unique_ptr<Expression> expr) 
-	: m_Name(move(name)), m_Expr(move(expr)) {
+int VarStatement::Slot() const {
+	return m_Slot;
+}
+
+AssignExpression::AssignExpression(Atom name, unique_ptr<Expression> expr, LocalSlot slot) 
+	: Expression(NodeType::Assign), m_Name(name), m_Expr(move(expr)), m_Slot(slot) {
 }
 
 Value AssignExpression::Accept(Visitor* visitor) const {
@@ -145,6 +263,10 @@ Value AssignExpression::Accept(Visitor* visitor) const {
 }
 
 string const& AssignExpression::Variable() const {
+	return AtomTable::Name(m_Name);
+}
+
+Atom AssignExpression::Id() const {
 	return m_Name;
 }
 
@@ -152,8 +274,12 @@ Expression* const AssignExpression::Value() const {
 	return m_Expr.get();
 }
 
-InvokeFunctionExpression::InvokeFunctionExpression(string name, vector<unique_ptr<Expression>> args) :
-	m_Name(move(name)), m_Arguments(move(args)) {
+LocalSlot const& AssignExpression::Slot() const {
+	return m_Slot;
+}
+
+InvokeFunctionExpression::InvokeFunctionExpression(Atom name, vector<unique_ptr<Expression>> args, LocalSlot slot, bool bound) :
+	Expression(NodeType::InvokeFunction), m_Name(name), m_Arguments(move(args)), m_Slot(slot), m_Bound(bound) {
 }
 
 Value InvokeFunctionExpression::Accept(Visitor* visitor) const {
@@ -161,6 +287,10 @@ Value InvokeFunctionExpression::Accept(Visitor* visitor) const {
 }
 
 string const& InvokeFunctionExpression::Name() const {
+	return AtomTable::Name(m_Name);
+}
+
+Atom InvokeFunctionExpression::Id() const {
 	return m_Name;
 }
 
@@ -168,8 +298,28 @@ vector<unique_ptr<Expression>> const& InvokeFunctionExpression::Arguments() cons
 	return m_Arguments;
 }
 
+LocalSlot const& InvokeFunctionExpression::Slot() const {
+	return m_Slot;
+}
+
+bool InvokeFunctionExpression::IsBound() const {
+	return m_Bound;
+}
+
+CallCache& InvokeFunctionExpression::Cache() const {
+	return m_Cache;
+}
+
+bool InvokeFunctionExpression::IsTailCall() const {
+	return m_TailCall;
+}
+
+void InvokeFunctionExpression::SetTailCall() {
+	m_TailCall = true;
+}
+
 RepeatStatement::RepeatStatement(unique_ptr<Expression> count, unique_ptr<BlockExpression> body) : 
-	m_Count(move(count)), m_Block(move(body)) {
+	Statement(NodeType::Repeat), m_Count(move(count)), m_Block(move(body)) {
 }
 
 Value RepeatStatement::Accept(Visitor* visitor) const {
@@ -184,7 +334,7 @@ BlockExpression const* RepeatStatement::Block() const {
 	return m_Block.get();
 }
 
-ExpressionStatement::ExpressionStatement(unique_ptr<Expression> expr) : m_Expr(move(expr)) {
+ExpressionStatement::ExpressionStatement(unique_ptr<Expression> expr) : Statement(NodeType::ExpressionStatement), m_Expr(move(expr)) {
 }
 
 Value ExpressionStatement::Accept(Visitor* visitor) const {
@@ -196,7 +346,7 @@ Expression const* ExpressionStatement::Expr() const {
 }
 
 Logo2::WhileStatement::WhileStatement(unique_ptr<Expression> condition, unique_ptr<BlockExpression> body) :
-	m_Condition(move(condition)), m_Body(move(body)) {
+	Statement(NodeType::While), m_Condition(move(condition)), m_Body(move(body)) {
 }
 
 Value Logo2::WhileStatement::Accept(Visitor* visitor) const {
@@ -212,7 +362,7 @@ BlockExpression const* Logo2::WhileStatement::Body() const {
 }
 
 Logo2::IfThenElseExpression::IfThenElseExpression(unique_ptr<Expression> condition, unique_ptr<Expression> thenExpr, unique_ptr<Expression> elseExpr) : 
-	m_Condition(move(condition)), m_Then(move(thenExpr)), m_Else(move(elseExpr)) {
+	Expression(NodeType::IfThenElse), m_Condition(move(condition)), m_Then(move(thenExpr)), m_Else(move(elseExpr)) {
 }
 
 Value Logo2::IfThenElseExpression::Accept(Visitor* visitor) const {
@@ -231,8 +381,8 @@ Expression const* Logo2::IfThenElseExpression::Else() const {
 	return m_Else.get();
 }
 
-Logo2::FunctionDeclaration::FunctionDeclaration(string name, vector<string> parameters, unique_ptr<Expression> body) : 
-	m_Name(move(name)), m_Parameters(move(parameters)), m_Body(move(body)) {
+Logo2::FunctionDeclaration::FunctionDeclaration(Atom name, vector<Atom> parameters, unique_ptr<Expression> body, int frameSize, vector<Capture> captures) : 
+	Statement(NodeType::FunctionDeclaration), m_Name(name), m_Parameters(move(parameters)), m_Body(move(body)), m_FrameSize(frameSize), m_Captures(move(captures)) {
 }
 
 Value Logo2::FunctionDeclaration::Accept(Visitor* visitor) const {
@@ -240,10 +390,14 @@ Value Logo2::FunctionDeclaration::Accept(Visitor* visitor) const {
 }
 
 string const& Logo2::FunctionDeclaration::Name() const {
+	return AtomTable::Name(m_Name);
+}
+
+Atom Logo2::FunctionDeclaration::Id() const {
 	return m_Name;
 }
 
-vector<string> const& Logo2::FunctionDeclaration::Parameters() const {
+vector<Atom> const& Logo2::FunctionDeclaration::Parameters() const {
 	return m_Parameters;
 }
 
@@ -251,7 +405,15 @@ Expression const* Logo2::FunctionDeclaration::Body() const {
 	return m_Body.get();
 }
 
-Logo2::ReturnStatement::ReturnStatement(unique_ptr<Expression> expr) : m_Expr(move(expr)) {
+int Logo2::FunctionDeclaration::FrameSize() const {
+	return m_FrameSize;
+}
+
+vector<Capture> const& Logo2::FunctionDeclaration::Captures() const {
+	return m_Captures;
+}
+
+Logo2::ReturnStatement::ReturnStatement(unique_ptr<Expression> expr) : Statement(NodeType::Return), m_Expr(move(expr)) {
 }
 
 Value Logo2::ReturnStatement::Accept(Visitor* visitor) const {
@@ -262,7 +424,7 @@ Expression const* Logo2::ReturnStatement::ReturnValue() const {
 	return m_Expr.get();
 }
 
-Logo2::BreakOrContinueStatement::BreakOrContinueStatement(bool cont) : m_IsContinue(cont) {
+Logo2::BreakOrContinueStatement::BreakOrContinueStatement(bool cont) : Statement(NodeType::BreakContinue), m_IsContinue(cont) {
 }
 
 Value Logo2::BreakOrContinueStatement::Accept(Visitor* visitor) const {
@@ -274,7 +436,7 @@ bool Logo2::BreakOrContinueStatement::IsContinue() const {
 }
 
 Logo2::ForStatement::ForStatement(unique_ptr<Statement> init, unique_ptr<Expression> whileExpr, unique_ptr<Expression> incExpr, unique_ptr<BlockExpression> body) :
-	m_Init(move(init)), m_While(move(whileExpr)), m_Inc(move(incExpr)), m_Body(move(body)) {
+	Statement(NodeType::For), m_Init(move(init)), m_While(move(whileExpr)), m_Inc(move(incExpr)), m_Body(move(body)) {
 }
 
 Value Logo2::ForStatement::Accept(Visitor* visitor) const {
@@ -297,6 +459,9 @@ BlockExpression const* Logo2::ForStatement::Body() const {
 	return m_Body.get();
 }
 
+Statements::Statements() : Statement(NodeType::Statements) {
+}
+
 Value Statements::Accept(Visitor* visitor) const {
 	return visitor->VisitStatements(this);
 }
@@ -309,15 +474,19 @@ vector<unique_ptr<Statement>> const& Statements::Get() const {
 	return m_Stmts;
 }
 
-AnonymousFunctionExpression::AnonymousFunctionExpression(vector<string> args, unique_ptr<Expression> body) :
-	m_Args(move(args)), m_Body(move(body)) {
+void Statements::SetArena(unique_ptr<AstArena> arena) {
+	m_Arena = move(arena);
+}
+
+AnonymousFunctionExpression::AnonymousFunctionExpression(vector<Atom> args, unique_ptr<Expression> body, int frameSize, vector<Capture> captures) :
+	Expression(NodeType::AnonymousFunction), m_Args(move(args)), m_Body(move(body)), m_FrameSize(frameSize), m_Captures(move(captures)) {
 }
 
 Value Logo2::AnonymousFunctionExpression::Accept(Visitor* visitor) const {
 	return visitor->VisitAnonymousFunction(this);
 }
 
-vector<string> const& Logo2::AnonymousFunctionExpression::Args() const {
+vector<Atom> const& Logo2::AnonymousFunctionExpression::Args() const {
 	return m_Args;
 }
 
@@ -325,11 +494,19 @@ Expression const* Logo2::AnonymousFunctionExpression::Body() const {
 	return m_Body.get();
 }
 
+int Logo2::AnonymousFunctionExpression::FrameSize() const {
+	return m_FrameSize;
+}
+
+vector<Capture> const& Logo2::AnonymousFunctionExpression::Captures() const {
+	return m_Captures;
+}
+
 bool Logo2::Statement::IsStatement() const {
 	return true;
 }
 
-Logo2::EnumDeclaration::EnumDeclaration(std::string name, std::unordered_map<std::string, long long> values) : m_Name(move(name)), m_Values(move(values)) {
+Logo2::EnumDeclaration::EnumDeclaration(std::string name, std::unordered_map<std::string, long long> values) : Statement(NodeType::EnumDeclaration), m_Name(move(name)), m_Values(move(values)) {
 }
 
 Value Logo2::EnumDeclaration::Accept(Visitor* visitor) const {
@@ -339,3 +516,95 @@ Value Logo2::EnumDeclaration::Accept(Visitor* visitor) const {
 std::string const& Logo2::EnumDeclaration::Name() const {
 	return m_Name;
 }
+
+ArrayExpression::ArrayExpression(vector<unique_ptr<Expression>> elements) : Expression(NodeType::Array), m_Elements(move(elements)) {
+}
+
+Value ArrayExpression::Accept(Visitor* visitor) const {
+	return visitor->VisitArray(this);
+}
+
+vector<unique_ptr<Expression>> const& ArrayExpression::Elements() const {
+	return m_Elements;
+}
+
+DictionaryExpression::DictionaryExpression(vector<Entry> entries) : Expression(NodeType::Dictionary), m_Entries(move(entries)) {
+}
+
+Value DictionaryExpression::Accept(Visitor* visitor) const {
+	return visitor->VisitDictionary(this);
+}
+
+vector<DictionaryExpression::Entry> const& DictionaryExpression::Entries() const {
+	return m_Entries;
+}
+
+IndexExpression::IndexExpression(unique_ptr<Expression> container, unique_ptr<Expression> index) : Expression(NodeType::Index), m_Container(move(container)), m_Index(move(index)) {
+	SetPure(m_Container->IsPure() && m_Index->IsPure());
+}
+
+Value IndexExpression::Accept(Visitor* visitor) const {
+	return visitor->VisitIndex(this);
+}
+
+Expression const* IndexExpression::Container() const {
+	return m_Container.get();
+}
+
+Expression const* IndexExpression::Index() const {
+	return m_Index.get();
+}
+
+MemberExpression::MemberExpression(unique_ptr<Expression> object, Atom field) : Expression(NodeType::Member), m_Object(move(object)), m_Field(field) {
+	SetPure(m_Object->IsPure());
+}
+
+Value MemberExpression::Accept(Visitor* visitor) const {
+	return visitor->VisitMember(this);
+}
+
+Expression const* MemberExpression::Object() const {
+	return m_Object.get();
+}
+
+Atom MemberExpression::Field() const {
+	return m_Field;
+}
+
+string const& MemberExpression::FieldName() const {
+	return AtomTable::Name(m_Field);
+}
+
+FieldCache& MemberExpression::Cache() const {
+	return m_Cache;
+}
+
+AssignMemberExpression::AssignMemberExpression(unique_ptr<MemberExpression> target, unique_ptr<Expression> expr) : Expression(NodeType::AssignMember), m_Target(move(target)), m_Expr(move(expr)) {
+}
+
+Value AssignMemberExpression::Accept(Visitor* visitor) const {
+	return visitor->VisitAssignMember(this);
+}
+
+MemberExpression const* AssignMemberExpression::Target() const {
+	return m_Target.get();
+}
+
+Expression const* AssignMemberExpression::Value() const {
+	return m_Expr.get();
+}
+
+AssignIndexExpression::AssignIndexExpression(unique_ptr<IndexExpression> target, unique_ptr<Expression> expr) : Expression(NodeType::AssignIndex), m_Target(move(target)), m_Expr(move(expr)) {
+}
+
+Value AssignIndexExpression::Accept(Visitor* visitor) const {
+	return visitor->VisitAssignIndex(this);
+}
+
+IndexExpression const* AssignIndexExpression::Target() const {
+	return m_Target.get();
+}
+
+Expression const* AssignIndexExpression::Value() const {
+	return m_Expr.get();
+}
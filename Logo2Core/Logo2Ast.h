@@ -5,24 +5,136 @@
 #include "Visitor.h"
 
 namespace Logo2 {
-	enum class NodeType {
-		Invalid,
-		Name,
-		For,
+	//
+	// the concrete class of a node, so that code walking the tree can switch on it instead of dispatching through Accept
+	//
+	enum class NodeType : uint8_t {
+		Statements,
+		ExpressionStatement,
 		Var,
+		Repeat,
+		While,
+		For,
+		BreakContinue,
+		Return,
+		EnumDeclaration,
+		FunctionDeclaration,
+		Block,
+		Assign,
+		AssignIndex,
+		AssignMember,
+		IfThenElse,
+		Postfix,
+		Binary,
+		Unary,
 		Literal,
+		Name,
+		InvokeFunction,
+		AnonymousFunction,
+		Array,
+		Dictionary,
+		Index,
+		Member,
+	};
+
+	//
+	// compile time location of a local variable: a slot in the current function frame,
+	// or (IsUpvalue) an index into the captures of the running closure
+	// Index < 0 means the name is global or late bound and must be looked up by name
+	//
+	struct LocalSlot {
+		int Index{ -1 };
+		bool IsUpvalue{ false };
+
+		bool IsResolved() const {
+			return Index >= 0;
+		}
+	};
+
+	//
+	// a variable captured by a function when it is created: a slot of the enclosing
+	// function's frame (FromLocal) or one of the enclosing function's own captures
+	//
+	struct Capture {
+		bool FromLocal;
+		int Index;
+		Atom Name{ Atom::None };		// a variable of a top-level block, copied when the closure is created
+
+		bool operator==(Capture const&) const = default;
 	};
 
+	//
+	// bump allocator for the nodes of one parse: nodes are carved out of large chunks and released all at once
+	// with the arena, rather than allocated and freed one by one
+	// the chunks come from the pools of the heap current when the arena is made
+	//
+	class AstArena {
+	public:
+		AstArena();
+		~AstArena();
+		AstArena(AstArena const&) = delete;
+		AstArena& operator=(AstArena const&) = delete;
+
+		void* Allocate(size_t size);
+		size_t Size() const;		// bytes handed out
+
+		//
+		// the arena nodes are allocated from while it is alive (on this thread)
+		//
+		class Scope {
+		public:
+			explicit Scope(AstArena& arena);
+			~Scope();
+			Scope(Scope const&) = delete;
+			Scope& operator=(Scope const&) = delete;
+
+		private:
+			AstArena* m_Previous;
+		};
+		static AstArena* Current();
+
+	private:
+		static constexpr size_t ChunkSize = 32 * 1024;
+
+		struct Chunk {
+			std::byte* Memory;
+			size_t Size;
+		};
+
+		std::pmr::memory_resource* m_Resource;
+		std::vector<Chunk> m_Chunks;
+		std::byte* m_Next{ nullptr };
+		std::byte* m_End{ nullptr };
+		size_t m_Size{ 0 };
+	};
+
+	struct JitSite;
+
 	class LogoAstNode abstract {
 	public:
-		virtual ~LogoAstNode() = default;
+		virtual ~LogoAstNode();
 		virtual std::string ToString() const {
 			return "";
 		}
 
-		virtual NodeType Type() const {
-			return NodeType::Invalid;
+		NodeType Type() const {
+			return m_Type;
+		}
+
+		//
+		// evaluating the node has no effects (it only reads variables, literals and elements and applies operators to them),
+		// so a value borrowed before it is evaluated stays valid and unchanged
+		//
+		bool IsPure() const {
+			return m_Pure;
 		}
+
+		//
+		// nodes come from the current arena if there is one, deleting them then only runs their destructor
+		//
+		static void* operator new(size_t size);
+		static void operator delete(LogoAstNode* node, std::destroying_delete_t);
+		static void operator delete(void* p);		// a constructor threw
 		virtual Value Accept(Visitor* visitor) const = 0;
 		virtual bool IsStatement() const {
 			return false;
@@ -31,20 +143,44 @@ namespace Logo2 {
 		virtual bool IsExpression() const {
 			return false;
 		}
+
+		//
+		// the JIT's counters and code for a function body or repeat loop live on the node,
+		// so they go away with the AST (a later parse may reuse its memory)
+		//
+		JitSite& JitState() const;
+
+	protected:
+		explicit LogoAstNode(NodeType type);
+		void SetPure(bool pure) {
+			m_Pure = pure;
+		}
+
+	private:
+		NodeType m_Type;
+		bool m_InArena;
+		bool m_Pure{ false };
+		mutable std::unique_ptr<JitSite> m_JitState;
 	};
 
 	class Statement abstract : public LogoAstNode {
 	public:
 		bool IsStatement() const override;
+
+	protected:
+		using LogoAstNode::LogoAstNode;
 	};
 
 	class Statements final : public Statement {
 	public:
+		Statements();
 		Value Accept(Visitor* visitor) const override;
 		void Add(std::unique_ptr<Statement> stmt);
 		std::vector<std::unique_ptr<Statement>> const& Get() const;
+		void SetArena(std::unique_ptr<AstArena> arena);		// the arena of the nodes below the root
 
 	private:
+		std::unique_ptr<AstArena> m_Arena;		// declared first: destroyed after the nodes it holds
 		std::vector<std::unique_ptr<Statement>> m_Stmts;
 	};
 
@@ -53,6 +189,9 @@ namespace Logo2 {
 		virtual bool IsExpression() const override {
 			return true;
 		}
+
+	protected:
+		using Statement::Statement;
 	};
 
 	class ExpressionStatement final : public Statement {
@@ -67,21 +206,25 @@ namespace Logo2 {
 
 	class AssignExpression : public Expression {
 	public:
-		AssignExpression(std::string name, std::unique_ptr<Expression> expr);
+		AssignExpression(Atom name, std::unique_ptr<Expression> expr, LocalSlot slot = {});
 		Value Accept(Visitor* visitor) const override;
 		std::string const& Variable() const;
+		Atom Id() const;
 		Expression* const Value() const;
+		LocalSlot const& Slot() const;
 
 	private:
-		std::string m_Name;
+		Atom m_Name;
 		std::unique_ptr<Expression> m_Expr;
+		LocalSlot m_Slot;
 	};
 
 	class BlockExpression : public Expression {
 	public:
+		BlockExpression();
 		void Add(std::unique_ptr<LogoAstNode> node);
 		Value Accept(Visitor* visitor) const override;
-		std::vector<LogoAstNode*> const Expressions() const;
+		std::vector<std::unique_ptr<LogoAstNode>> const& Expressions() const;
 		std::string ToString() const override;
 
 	private:
@@ -90,21 +233,21 @@ namespace Logo2 {
 
 	class VarStatement : public Statement {
 	public:
-		VarStatement(std::string name, bool isConst, std::unique_ptr<Expression> init);
-		NodeType Type() const override {
-			return NodeType::Var;
-		}
+		VarStatement(Atom name, bool isConst, std::unique_ptr<Expression> init, int slot = -1);
 		Value Accept(Visitor* visitor) const override;
 		std::string ToString() const override;
 
 		std::string const& Name() const;
+		Atom Id() const;
 		Expression const* Init() const;
 		bool IsConst() const;
+		int Slot() const;
 
 	private:
-		std::string m_Name;
+		Atom m_Name;
 		std::unique_ptr<Expression> m_Init;
 		bool m_IsConst;
+		int m_Slot;
 	};
 
 	class RepeatStatement : public Statement {
@@ -182,17 +325,22 @@ namespace Logo2 {
 
 	class FunctionDeclaration : public Statement {
 	public:
-		FunctionDeclaration(std::string name, std::vector<std::string> parameters, std::unique_ptr<Expression> body);
+		FunctionDeclaration(Atom name, std::vector<Atom> parameters, std::unique_ptr<Expression> body, int frameSize = 0, std::vector<Capture> captures = {});
 		Value Accept(Visitor* visitor) const override;
 
 		std::string const& Name() const;
-		std::vector<std::string> const& Parameters() const;
+		Atom Id() const;
+		std::vector<Atom> const& Parameters() const;
 		Expression const* Body() const;
+		int FrameSize() const;
+		std::vector<Capture> const& Captures() const;
 
 	private:
-		std::string m_Name;
-		std::vector<std::string> m_Parameters;
+		Atom m_Name;
+		std::vector<Atom> m_Parameters;
 		std::unique_ptr<Expression> m_Body;
+		int m_FrameSize;
+		std::vector<Capture> m_Captures;
 	};
 
 	class PostfixExpression : public Expression {
@@ -218,10 +366,12 @@ namespace Logo2 {
 		Expression* Left() const;
 		Expression* Right() const;
 		Token const& Operator() const;
+		BinaryFeedback& Feedback() const;
 
 	private:
 		std::unique_ptr<Expression> m_Left, m_Right;
 		Token m_Operator;
+		mutable BinaryFeedback m_Feedback;
 	};
 
 	class UnaryExpression : public Expression {
@@ -231,10 +381,12 @@ namespace Logo2 {
 		std::string ToString() const override;
 		Token const& Operator() const;
 		Expression* Arg() const;
+		UnaryFeedback& Feedback() const;
 
 	private:
 		std::unique_ptr<Expression> m_Arg;
 		Token m_Operator;
+		mutable UnaryFeedback m_Feedback;
 	};
 
 	class LiteralExpression : public Expression {
@@ -242,38 +394,121 @@ namespace Logo2 {
 		explicit LiteralExpression(Token token);
 		Value Accept(Visitor* visitor) const override;
 
-		NodeType Type() const override;
 		std::string ToString() const override;
 		Token const& Literal() const;
+		Value const& Constant() const;		// the value of the literal, made once
 
 	private:
 		Token m_Token;
+		Value m_Constant;
 	};
 
 	class NameExpression : public Expression {
 	public:
-		explicit NameExpression(std::string name);
-		NodeType Type() const override {
-			return NodeType::Name;
-		}
+		explicit NameExpression(Atom name, LocalSlot slot = {});
 		Value Accept(Visitor* visitor) const override;
 		std::string const& Name() const;
+		Atom Id() const;
+		LocalSlot const& Slot() const;
 		std::string ToString() const override;
 
 	private:
-		std::string m_Name;
+		Atom m_Name;
+		LocalSlot m_Slot;
 	};
 
 	class InvokeFunctionExpression : public Expression {
 	public:
-		InvokeFunctionExpression(std::string name, std::vector<std::unique_ptr<Expression>> args);
+		InvokeFunctionExpression(Atom name, std::vector<std::unique_ptr<Expression>> args, LocalSlot slot = {}, bool bound = false);
 		Value Accept(Visitor* visitor) const override;
 		std::string const& Name() const;
+		Atom Id() const;
 		std::vector<std::unique_ptr<Expression>> const& Arguments() const;
+		LocalSlot const& Slot() const;		// local variable holding the callee, if not a named function
+		bool IsBound() const;				// the parser proved the callee is a named function
+		CallCache& Cache() const;
+		bool IsTailCall() const;			// its value is returned by the enclosing function as is
+		void SetTailCall();
 
 	private:
-		std::string m_Name;
+		Atom m_Name;
 		std::vector<std::unique_ptr<Expression>> m_Arguments;
+		LocalSlot m_Slot;
+		bool m_Bound;
+		bool m_TailCall{ false };
+		mutable CallCache m_Cache;
+	};
+
+	class ArrayExpression : public Expression {
+	public:
+		explicit ArrayExpression(std::vector<std::unique_ptr<Expression>> elements);
+		Value Accept(Visitor* visitor) const override;
+		std::vector<std::unique_ptr<Expression>> const& Elements() const;
+
+	private:
+		std::vector<std::unique_ptr<Expression>> m_Elements;
+	};
+
+	class DictionaryExpression : public Expression {
+	public:
+		using Entry = std::pair<std::unique_ptr<Expression>, std::unique_ptr<Expression>>;		// key, value
+
+		explicit DictionaryExpression(std::vector<Entry> entries);
+		Value Accept(Visitor* visitor) const override;
+		std::vector<Entry> const& Entries() const;
+
+	private:
+		std::vector<Entry> m_Entries;
+	};
+
+	class IndexExpression : public Expression {
+	public:
+		IndexExpression(std::unique_ptr<Expression> container, std::unique_ptr<Expression> index);
+		Value Accept(Visitor* visitor) const override;
+		Expression const* Container() const;
+		Expression const* Index() const;
+
+	private:
+		std::unique_ptr<Expression> m_Container, m_Index;
+	};
+
+	class MemberExpression : public Expression {
+	public:
+		MemberExpression(std::unique_ptr<Expression> object, Atom field);
+		Value Accept(Visitor* visitor) const override;
+		Expression const* Object() const;
+		Atom Field() const;
+		std::string const& FieldName() const;
+		FieldCache& Cache() const;
+
+	private:
+		std::unique_ptr<Expression> m_Object;
+		Atom m_Field;
+		mutable FieldCache m_Cache;
+	};
+
+	class AssignMemberExpression : public Expression {
+	public:
+		AssignMemberExpression(std::unique_ptr<MemberExpression> target, std::unique_ptr<Expression> expr);
+		Value Accept(Visitor* visitor) const override;
+		MemberExpression const* Target() const;
+		Expression const* Value() const;
+
+	private:
+		std::unique_ptr<MemberExpression> m_Target;
+		std::unique_ptr<Expression> m_Expr;
+	};
+
+	class AssignIndexExpression : public Expression {
+	public:
+		AssignIndexExpression(std::unique_ptr<IndexExpression> target, std::unique_ptr<Expression> expr);
+		Value Accept(Visitor* visitor) const override;
+		IndexExpression const* Target() const;
+		Expression const* Value() const;
+
+	private:
+		std::unique_ptr<IndexExpression> m_Target;
+		std::unique_ptr<Expression> m_Expr;
 	};
 
 	class ForStatement : public Statement {
@@ -294,14 +529,18 @@ namespace Logo2 {
 
 	class AnonymousFunctionExpression : public Expression {
 	public:
-		AnonymousFunctionExpression(std::vector<std::string> args, std::unique_ptr<Expression> body);
+		AnonymousFunctionExpression(std::vector<Atom> args, std::unique_ptr<Expression> body, int frameSize = 0, std::vector<Capture> captures = {});
 		Value Accept(Visitor* visitor) const override;
-		std::vector<std::string> const& Args() const;
+		std::vector<Atom> const& Args() const;
 		Expression const* Body() const;
+		int FrameSize() const;
+		std::vector<Capture> const& Captures() const;
 
 	private:
-		std::vector<std::string> m_Args;
+		std::vector<Atom> m_Args;
 		std::unique_ptr<Expression> m_Body;
+		int m_FrameSize;
+		std::vector<Capture> m_Captures;
 	};
 
 }
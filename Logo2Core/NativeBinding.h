@@ -0,0 +1,105 @@
+#pragma once
+
+#include "Value.h"
+
+namespace Logo2 {
+	//
+	// compile time adapters from C++ functions to the NativeCall convention
+	// each parameter is converted from the corresponding argument, the result (if any) back to a Value
+	//
+	namespace Native {
+		template<typename T, typename U = std::remove_cvref_t<T>>
+		U FromValue(Value const& v) {
+			if constexpr (std::is_same_v<U, Value>)
+				return v;
+			else if constexpr (std::is_same_v<U, bool>)
+				return v.ToBoolean();
+			else if constexpr (std::is_floating_point_v<U>)
+				return static_cast<U>(v.ToDouble());
+			else if constexpr (std::is_integral_v<U>)
+				return static_cast<U>(v.ToInteger());
+			else if constexpr (std::is_same_v<U, std::string>)
+				return v.ToString();
+			else
+				static_assert(!sizeof(U), "unsupported native parameter type");
+		}
+
+		template<typename T>
+		Value ToValue(T&& result) {
+			using U = std::remove_cvref_t<T>;
+			if constexpr (std::is_same_v<U, Value> || std::is_same_v<U, bool> || std::is_same_v<U, std::string>)
+				return Value(std::forward<T>(result));
+			else if constexpr (std::is_floating_point_v<U>)
+				return Value(static_cast<double>(result));
+			else if constexpr (std::is_integral_v<U>)
+				return Value(static_cast<long long>(result));
+			else
+				static_assert(!sizeof(U), "unsupported native return type");
+		}
+
+		template<auto F, typename Signature = decltype(F)>
+		struct Binder;
+
+		template<auto F, typename R, typename... Args>
+		struct Binder<F, R(*)(Args...)> {
+			static constexpr int Arity = sizeof...(Args);
+
+			static Value Call(Interpreter&, void*, std::span<const Value> args) {
+				return Invoke(args, std::index_sequence_for<Args...>{});
+			}
+
+		private:
+			template<size_t... I>
+			static Value Invoke(std::span<const Value> args, std::index_sequence<I...>) {
+				if constexpr (std::is_void_v<R>) {
+					F(FromValue<Args>(args[I])...);
+					return Value();
+				}
+				else
+					return ToValue(F(FromValue<Args>(args[I])...));
+			}
+		};
+
+		template<auto F, typename C, typename R, typename... Args>
+		struct Binder<F, R(C::*)(Args...)> {
+			using Class = C;
+			static constexpr int Arity = sizeof...(Args);
+
+			static Value Call(Interpreter&, void* object, std::span<const Value> args) {
+				return Invoke(static_cast<C*>(object), args, std::index_sequence_for<Args...>{});
+			}
+
+		private:
+			template<size_t... I>
+			static Value Invoke(C* object, std::span<const Value> args, std::index_sequence<I...>) {
+				if constexpr (std::is_void_v<R>) {
+					(object->*F)(FromValue<Args>(args[I])...);
+					return Value();
+				}
+				else
+					return ToValue((object->*F)(FromValue<Args>(args[I])...));
+			}
+		};
+
+		template<auto F, typename C, typename R, typename... Args>
+		struct Binder<F, R(C::*)(Args...) const> {
+			using Class = C const;
+			static constexpr int Arity = sizeof...(Args);
+
+			static Value Call(Interpreter&, void* object, std::span<const Value> args) {
+				return Invoke(static_cast<C const*>(object), args, std::index_sequence_for<Args...>{});
+			}
+
+		private:
+			template<size_t... I>
+			static Value Invoke(C const* object, std::span<const Value> args, std::index_sequence<I...>) {
+				if constexpr (std::is_void_v<R>) {
+					(object->*F)(FromValue<Args>(args[I])...);
+					return Value();
+				}
+				else
+					return ToValue((object->*F)(FromValue<Args>(args[I])...));
+			}
+		};
+	}
+}
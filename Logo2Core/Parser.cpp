@@ -15,6 +15,7 @@ Parser::Parser(Tokenizer& t) : m_Tokenizer(t) {
 
 unique_ptr<LogoAstNode> Parser::Parse(string text, int line) {
 	m_Tokenizer.Tokenize(move(text), line);
+	m_AheadCount = 0;
 	m_Errors.clear();
 	return DoParse();
 }
@@ -77,7 +78,7 @@ unique_ptr<VarStatement> Parser::ParseVarConstStatement(bool constant) {
 		throw ParseError(ParseErrorType::IdentifierExpected, name);
 
 	{
-		auto sym = FindSymbol(name.Lexeme, true);
+		auto sym = FindSymbol(name.Id, true);
 		if (sym)
 			throw ParseError(ParseErrorType::DuplicateDefinition, name, format("Symbol {} already defined in scope", name.Lexeme));
 	}
@@ -94,12 +95,13 @@ unique_ptr<VarStatement> Parser::ParseVarConstStatement(bool constant) {
 	if (!Match(TokenType::SemiColon))
 		throw ParseError(ParseErrorType::SemicolonExpected, Peek());
 	Symbol sym;
-	sym.Name = name.Lexeme;
+	sym.Name = name.Id;
 	sym.Type = SymbolType::Variable;
 	sym.Flags = constant ? SymbolFlags::Const : SymbolFlags::None;
 	if (!AddSymbol(sym))
 		throw ParseError(ParseErrorType::DuplicateDefinition, name);
-	return make_unique<VarStatement>(name.Lexeme, constant, move(init));
+	auto slot = FindSymbol(name.Id, true)->Slot;
+	return make_unique<VarStatement>(name.Id, constant, move(init), slot);
 }
 
 unique_ptr<FunctionDeclaration> Parser::ParseFunctionDeclaration() {
@@ -108,43 +110,48 @@ unique_ptr<FunctionDeclaration> Parser::ParseFunctionDeclaration() {
 	if (ident.Type != TokenType::Identifier)
 		throw ParseError(ParseErrorType::IdentifierExpected, ident);
 
-	auto sym = FindSymbol(ident.Lexeme);
+	auto sym = FindSymbol(ident.Id);
 	if (sym)
 		AddError(ParseError(ParseErrorType::DuplicateDefinition, ident));
 
 	if (!Match(TokenType::OpenParen))
 		throw ParseError(ParseErrorType::OpenParenExpected, ident);
 
-	PushScope();
 	//
 	// get list of arguments
 	//
-	vector<string> parameters;
+	vector<Atom> parameters;
 	while (Peek().Type != TokenType::CloseParen) {
 		auto param = Next();
 		if (param.Type != TokenType::Identifier)
 			throw ParseError(ParseErrorType::IdentifierExpected, ident);
-		parameters.push_back(param.Lexeme);
+		parameters.push_back(param.Id);
 		Match(TokenType::Comma);
 	}
 
 	Next();		// eat close paren
-	unique_ptr<Expression> body;
-	if (Match(TokenType::GoesTo))
-		body = ParseExpression();
-	else
-		body = ParseBlock(parameters);
 
-	auto decl = make_unique<FunctionDeclaration>(move(ident.Lexeme), move(parameters), move(body));
-	if (decl && sym == nullptr) {
+	//
+	// declared before the body is parsed, so recursive calls bind statically
+	//
+	if (sym == nullptr) {
 		Symbol sym;
-		sym.Name = decl->Name();
+		sym.Name = ident.Id;
 		sym.Type = SymbolType::Function;
 		sym.Flags = SymbolFlags::None;
 		AddSymbol(sym);
 	}
-	PopScope();
-	return decl;
+	PushFunctionScope(parameters);
+	unique_ptr<Expression> body;
+	if (Match(TokenType::GoesTo)) {
+		body = ParseExpression();
+		MarkTailCall(body.get());
+	}
+	else
+		body = ParseBlock();
+
+	auto scope = PopFunctionScope();
+	return make_unique<FunctionDeclaration>(ident.Id, move(parameters), move(body), scope.FrameSize, move(scope.Captures));
 }
 
 unique_ptr<RepeatStatement> Parser::ParseRepeatStatement() {
@@ -168,20 +175,11 @@ unique_ptr<WhileStatement> Parser::ParseWhileStatement() {
 	return make_unique<WhileStatement>(move(cond), move(block));
 }
 
-unique_ptr<BlockExpression> Parser::ParseBlock(vector<string> const& args) {
+unique_ptr<BlockExpression> Parser::ParseBlock() {
 	if (!Match(TokenType::OpenBrace))
 		AddError(ParseError(ParseErrorType::OpenBraceExpected, Peek()));
 
 	PushScope();
-
-	for (auto& arg : args) {
-		Symbol sym;
-		sym.Name = arg;
-		sym.Flags = SymbolFlags::None;
-		sym.Type = SymbolType::Argument;
-		AddSymbol(sym);
-	}
-
 	auto block = make_unique<BlockExpression>();
 	while (Peek().Type != TokenType::CloseBrace) {
 		auto stmt = ParseStatement();
@@ -215,6 +213,7 @@ unique_ptr<Statement> Parser::ParseStatement() {
 		case TokenType::SemiColon: 
 			Next();		// eat semicolon empty statement
 			return ParseStatement();
+		default: break;
 	}
 	auto expr = ParseExpression();
 	if (expr) {
@@ -232,6 +231,7 @@ unique_ptr<ReturnStatement> Parser::ParseReturnStatement() {
 	if (expr) {
 		if (!Match(TokenType::SemiColon))
 			AddError(ParseError(ParseErrorType::SemicolonExpected, Peek()));
+		MarkTailCall(expr.get());
 		return make_unique<ReturnStatement>(move(expr));
 	}
 	return nullptr;
@@ -272,7 +272,7 @@ unique_ptr<EnumDeclaration> Logo2::Parser::ParseEnumDeclaration() {
 		SkipTo(TokenType::CloseBrace);
 		return nullptr;
 	}
-	auto sym = FindSymbol(name.Lexeme);
+	auto sym = FindSymbol(name.Id);
 	if (sym) {
 		AddError(ParseError(ParseErrorType::DuplicateDefinition, name, "Idenitifier already defined in current scope"));
 	}
@@ -310,7 +310,7 @@ unique_ptr<EnumDeclaration> Logo2::Parser::ParseEnumDeclaration() {
 	auto decl = make_unique<EnumDeclaration>(move(name.Lexeme), move(values));
 	{
 		Symbol sym;
-		sym.Name = decl->Name();
+		sym.Name = name.Id;
 		sym.Type = SymbolType::Enum;
 		sym.Flags = SymbolFlags::None;
 		AddSymbol(sym);
@@ -319,14 +319,39 @@ unique_ptr<EnumDeclaration> Logo2::Parser::ParseEnumDeclaration() {
 	return decl;
 }
 
-void Logo2::Parser::PushScope() {
-	m_Symbols.push(make_unique<SymbolTable>(m_Symbols.top().get()));
+void Logo2::Parser::PushScope(bool frame) {
+	m_Symbols.push(make_unique<SymbolTable>(m_Symbols.top().get(), frame));
 }
 
 void Logo2::Parser::PopScope() {
 	m_Symbols.pop();
 }
 
+void Parser::PushFunctionScope(vector<Atom> const& parameters) {
+	//
+	// parameters take the first slots of the frame, in order
+	//
+	PushScope(true);
+	m_Functions.push_back({ m_Symbols.top().get() });
+	for (auto& param : parameters) {
+		Symbol sym;
+		sym.Name = param;
+		sym.Flags = SymbolFlags::None;
+		sym.Type = SymbolType::Argument;
+		if (!AddSymbol(sym))
+			throw ParseError(ParseErrorType::DuplicateDefinition, Peek(), format("Duplicate parameter '{}'", AtomTable::Name(param)));
+	}
+}
+
+Parser::FunctionScope Parser::PopFunctionScope() {
+	assert(!m_Functions.empty() && m_Functions.back().Symbols == m_Symbols.top().get());
+	auto scope = move(m_Functions.back());
+	m_Functions.pop_back();
+	scope.FrameSize = m_Symbols.top()->FrameSize();
+	PopScope();
+	return scope;
+}
+
 void Parser::Init() {
 	vector<pair<string, TokenType>> tokens{
 		{ "+", TokenType::Add },
@@ -365,6 +390,8 @@ void Parser::Init() {
 		{ ";", TokenType::SemiColon },
 		{ ",", TokenType::Comma },
 		{ "::", TokenType::ScopeRes },
+		{ ":", TokenType::Colon },
+		{ ".", TokenType::Dot },
 		{ "=>", TokenType::GoesTo },
 		{ "null", TokenType::Keyword_Null },
 		{ "true", TokenType::Keyword_True },
@@ -399,6 +426,8 @@ void Parser::Init() {
 	AddParslet(TokenType::Integer, make_unique<LiteralParslet>());
 	AddParslet(TokenType::String, make_unique<LiteralParslet>());
 	AddParslet(TokenType::Keyword_True, make_unique<LiteralParslet>());
+	AddParslet(TokenType::Keyword_False, make_unique<LiteralParslet>());
+	AddParslet(TokenType::Keyword_Null, make_unique<LiteralParslet>());
 	AddParslet(TokenType::Real, make_unique<LiteralParslet>());
 	AddParslet(TokenType::Identifier, make_unique<NameParslet>());
 	AddParslet(TokenType::OpenParen, make_unique<GroupParslet>());
@@ -416,37 +445,59 @@ void Parser::Init() {
 	AddParslet(TokenType::Or, make_unique<BinaryOperatorParslet>(390));
 	AddParslet(TokenType::Xor, make_unique<BinaryOperatorParslet>(390));
 	AddParslet(TokenType::Keyword_Fn, make_unique<AnonymousFunctionParslet>());
+	AddParslet(TokenType::OpenBracket, make_unique<ArrayParslet>());
+	AddParslet(TokenType::OpenBracket, make_unique<IndexParslet>());
+	AddParslet(TokenType::Dot, make_unique<MemberParslet>());
 }
 
 unique_ptr<Statements> Parser::DoParse() {
+	//
+	// the nodes are allocated from an arena owned by the (heap allocated) root; the arena is declared
+	// before the root so a parse error unwinds the nodes before releasing their memory
+	//
+	auto arena = make_unique<AstArena>();
 	auto block = make_unique<Statements>();
-	while (true) {
-		auto stmt = ParseStatement();
-		if (stmt == nullptr)
-			break;
-		block->Add(move(stmt));
+	{
+		AstArena::Scope scope(*arena);
+		while (true) {
+			auto stmt = ParseStatement();
+			if (stmt == nullptr)
+				break;
+			block->Add(move(stmt));
+		}
 	}
+	block->SetArena(move(arena));
 	return block;
 }
 
 int Parser::GetPrecedence() const {
-	auto token = Peek();
+	auto const& token = Peek();
 	if (auto it = m_InfixParslets.find(token.Type); it != m_InfixParslets.end())
 		return it->second->Precedence();
 	return 0;
 }
 
+void Parser::ReadAhead(size_t count) const {
+	for (; m_AheadCount < count; m_AheadCount++)
+		m_Ahead[(m_First + m_AheadCount) % Lookahead] = m_Tokenizer.Next();
+}
+
 Token Parser::Next() {
-	return m_Tokenizer.Next();
+	ReadAhead(1);
+	auto token = move(m_Ahead[m_First]);
+	m_First = (m_First + 1) % Lookahead;
+	m_AheadCount--;
+	return token;
 }
 
-Token Parser::Peek() const {
-	return m_Tokenizer.Peek();
+Token const& Parser::Peek(size_t ahead) const {
+	assert(ahead < Lookahead);
+	ReadAhead(ahead + 1);
+	return m_Ahead[(m_First + ahead) % Lookahead];
 }
 
 bool Logo2::Parser::SkipTo(TokenType type) {
-	auto next = Next();
-	while (next.Type != type) {
+	for (auto next = Next(); next.Type != type; next = Next()) {
 		if (next.Type == TokenType::Invalid)
 			return false;
 	}
@@ -454,7 +505,7 @@ bool Logo2::Parser::SkipTo(TokenType type) {
 }
 
 bool Parser::Match(TokenType type, bool consume, bool errorIfNotFound) {
-	auto next = Peek();
+	auto const& next = Peek();
 	if (consume && next.Type == type) {
 		Next();
 		return true;
@@ -466,7 +517,7 @@ bool Parser::Match(TokenType type, bool consume, bool errorIfNotFound) {
 }
 
 bool Parser::Match(string_view lexeme, bool consume, bool errorIfNotFound) {
-	auto next = Peek();
+	auto const& next = Peek();
 	if (consume && next.Lexeme == lexeme) {
 		Next();
 		return true;
@@ -481,8 +532,50 @@ bool Parser::AddSymbol(Symbol sym) {
 	return m_Symbols.top()->AddSymbol(move(sym));
 }
 
-Symbol const* Parser::FindSymbol(string const& name, bool localOnly) const {
+Symbol const* Parser::FindSymbol(Atom name, bool localOnly) const {
 	return m_Symbols.top()->FindSymbol(name, localOnly);
 }
 
+void Parser::MarkTailCall(Expression* expr) const {
+	//
+	// a call whose value the enclosing function returns as is can reuse the caller's frame
+	//
+	if (!m_Functions.empty() && expr && expr->Type() == NodeType::InvokeFunction)
+		static_cast<InvokeFunctionExpression*>(expr)->SetTailCall();
+}
+
+LocalSlot Parser::ResolveSlot(Atom name) {
+	int frames;
+	bool global;
+	auto sym = m_Symbols.top()->FindSymbol(name, frames, global);
+	if (sym == nullptr)
+		return {};
+
+	//
+	// a variable of a top-level block has no slot (there is no frame): a function reaching it copies it by name
+	//
+	auto byName = sym->Slot < 0 && frames > 0 && !global && sym->Type == SymbolType::Variable;
+	if (sym->Slot < 0 && !byName)
+		return {};
+	if (frames == 0)
+		return LocalSlot{ .Index = sym->Slot };
+
+	//
+	// a local of an enclosing function: thread it through the captures of every function in between
+	//
+	assert(frames <= (int)m_Functions.size());
+	auto index = sym->Slot;
+	auto local = !byName;
+	for (auto i = m_Functions.size() - frames; i < m_Functions.size(); i++) {
+		auto& captures = m_Functions[i].Captures;
+		Capture capture{ .FromLocal = local, .Index = index, .Name = byName ? name : Atom::None };
+		auto it = find(captures.begin(), captures.end(), capture);
+		if (it == captures.end())
+			it = captures.insert(captures.end(), capture);
+		index = int(it - captures.begin());
+		local = byName = false;
+	}
+	return LocalSlot{ .Index = index, .IsUpvalue = true };
+}
+
 
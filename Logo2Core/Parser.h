@@ -2,6 +2,7 @@
 
 #include "Logo2Ast.h"
 #include "Parslets.h"
+#include <array>
 #include <stack>
 #include <span>
 #include "SymbolTable.h"
@@ -35,6 +36,8 @@ namespace Logo2 {
 		BreakContinueNoLoop,
 		ExpressionOrVarExpected,
 		IllegalExpression,
+		CloseBracketExpected,
+		ColonExpected,
 	};
 
 	struct ParseError {
@@ -63,36 +66,58 @@ namespace Logo2 {
 		std::unique_ptr<FunctionDeclaration> ParseFunctionDeclaration();
 		std::unique_ptr<RepeatStatement> ParseRepeatStatement();
 		std::unique_ptr<WhileStatement> ParseWhileStatement();
-		std::unique_ptr<BlockExpression> ParseBlock(std::vector<std::string> const& args = {});
+		std::unique_ptr<BlockExpression> ParseBlock();
 		std::unique_ptr<Statement> ParseStatement();
 		std::unique_ptr<ReturnStatement> ParseReturnStatement();
 		std::unique_ptr<BreakOrContinueStatement> ParseBreakContinueStatement(bool cont);
 		std::unique_ptr<ForStatement> ParseForStatement();
 		std::unique_ptr<EnumDeclaration> ParseEnumDeclaration();
 
+		//
+		// Peek looks at the token ahead tokens past the current one (at most Lookahead - 1), without consuming it;
+		// the reference holds until the next call to Next
+		//
 		Token Next();
-		Token Peek() const;
+		Token const& Peek(size_t ahead = 0) const;
 		bool SkipTo(TokenType type);
 		bool Match(TokenType type, bool consume = true, bool errorIfNotFound = false);
 		bool Match(std::string_view lexeme, bool consume = true, bool errorIfNotFound = false);
 
 		bool AddSymbol(Symbol sym);
-		Symbol const* FindSymbol(std::string const& name, bool localOnly = false) const;
+		Symbol const* FindSymbol(Atom name, bool localOnly = false) const;
+		LocalSlot ResolveSlot(Atom name);
+
+		struct FunctionScope {
+			SymbolTable* Symbols{ nullptr };
+			int FrameSize{ 0 };
+			std::vector<Capture> Captures{};
+		};
+
+		void PushFunctionScope(std::vector<Atom> const& parameters);
+		FunctionScope PopFunctionScope();
+		void MarkTailCall(Expression* expr) const;
 
 	private:
-		void PushScope();
+		void PushScope(bool frame = false);
 		void PopScope();
 		void Init();
 		std::unique_ptr<Statements> DoParse();
 		int GetPrecedence() const;
+		void ReadAhead(size_t count) const;
 
 		Tokenizer& m_Tokenizer;
 		std::unordered_map<TokenType, std::unique_ptr<InfixParslet>> m_InfixParslets;
 		std::unordered_map<TokenType, std::unique_ptr<PrefixParslet>> m_PrefixParslets;
 		std::vector<ParseError> m_Errors;
-		std::vector<Token> m_Tokens;
-		size_t m_Current;
+		//
+		// tokens read from the tokenizer ahead of the current position, so each one is tokenized once
+		//
+		static constexpr size_t Lookahead = 4;
+		mutable std::array<Token, Lookahead> m_Ahead;
+		mutable size_t m_First{ 0 };		// index of the current token in m_Ahead
+		mutable size_t m_AheadCount{ 0 };
 		std::stack<std::unique_ptr<SymbolTable>> m_Symbols;
+		std::vector<FunctionScope> m_Functions;
 		std::stack<std::string> m_Namespaces;
 		int m_LoopCount{ 0 };
 	};
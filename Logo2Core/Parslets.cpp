@@ -32,6 +32,7 @@ int PostfixOperatorParslet::Precedence() const {
 
 unique_ptr<Expression> NameParslet::Parse(Parser& parser, Token const& token) {
 	auto name = token.Lexeme;
+	auto id = token.Id;
 	while (parser.Peek().Type == TokenType::ScopeRes) {
 		parser.Next();
 		if (parser.Peek().Type != TokenType::Identifier) {
@@ -39,8 +40,9 @@ unique_ptr<Expression> NameParslet::Parse(Parser& parser, Token const& token) {
 			break;
 		}
 		name += "::" + parser.Next().Lexeme;
+		id = AtomTable::Intern(name);
 	}
-	return make_unique<NameExpression>(name);
+	return make_unique<NameExpression>(id, parser.ResolveSlot(id));
 }
 
 unique_ptr<Expression> PrefixOperatorParslet::Parse(Parser& parser, Token const& token) {
@@ -68,18 +70,25 @@ unique_ptr<Expression> GroupParslet::Parse(Parser& parser, Token const& token) {
 
 unique_ptr<Expression> AssignParslet::Parse(Parser& parser, unique_ptr<Expression> left, Token const& token) {
 	auto right = parser.ParseExpression(Precedence() - 1);
+	//
+	// the semicolon is left to the enclosing statement, so a following '[' or '-' starts a new expression
+	//
+	if (left->Type() == NodeType::Index)
+		return make_unique<AssignIndexExpression>(unique_ptr<IndexExpression>(static_cast<IndexExpression*>(left.release())), move(right));
+	if (left->Type() == NodeType::Member)
+		return make_unique<AssignMemberExpression>(unique_ptr<MemberExpression>(static_cast<MemberExpression*>(left.release())), move(right));
+
 	if (left->Type() != NodeType::Name) {
 		throw ParseError(ParseErrorType::IdentifierExpected, token);
 	}
 	auto nameExpr = reinterpret_cast<NameExpression*>(left.get());
-	auto sym = parser.FindSymbol(nameExpr->Name());
+	auto sym = parser.FindSymbol(nameExpr->Id());
 	if (!sym)
 		throw ParseError(ParseErrorType::UndefinedSymbol, token);
 
 	if ((sym->Flags & SymbolFlags::Const) == SymbolFlags::Const)
 		throw ParseError(ParseErrorType::CannotModifyConst, token);
-	parser.Match(TokenType::SemiColon);
-	return make_unique<AssignExpression>(nameExpr->Name(), move(right));
+	return make_unique<AssignExpression>(nameExpr->Id(), move(right), nameExpr->Slot());
 }
 
 int AssignParslet::Precedence() const {
@@ -94,9 +103,12 @@ unique_ptr<Expression> InvokeFunctionParslet::Parse(Parser& parser, unique_ptr<E
 		throw ParseError(ParseErrorType::Syntax, token);
 
 	auto nameExpr = reinterpret_cast<NameExpression*>(left.get());
-	//auto sym = parser.FindSymbol(nameExpr->Name());
-	//if (sym == nullptr)
-	//	parser.AddError(ParserError(ParseErrorType::UndefinedSymbol, token));
+	//
+	// a name that resolves to a function declaration (and not to a local) is bound statically:
+	// it can only ever be found in the function table
+	//
+	auto sym = parser.FindSymbol(nameExpr->Id());
+	auto bound = sym && sym->Type == SymbolType::Function && !nameExpr->Slot().IsResolved();
 
 	auto next = parser.Peek();
 	vector<unique_ptr<Expression>> args;
@@ -108,7 +120,7 @@ unique_ptr<Expression> InvokeFunctionParslet::Parse(Parser& parser, unique_ptr<E
 		next = parser.Peek();
 	}
 	parser.Next();		// eat close paren
-	return make_unique<InvokeFunctionExpression>(nameExpr->Name(), move(args));
+	return make_unique<InvokeFunctionExpression>(nameExpr->Id(), move(args), nameExpr->Slot(), bound);
 }
 
 unique_ptr<Expression> Logo2::IfThenElseParslet::Parse(Parser& parser, Token const& token) {
@@ -128,25 +140,82 @@ unique_ptr<Expression> Logo2::AnonymousFunctionParslet::Parse(Parser& parser, To
 	//
 	// parse args
 	//
-	vector<string> args;
+	vector<Atom> args;
 	while (parser.Peek().Type != TokenType::CloseParen) {
 		auto arg = parser.Next();
 		if(arg.Type != TokenType::Identifier)
 			throw ParseError(ParseErrorType::IdentifierExpected, arg);
-		args.push_back(move(arg.Lexeme));
+		args.push_back(arg.Id);
 		if (parser.Match(TokenType::Comma) || parser.Match(TokenType::CloseParen, false))
 			continue;
 		throw ParseError(ParseErrorType::CommaOrCloseParenExpected, parser.Peek());
 	}
 	parser.Next();		// eat close paren
+	parser.PushFunctionScope(args);
+	unique_ptr<Expression> body;
 	if (parser.Match(TokenType::GoesTo)) {
-		auto expr = parser.ParseExpression();
-		return make_unique<AnonymousFunctionExpression>(move(args), move(expr));
+		body = parser.ParseExpression();
+		parser.MarkTailCall(body.get());
 	}
-	auto block = parser.ParseBlock(args);
-	return make_unique<AnonymousFunctionExpression>(move(args), move(block));
+	else
+		body = parser.ParseBlock();
+	auto scope = parser.PopFunctionScope();
+	return make_unique<AnonymousFunctionExpression>(move(args), move(body), scope.FrameSize, move(scope.Captures));
 }
 
 int Logo2::AnonymousFunctionParslet::Precedence() const {
 	return 2000;
 }
+
+unique_ptr<Expression> Logo2::ArrayParslet::Parse(Parser& parser, Token const& token) {
+	//
+	// [a, b] is an array, [key: value, key: value] a dictionary and [:] an empty dictionary
+	//
+	if (parser.Match(TokenType::Colon)) {
+		if (!parser.Match(TokenType::CloseBracket))
+			throw ParseError(ParseErrorType::CloseBracketExpected, parser.Peek());
+		return make_unique<DictionaryExpression>(vector<DictionaryExpression::Entry>());
+	}
+
+	vector<unique_ptr<Expression>> elements;
+	vector<DictionaryExpression::Entry> entries;
+	bool dictionary = false;
+	while (parser.Peek().Type != TokenType::CloseBracket) {
+		auto element = parser.ParseExpression();
+		if (elements.empty() && entries.empty())
+			dictionary = parser.Peek().Type == TokenType::Colon;
+		if (dictionary) {
+			if (!parser.Match(TokenType::Colon))
+				throw ParseError(ParseErrorType::ColonExpected, parser.Peek());
+			entries.emplace_back(move(element), parser.ParseExpression());
+		}
+		else
+			elements.push_back(move(element));
+		if (!parser.Match(TokenType::Comma) && !parser.Match(TokenType::CloseBracket, false))
+			throw ParseError(ParseErrorType::CommaExpected, parser.Peek());
+	}
+	parser.Next();		// eat close bracket
+	if (dictionary)
+		return make_unique<DictionaryExpression>(move(entries));
+	return make_unique<ArrayExpression>(move(elements));
+}
+
+Logo2::IndexParslet::IndexParslet() : PostfixOperatorParslet(1200) {
+}
+
+unique_ptr<Expression> Logo2::IndexParslet::Parse(Parser& parser, unique_ptr<Expression> left, Token const& token) {
+	auto index = parser.ParseExpression();
+	if (!parser.Match(TokenType::CloseBracket))
+		throw ParseError(ParseErrorType::CloseBracketExpected, parser.Peek());
+	return make_unique<IndexExpression>(move(left), move(index));
+}
+
+Logo2::MemberParslet::MemberParslet() : PostfixOperatorParslet(1200) {
+}
+
+unique_ptr<Expression> Logo2::MemberParslet::Parse(Parser& parser, unique_ptr<Expression> left, Token const& token) {
+	auto field = parser.Next();
+	if (field.Type != TokenType::Identifier)
+		throw ParseError(ParseErrorType::IdentifierExpected, field);
+	return make_unique<MemberExpression>(move(left), field.Id);
+}
@@ -74,6 +74,20 @@ namespace Logo2 {
 		std::unique_ptr<Expression> Parse(Parser& parser, Token const& token) override;
 	};
 
+	struct ArrayParslet : PrefixParslet {
+		std::unique_ptr<Expression> Parse(Parser& parser, Token const& token) override;
+	};
+
+	struct IndexParslet : PostfixOperatorParslet {
+		IndexParslet();
+		std::unique_ptr<Expression> Parse(Parser& parser, std::unique_ptr<Expression> left, Token const& token) override;
+	};
+
+	struct MemberParslet : PostfixOperatorParslet {
+		MemberParslet();
+		std::unique_ptr<Expression> Parse(Parser& parser, std::unique_ptr<Expression> left, Token const& token) override;
+	};
+
 	struct AnonymousFunctionParslet : PrefixParslet {
 		std::unique_ptr<Expression> Parse(Parser& parser, Token const& token) override;
 		int Precedence() const override;
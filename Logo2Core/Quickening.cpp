@@ -0,0 +1,85 @@
+#include "pch.h"
+#include "Quickening.h"
+#include <Errors.h>
+
+namespace Logo2::Quickening {
+	template<typename T>
+	T Get(Value const& v) {
+		if constexpr (std::is_same_v<T, long long>)
+			return v.Integer();
+		else
+			return v.Real();
+	}
+
+	template<TokenType Op, typename L, typename R>
+	Value Binary(Value const& left, Value const& right) {
+		auto l = Get<L>(left);
+		auto r = Get<R>(right);
+		if constexpr (Op == TokenType::Add) return l + r;
+		else if constexpr (Op == TokenType::Sub) return l - r;
+		else if constexpr (Op == TokenType::Mul) return l * r;
+		else if constexpr (Op == TokenType::Div) {
+			if (r == 0)
+				throw RuntimeError(ErrorType::DivisionByZero);
+			return l / r;
+		}
+		else if constexpr (Op == TokenType::Mod) return l % r;
+		else if constexpr (Op == TokenType::Equal) return l == r;
+		else if constexpr (Op == TokenType::NotEqual) return l != r;
+		else if constexpr (Op == TokenType::LessThan) return l < r;
+		else if constexpr (Op == TokenType::LessThanOrEqual) return l <= r;
+		else if constexpr (Op == TokenType::GreaterThan) return l > r;
+		else if constexpr (Op == TokenType::GreaterThanOrEqual) return l >= r;
+	}
+
+	template<typename L, typename R>
+	BinaryHandler Select(TokenType op) {
+		switch (op) {
+			case TokenType::Add: return &Binary<TokenType::Add, L, R>;
+			case TokenType::Sub: return &Binary<TokenType::Sub, L, R>;
+			case TokenType::Mul: return &Binary<TokenType::Mul, L, R>;
+			case TokenType::Div: return &Binary<TokenType::Div, L, R>;
+			case TokenType::Equal: return &Binary<TokenType::Equal, L, R>;
+			case TokenType::NotEqual: return &Binary<TokenType::NotEqual, L, R>;
+			case TokenType::LessThan: return &Binary<TokenType::LessThan, L, R>;
+			case TokenType::LessThanOrEqual: return &Binary<TokenType::LessThanOrEqual, L, R>;
+			case TokenType::GreaterThan: return &Binary<TokenType::GreaterThan, L, R>;
+			case TokenType::GreaterThanOrEqual: return &Binary<TokenType::GreaterThanOrEqual, L, R>;
+			case TokenType::Mod:
+				if constexpr (std::is_same_v<L, long long> && std::is_same_v<R, long long>)
+					return &Binary<TokenType::Mod, L, R>;
+				break;
+			default: break;
+		}
+		return nullptr;
+	}
+
+	BinaryHandler SpecializeBinary(TokenType op, Value::TypeIndex left, Value::TypeIndex right) {
+		switch (left | (right << 4)) {
+			case Value::TypeInteger | (Value::TypeInteger << 4): return Select<long long, long long>(op);
+			case Value::TypeReal | (Value::TypeInteger << 4): return Select<double, long long>(op);
+			case Value::TypeInteger | (Value::TypeReal << 4): return Select<long long, double>(op);
+			case Value::TypeReal | (Value::TypeReal << 4): return Select<double, double>(op);
+		}
+		return nullptr;
+	}
+
+	UnaryHandler SpecializeUnary(TokenType op, Value::TypeIndex arg) {
+		switch (op) {
+			case TokenType::Sub:
+				if (arg == Value::TypeInteger)
+					return [](Value const& v) { return Value(-v.Integer()); };
+				if (arg == Value::TypeReal)
+					return [](Value const& v) { return Value(-v.Real()); };
+				break;
+
+			case TokenType::Not:
+				if (arg == Value::TypeBoolean)
+					return [](Value const& v) { return Value(!v.Boolean()); };
+				break;
+
+			default: break;
+		}
+		return nullptr;
+	}
+}
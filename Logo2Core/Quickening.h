@@ -0,0 +1,14 @@
+#pragma once
+
+#include "Token.h"
+#include "Value.h"
+
+namespace Logo2::Quickening {
+	//
+	// handlers for operators applied to operands of fixed types (integers and reals),
+	// used by operator sites that have settled on these types; null if there is none
+	// a handler computes exactly what the generic Value operator does for these types
+	//
+	BinaryHandler SpecializeBinary(TokenType op, Value::TypeIndex left, Value::TypeIndex right);
+	UnaryHandler SpecializeUnary(TokenType op, Value::TypeIndex arg);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "Value.h"
+#include "Logo2Ast.h"
+
+namespace Logo2 {
+	class Expression;
+
+	//
+	// three address instructions operating on numbered frame slots (registers)
+	// R[x] is a register, K[x] a constant, N[x] a name, F[x] a nested function, S[x] a field access site
+	//
+	enum class RegOp : uint8_t {
+		Nop,
+		Move,			// R[A] = R[B]
+		LoadConst,		// R[A] = K[B]
+		LoadNull,		// R[A] = null
+		LoadBool,		// R[A] = B != 0
+
+		LoadGlobal,		// R[A] = N[B]
+		StoreGlobal,	// N[B] = R[A]
+		DefineGlobal,	// var N[B] = R[A], Count = const
+		LoadUpvalue,	// R[A] = U[B]
+		StoreUpvalue,	// U[B] = R[A]
+		Close,			// R[A] becomes a new variable, closures keep the old one
+
+		Add,			// R[A] = R[B] op R[C]
+		Sub,
+		Mul,
+		Div,
+		Mod,
+		Power,
+		And,
+		Or,
+		Xor,
+		Equal,
+		NotEqual,
+		Less,
+		LessEqual,
+		Greater,
+		GreaterEqual,
+		Neg,			// R[A] = op R[B]
+		Not,
+
+		Jump,			// goto Target
+		JumpIfFalse,	// if !R[A] goto Target
+		RepeatInit,		// check R[A] is an integer
+		RepeatNext,		// if R[A] <= 0 goto Target else R[A]--
+
+		PushScope,
+		PopScope,
+
+		Arg,			// stage R[A] as the next call argument
+		Call,			// R[A] = N[B](staged args), Count = argument count
+		CallLocal,		// R[A] = R[B](staged args), Count = argument count
+		TailCall,		// Call in tail position, runs in the frame of the returning function
+		TailCallLocal,	// CallLocal in tail position
+		Return,			// return R[A]
+		DefineFunction,	// fn N = F[B]
+		MakeClosure,	// R[A] = closure of F[B]
+
+		MakeArray,		// R[A] = array of the last B staged args
+		MakeDictionary,	// R[A] = dictionary of the last B pairs of staged args (key, value)
+		LoadIndex,		// R[A] = R[B][R[C]]
+		StoreIndex,		// R[A][R[B]] = R[C]
+		LoadField,		// R[A] = R[B].S[C]
+		StoreField,		// R[A].S[B] = R[C]
+
+		Count			// number of opcodes
+	};
+
+	struct RegInstruction {
+		RegOp Code;
+		uint8_t Count;
+		uint16_t A;
+		union {
+			struct {
+				uint16_t B, C;
+			};
+			int Target;
+		};
+	};
+	static_assert(sizeof(RegInstruction) == 8);
+
+	struct RegisterChunk {
+		Atom Name{ Atom::None };
+		std::vector<Atom> Parameters;
+		Expression const* Body{ nullptr };
+		int RegisterCount{ 0 };
+		std::vector<Capture> Captures;		// FromLocal: register of the enclosing frame
+
+		std::vector<RegInstruction> Code;
+		std::vector<Value> Constants;
+		std::vector<Atom> Names;
+		mutable std::vector<CallCache> Callees;		// inline caches for calls by name, parallel to Names
+		mutable std::vector<FieldSite> FieldSites;	// one per field access
+		std::vector<std::shared_ptr<RegisterChunk>> Functions;
+	};
+}
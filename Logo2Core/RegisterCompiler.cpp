@@ -0,0 +1,698 @@
+#include "pch.h"
+#include "RegisterCompiler.h"
+#include "Logo2Ast.h"
+#include <Errors.h>
+#include <algorithm>
+#include <queue>
+
+using namespace Logo2;
+using namespace std;
+
+shared_ptr<RegisterChunk> RegisterCompiler::Compile(LogoAstNode const* root) {
+	auto chunk = make_shared<RegisterChunk>();
+	FunctionState state{ .Chunk = chunk.get(), .Parent = nullptr, .TopLevel = true };
+	m_Function = &state;
+	auto result = CompileNode(root);
+	Emit(RegOp::Return, result);
+	Finish(state);
+	m_Function = nullptr;
+	return chunk;
+}
+
+Value RegisterCompiler::VisitLiteral(LiteralExpression const* expr) {
+	auto& lit = expr->Literal();
+	auto target = NewTemp();
+	switch (lit.Type) {
+		case TokenType::Integer: Emit(RegOp::LoadConst, target, AddConstant(get<0>(lit.Value))); break;
+		case TokenType::Real: Emit(RegOp::LoadConst, target, AddConstant(get<1>(lit.Value))); break;
+		case TokenType::String: Emit(RegOp::LoadConst, target, AddConstant(lit.Lexeme)); break;
+		case TokenType::Keyword_True: Emit(RegOp::LoadBool, target, 1); break;
+		case TokenType::Keyword_False: Emit(RegOp::LoadBool, target, 0); break;
+		default: Emit(RegOp::LoadNull, target); break;
+	}
+	m_Result = target;
+	return {};
+}
+
+Value RegisterCompiler::VisitBinary(BinaryExpression const* expr) {
+	RegOp code;
+	switch (expr->Operator().Type) {
+		case TokenType::Add: code = RegOp::Add; break;
+		case TokenType::Sub: code = RegOp::Sub; break;
+		case TokenType::Mul: code = RegOp::Mul; break;
+		case TokenType::Div: code = RegOp::Div; break;
+		case TokenType::Power: code = RegOp::Power; break;
+		case TokenType::Mod: code = RegOp::Mod; break;
+		case TokenType::And: code = RegOp::And; break;
+		case TokenType::Or: code = RegOp::Or; break;
+		case TokenType::Xor: code = RegOp::Xor; break;
+		case TokenType::Equal: code = RegOp::Equal; break;
+		case TokenType::NotEqual: code = RegOp::NotEqual; break;
+		case TokenType::LessThan: code = RegOp::Less; break;
+		case TokenType::LessThanOrEqual: code = RegOp::LessEqual; break;
+		case TokenType::GreaterThan: code = RegOp::Greater; break;
+		case TokenType::GreaterThanOrEqual: code = RegOp::GreaterEqual; break;
+		default:
+			m_Result = NoRegister;
+			return {};
+	}
+	auto left = CompileNode(expr->Left());
+	auto right = CompileNode(expr->Right());
+	auto target = NewTemp();
+	Emit(code, target, left, right);
+	m_Result = target;
+	return {};
+}
+
+Value RegisterCompiler::VisitUnary(UnaryExpression const* expr) {
+	auto arg = CompileNode(expr->Arg());
+	switch (expr->Operator().Type) {
+		case TokenType::Add:
+			m_Result = arg;
+			return {};
+		case TokenType::Sub: m_Result = NewTemp(); Emit(RegOp::Neg, m_Result, arg); break;
+		case TokenType::Not: m_Result = NewTemp(); Emit(RegOp::Not, m_Result, arg); break;
+		default: throw RuntimeError(ErrorType::UndefinedOperator, expr->Arg());
+	}
+	return {};
+}
+
+Value RegisterCompiler::VisitName(NameExpression const* expr) {
+	if (auto local = FindLocal(m_Function, expr->Id()); local != NoRegister) {
+		m_Result = local;
+		return {};
+	}
+	m_Result = NewTemp();
+	if (auto up = Capture(m_Function, expr->Id()); up >= 0)
+		Emit(RegOp::LoadUpvalue, m_Result, up);
+	else
+		Emit(RegOp::LoadGlobal, m_Result, AddName(expr->Id()));
+	return {};
+}
+
+Value RegisterCompiler::VisitBlock(BlockExpression const* expr) {
+	m_Function->Locals.emplace_back();
+	auto result = NoRegister;
+	for (auto& stmt : expr->Expressions()) {
+		stmt->Accept(this);
+		result = m_Result;
+	}
+	m_Function->Locals.pop_back();
+	m_Result = result;
+	return {};
+}
+
+Value RegisterCompiler::VisitVar(VarStatement const* expr) {
+	if (m_Function->TopLevel) {
+		int value;
+		if (expr->Init())
+			value = CompileNode(expr->Init());
+		else {
+			value = NewTemp();
+			Emit(RegOp::LoadNull, value);
+		}
+		Emit(RegOp::DefineGlobal, value, AddName(expr->Id()), 0, expr->IsConst() ? 1 : 0);
+		if (!m_Function->Locals.empty())
+			m_Function->Locals.back()[expr->Id()] = NoRegister;
+	}
+	else {
+		//
+		// Close is dropped by Finish unless a nested function captures the local
+		//
+		auto local = NewLocal();
+		Emit(RegOp::Close, local);
+		int value = expr->Init() ? CompileNode(expr->Init()) : NoRegister;
+		DeclareLocal(expr->Id(), local);
+		if (value == NoRegister)
+			Emit(RegOp::LoadNull, local);
+		else
+			StoreInto(local, value);
+	}
+	m_Result = NoRegister;
+	return {};
+}
+
+Value RegisterCompiler::VisitAssign(AssignExpression const* expr) {
+	auto value = CompileNode(expr->Value());
+	if (auto local = FindLocal(m_Function, expr->Id()); local != NoRegister) {
+		StoreInto(local, value);
+		m_Result = local;
+		return {};
+	}
+	if (auto up = Capture(m_Function, expr->Id()); up >= 0)
+		Emit(RegOp::StoreUpvalue, value, up);
+	else
+		Emit(RegOp::StoreGlobal, value, AddName(expr->Id()));
+	m_Result = value;
+	return {};
+}
+
+Value RegisterCompiler::VisitPostfix(PostfixExpression const*) {
+	m_Result = NoRegister;
+	return {};
+}
+
+Value RegisterCompiler::VisitInvokeFunction(InvokeFunctionExpression const* expr) {
+	//
+	// evaluate all arguments before staging any, so nested calls do not interleave
+	//
+	vector<int> args;
+	args.reserve(expr->Arguments().size());
+	for (auto& arg : expr->Arguments())
+		args.push_back(CompileNode(arg.get()));
+	for (auto arg : args)
+		Emit(RegOp::Arg, arg);
+
+	m_Result = NewTemp();
+	auto tail = expr->IsTailCall();
+	if (auto local = FindLocal(m_Function, expr->Id()); local != NoRegister) {
+		Emit(tail ? RegOp::TailCallLocal : RegOp::CallLocal, m_Result, local, 0, (int)args.size());
+		return {};
+	}
+	if (auto up = Capture(m_Function, expr->Id()); up >= 0) {
+		auto callee = NewTemp();
+		Emit(RegOp::LoadUpvalue, callee, up);
+		Emit(tail ? RegOp::TailCallLocal : RegOp::CallLocal, m_Result, callee, 0, (int)args.size());
+		return {};
+	}
+	Emit(tail ? RegOp::TailCall : RegOp::Call, m_Result, AddName(expr->Id()), 0, (int)args.size());
+	return {};
+}
+
+Value RegisterCompiler::VisitRepeat(RepeatStatement const* expr) {
+	auto count = NewTemp();
+	StoreInto(count, CompileNode(expr->Count()));
+	Emit(RegOp::RepeatInit, count);
+	auto start = Emit(RegOp::RepeatNext, count);
+	m_Function->Loops.push_back({ m_Function->ScopeDepth });
+	EnterScope();
+	expr->Block()->Accept(this);
+	ExitScope();
+	Emit(RegOp::Jump, 0, start);
+	auto loop = move(m_Function->Loops.back());
+	m_Function->Loops.pop_back();
+
+	PatchJumps(loop.Continues, start);
+	PatchJumps({ start }, Here());
+	PatchJumps(loop.Breaks, Here());
+	m_Result = NoRegister;
+	return {};
+}
+
+Value RegisterCompiler::VisitWhile(WhileStatement const* stmt) {
+	auto start = Here();
+	auto cond = CompileNode(stmt->Condition());
+	auto exit = Emit(RegOp::JumpIfFalse, cond);
+	m_Function->Loops.push_back({ m_Function->ScopeDepth });
+	EnterScope();
+	stmt->Body()->Accept(this);
+	ExitScope();
+	Emit(RegOp::Jump, 0, start);
+	auto loop = move(m_Function->Loops.back());
+	m_Function->Loops.pop_back();
+
+	PatchJumps(loop.Continues, start);
+	PatchJumps({ exit }, Here());
+	PatchJumps(loop.Breaks, Here());
+	m_Result = NoRegister;
+	return {};
+}
+
+Value RegisterCompiler::VisitIfThenElse(IfThenElseExpression const* expr) {
+	auto cond = CompileNode(expr->Condition());
+	auto elseJump = Emit(RegOp::JumpIfFalse, cond);
+	auto target = NewTemp(true);
+
+	EnterScope();
+	StoreInto(target, CompileNode(expr->Then()));
+	ExitScope();
+	auto endJump = Emit(RegOp::Jump);
+	PatchJumps({ elseJump }, Here());
+	if (expr->Else()) {
+		EnterScope();
+		StoreInto(target, CompileNode(expr->Else()));
+		ExitScope();
+	}
+	else {
+		Emit(RegOp::LoadNull, target);
+	}
+	PatchJumps({ endJump }, Here());
+	m_Result = target;
+	return {};
+}
+
+Value RegisterCompiler::VisitFunctionDeclaration(FunctionDeclaration const* decl) {
+	Emit(RegOp::DefineFunction, 0, CompileFunction(decl->Id(), decl->Parameters(), decl->Body()));
+	m_Result = NoRegister;
+	return {};
+}
+
+Value RegisterCompiler::VisitReturn(ReturnStatement const* stmt) {
+	int value;
+	if (stmt->ReturnValue())
+		value = CompileNode(stmt->ReturnValue());
+	else {
+		value = NewTemp();
+		Emit(RegOp::LoadNull, value);
+	}
+	Emit(RegOp::Return, value);
+	m_Result = NoRegister;
+	return {};
+}
+
+Value RegisterCompiler::VisitBreakContinue(BreakOrContinueStatement const* stmt) {
+	assert(!m_Function->Loops.empty());		// the parser rejects break/continue outside a loop
+	auto& loop = m_Function->Loops.back();
+	LeaveScopes(loop.ScopeDepth);
+	auto jump = Emit(RegOp::Jump);
+	if (stmt->IsContinue())
+		loop.Continues.push_back(jump);
+	else
+		loop.Breaks.push_back(jump);
+	m_Result = NoRegister;
+	return {};
+}
+
+Value RegisterCompiler::VisitFor(ForStatement const* stmt) {
+	EnterScope();
+	if (stmt->Init())
+		stmt->Init()->Accept(this);
+	auto start = Here();
+	auto cond = CompileNode(stmt->While());
+	auto exit = Emit(RegOp::JumpIfFalse, cond);
+	m_Function->Loops.push_back({ m_Function->ScopeDepth });
+	EnterScope();
+	stmt->Body()->Accept(this);
+	ExitScope();
+	auto loop = move(m_Function->Loops.back());
+	m_Function->Loops.pop_back();
+
+	PatchJumps(loop.Continues, Here());
+	stmt->Inc()->Accept(this);
+	Emit(RegOp::Jump, 0, start);
+	PatchJumps({ exit }, Here());
+	PatchJumps(loop.Breaks, Here());
+	ExitScope();
+	m_Result = NoRegister;
+	return {};
+}
+
+Value RegisterCompiler::VisitStatements(Statements const* stmts) {
+	auto result = NoRegister;
+	for (auto& stmt : stmts->Get()) {
+		stmt->Accept(this);
+		result = m_Result;
+	}
+	m_Result = result;
+	return {};
+}
+
+Value RegisterCompiler::VisitAnonymousFunction(AnonymousFunctionExpression const* func) {
+	auto index = CompileFunction(Atom::None, func->Args(), func->Body());
+	m_Result = NewTemp();
+	Emit(RegOp::MakeClosure, m_Result, index);
+	return {};
+}
+
+Value RegisterCompiler::VisitEnumDeclaration(EnumDeclaration const*) {
+	m_Result = NoRegister;
+	return {};
+}
+
+Value RegisterCompiler::VisitArray(ArrayExpression const* expr) {
+	//
+	// elements are staged like call arguments
+	//
+	vector<int> elements;
+	elements.reserve(expr->Elements().size());
+	for (auto& element : expr->Elements())
+		elements.push_back(CompileNode(element.get()));
+	for (auto element : elements)
+		Emit(RegOp::Arg, element);
+
+	m_Result = NewTemp();
+	Emit(RegOp::MakeArray, m_Result, (int)elements.size());
+	return {};
+}
+
+Value RegisterCompiler::VisitDictionary(DictionaryExpression const* expr) {
+	vector<int> operands;
+	operands.reserve(2 * expr->Entries().size());
+	for (auto& [key, value] : expr->Entries()) {
+		operands.push_back(CompileNode(key.get()));
+		operands.push_back(CompileNode(value.get()));
+	}
+	for (auto operand : operands)
+		Emit(RegOp::Arg, operand);
+
+	m_Result = NewTemp();
+	Emit(RegOp::MakeDictionary, m_Result, (int)expr->Entries().size());
+	return {};
+}
+
+Value RegisterCompiler::VisitIndex(IndexExpression const* expr) {
+	auto container = CompileNode(expr->Container());
+	auto index = CompileNode(expr->Index());
+	m_Result = NewTemp();
+	Emit(RegOp::LoadIndex, m_Result, container, index);
+	return {};
+}
+
+Value RegisterCompiler::VisitMember(MemberExpression const* expr) {
+	auto object = CompileNode(expr->Object());
+	m_Result = NewTemp();
+	Emit(RegOp::LoadField, m_Result, object, AddFieldSite(expr->Field()));
+	return {};
+}
+
+Value RegisterCompiler::VisitAssignMember(AssignMemberExpression const* expr) {
+	auto object = CompileNode(expr->Target()->Object());
+	auto value = CompileNode(expr->Value());
+	Emit(RegOp::StoreField, object, AddFieldSite(expr->Target()->Field()), value);
+	m_Result = value;
+	return {};
+}
+
+Value RegisterCompiler::VisitAssignIndex(AssignIndexExpression const* expr) {
+	auto container = CompileNode(expr->Target()->Container());
+	auto index = CompileNode(expr->Target()->Index());
+	auto value = CompileNode(expr->Value());
+	Emit(RegOp::StoreIndex, container, index, value);
+	m_Result = value;
+	return {};
+}
+
+int RegisterCompiler::Emit(RegOp code, int a, int b, int c, int count) {
+	m_Function->Code.push_back(VirtualInstruction{ .Code = code, .Count = (uint8_t)count, .A = a, .B = b, .C = c });
+	return (int)m_Function->Code.size() - 1;
+}
+
+int RegisterCompiler::Here() const {
+	return (int)m_Function->Code.size();
+}
+
+void RegisterCompiler::PatchJumps(vector<int> const& jumps, int target) {
+	for (auto index : jumps)
+		m_Function->Code[index].B = target;
+}
+
+int RegisterCompiler::NewTemp(bool multipleDefs) {
+	m_Function->MultipleDefs.push_back(multipleDefs);
+	return (int)m_Function->MultipleDefs.size() - 1;
+}
+
+int RegisterCompiler::NewLocal() {
+	return -1 - m_Function->LocalCount++;
+}
+
+int RegisterCompiler::DeclareLocal(Atom name, int local) {
+	if (m_Function->Locals.empty())
+		m_Function->Locals.emplace_back();
+	m_Function->Locals.back()[name] = local;
+	return local;
+}
+
+int RegisterCompiler::FindLocal(FunctionState const* f, Atom name) const {
+	for (auto it = f->Locals.rbegin(); it != f->Locals.rend(); ++it) {
+		if (auto local = it->find(name); local != it->end())
+			return local->second;
+	}
+	return NoRegister;
+}
+
+bool RegisterCompiler::IsBlockVariable(FunctionState const* f, Atom name) const {
+	for (auto it = f->Locals.rbegin(); it != f->Locals.rend(); ++it) {
+		if (auto local = it->find(name); local != it->end())
+			return local->second == NoRegister;
+	}
+	return false;
+}
+
+int RegisterCompiler::Capture(FunctionState* f, Atom name) {
+	//
+	// returns the upvalue index of a local of an enclosing function, -1 for globals
+	// a variable of a top-level block is copied (by name) when the closure is created
+	//
+	auto parent = f->Parent;
+	if (f->TopLevel || parent == nullptr)
+		return -1;
+
+	Logo2::Capture capture;
+	if (parent->TopLevel) {
+		if (!IsBlockVariable(parent, name))
+			return -1;
+		capture = { .FromLocal = false, .Index = -1, .Name = name };
+	}
+	else if (auto local = FindLocal(parent, name); local != NoRegister) {
+		parent->Captured.insert(local);
+		capture = { .FromLocal = true, .Index = -1 - local };
+	}
+	else if (auto up = Capture(parent, name); up >= 0)
+		capture = { .FromLocal = false, .Index = up };
+	else
+		return -1;
+
+	auto& captures = f->Chunk->Captures;
+	auto it = find(captures.begin(), captures.end(), capture);
+	if (it == captures.end())
+		it = captures.insert(captures.end(), capture);
+	return int(it - captures.begin());
+}
+
+int RegisterCompiler::CompileNode(LogoAstNode const* node) {
+	node->Accept(this);
+	return Materialize();
+}
+
+int RegisterCompiler::Materialize() {
+	if (m_Result == NoRegister) {
+		m_Result = NewTemp();
+		Emit(RegOp::LoadNull, m_Result);
+	}
+	return m_Result;
+}
+
+void RegisterCompiler::StoreInto(int target, int source) {
+	if (target == source)
+		return;
+
+	//
+	// retarget the instruction that just produced a single use temporary
+	//
+	auto& code = m_Function->Code;
+	if (source >= 0 && !m_Function->MultipleDefs[source] && !code.empty()) {
+		auto& last = code.back();
+		if (last.A == source && (RegisterOperands(last.Code) & 1) && last.Code != RegOp::Arg && last.Code != RegOp::Return
+			&& last.Code != RegOp::StoreGlobal && last.Code != RegOp::DefineGlobal && last.Code != RegOp::JumpIfFalse
+			&& last.Code != RegOp::StoreUpvalue && last.Code != RegOp::Close
+			&& last.Code != RegOp::RepeatInit && last.Code != RegOp::RepeatNext && last.Code != RegOp::StoreIndex
+			&& last.Code != RegOp::StoreField) {
+			last.A = target;
+			return;
+		}
+	}
+	Emit(RegOp::Move, target, source);
+}
+
+int RegisterCompiler::AddConstant(Value v) {
+	auto& constants = m_Function->Chunk->Constants;
+	constants.push_back(move(v));
+	return (int)constants.size() - 1;
+}
+
+int RegisterCompiler::AddName(Atom name) {
+	auto& names = m_Function->Chunk->Names;
+	if (auto it = find(names.begin(), names.end(), name); it != names.end())
+		return int(it - names.begin());
+	names.push_back(name);
+	m_Function->Chunk->Callees.emplace_back();
+	return (int)names.size() - 1;
+}
+
+int RegisterCompiler::AddFieldSite(Atom field) {
+	auto& sites = m_Function->Chunk->FieldSites;
+	sites.push_back(FieldSite{ .Name = field });
+	return (int)sites.size() - 1;
+}
+
+int RegisterCompiler::CompileFunction(Atom name, vector<Atom> const& parameters, Expression const* body) {
+	auto chunk = make_shared<RegisterChunk>();
+	chunk->Name = name;
+	chunk->Parameters = parameters;
+	chunk->Body = body;
+
+	FunctionState state{ .Chunk = chunk.get(), .Parent = m_Function, .TopLevel = false };
+	state.Locals.emplace_back();
+	auto parent = m_Function;
+	m_Function = &state;
+	for (auto& p : parameters)
+		DeclareLocal(p, NewLocal());
+
+	auto result = CompileNode(body);
+	Emit(RegOp::Return, result);
+	Finish(state);
+
+	m_Function = parent;
+	m_Function->Chunk->Functions.push_back(move(chunk));
+	return (int)m_Function->Chunk->Functions.size() - 1;
+}
+
+void RegisterCompiler::EnterScope() {
+	if (m_Function->TopLevel) {
+		Emit(RegOp::PushScope);
+		m_Function->ScopeDepth++;
+	}
+	m_Function->Locals.emplace_back();
+}
+
+void RegisterCompiler::ExitScope() {
+	m_Function->Locals.pop_back();
+	if (m_Function->TopLevel) {
+		m_Function->ScopeDepth--;
+		Emit(RegOp::PopScope);
+	}
+}
+
+void RegisterCompiler::LeaveScopes(int depth) {
+	for (auto i = m_Function->ScopeDepth; i > depth; i--)
+		Emit(RegOp::PopScope);
+}
+
+int RegisterCompiler::RegisterOperands(RegOp code) {
+	switch (code) {
+		case RegOp::Move: case RegOp::Neg: case RegOp::Not: case RegOp::CallLocal: case RegOp::TailCallLocal: case RegOp::LoadField:
+			return 1 | 2;
+
+		case RegOp::StoreField:
+			return 1 | 4;
+
+		case RegOp::LoadConst: case RegOp::LoadNull: case RegOp::LoadBool: case RegOp::LoadGlobal:
+		case RegOp::StoreGlobal: case RegOp::DefineGlobal: case RegOp::JumpIfFalse:
+		case RegOp::LoadUpvalue: case RegOp::StoreUpvalue: case RegOp::Close:
+		case RegOp::RepeatInit: case RegOp::RepeatNext: case RegOp::Arg: case RegOp::Call: case RegOp::TailCall:
+		case RegOp::Return: case RegOp::MakeClosure: case RegOp::MakeArray: case RegOp::MakeDictionary:
+			return 1;
+
+		case RegOp::Add: case RegOp::Sub: case RegOp::Mul: case RegOp::Div: case RegOp::Mod:
+		case RegOp::Power: case RegOp::And: case RegOp::Or: case RegOp::Xor: case RegOp::Equal:
+		case RegOp::NotEqual: case RegOp::Less: case RegOp::LessEqual: case RegOp::Greater:
+		case RegOp::GreaterEqual: case RegOp::LoadIndex: case RegOp::StoreIndex:
+			return 1 | 2 | 4;
+
+		default: break;		// no register operands
+	}
+	return 0;
+}
+
+void RegisterCompiler::Finish(FunctionState& f) {
+	auto& code = f.Code;
+	auto temps = (int)f.MultipleDefs.size();
+
+	//
+	// drop Close of locals no closure captured, then fix up jump targets
+	//
+	vector<int> remap(code.size() + 1);
+	int count = 0;
+	for (int i = 0; i < (int)code.size(); i++) {
+		remap[i] = count;
+		if (code[i].Code != RegOp::Close || f.Captured.contains(code[i].A))
+			code[count++] = code[i];
+	}
+	remap[code.size()] = count;
+	code.resize(count);
+	for (auto& vi : code) {
+		if (vi.Code == RegOp::Jump || vi.Code == RegOp::JumpIfFalse || vi.Code == RegOp::RepeatNext)
+			vi.B = remap[vi.B];
+	}
+
+	//
+	// live interval of every temporary, in instruction order
+	//
+	vector<int> start(temps, INT_MAX), end(temps, -1);
+	for (int i = 0; i < (int)code.size(); i++) {
+		auto operands = RegisterOperands(code[i].Code);
+		for (auto reg : { operands & 1 ? code[i].A : -1, operands & 2 ? code[i].B : -1, operands & 4 ? code[i].C : -1 }) {
+			if (reg >= 0) {
+				start[reg] = min(start[reg], i);
+				end[reg] = max(end[reg], i);
+			}
+		}
+	}
+
+	//
+	// a temporary live at a loop header must survive the entire loop body
+	//
+	for (bool changed = true; changed; ) {
+		changed = false;
+		for (int i = 0; i < (int)code.size(); i++) {
+			auto op = code[i].Code;
+			if (op != RegOp::Jump && op != RegOp::JumpIfFalse && op != RegOp::RepeatNext)
+				continue;
+			auto target = code[i].B;
+			if (target > i)
+				continue;
+			for (int t = 0; t < temps; t++) {
+				if (start[t] < target && end[t] >= target && end[t] < i) {
+					end[t] = i;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	//
+	// linear scan: temporaries sorted by start point, expired intervals return their slot
+	//
+	vector<int> order;
+	for (int t = 0; t < temps; t++)
+		if (end[t] >= 0)
+			order.push_back(t);
+	sort(order.begin(), order.end(), [&](int a, int b) { return start[a] < start[b]; });
+
+	vector<int> slot(temps, 0);
+	priority_queue<int, vector<int>, greater<int>> free;
+	using Active = pair<int, int>;		// end, temporary
+	priority_queue<Active, vector<Active>, greater<Active>> active;
+	int slots = 0;
+	for (auto t : order) {
+		while (!active.empty() && active.top().first < start[t]) {
+			free.push(slot[active.top().second]);
+			active.pop();
+		}
+		if (free.empty())
+			slot[t] = slots++;
+		else {
+			slot[t] = free.top();
+			free.pop();
+		}
+		active.push({ end[t], t });
+	}
+
+	//
+	// lower to the final encoding
+	//
+	auto physical = [&](int reg) {
+		return reg < 0 ? -1 - reg : f.LocalCount + slot[reg];
+	};
+	auto chunk = f.Chunk;
+	chunk->RegisterCount = f.LocalCount + slots;
+	chunk->Code.reserve(code.size());
+	for (auto& vi : code) {
+		RegInstruction inst{};
+		inst.Code = vi.Code;
+		inst.Count = vi.Count;
+		auto operands = RegisterOperands(vi.Code);
+		inst.A = uint16_t(operands & 1 ? physical(vi.A) : vi.A);
+		switch (vi.Code) {
+			case RegOp::Jump: case RegOp::JumpIfFalse: case RegOp::RepeatNext:
+				inst.Target = vi.B;
+				break;
+
+			default:
+				inst.B = uint16_t(operands & 2 ? physical(vi.B) : vi.B);
+				inst.C = uint16_t(operands & 4 ? physical(vi.C) : vi.C);
+				break;
+		}
+		chunk->Code.push_back(inst);
+	}
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Visitor.h"
+#include "RegisterCode.h"
+#include <climits>
+#include <unordered_set>
+
+namespace Logo2 {
+	class LogoAstNode;
+
+	//
+	// lowers the AST into three address code for the RegisterMachine
+	// locals of a function are pinned to frame slots, temporaries are packed
+	// into the remaining slots by a linear scan allocator once the function is complete
+	//
+	class RegisterCompiler : public Visitor {
+	public:
+		std::shared_ptr<RegisterChunk> Compile(LogoAstNode const* root);
+
+		Value VisitLiteral(LiteralExpression const* expr) override;
+		Value VisitBinary(BinaryExpression const* expr) override;
+		Value VisitUnary(UnaryExpression const* expr) override;
+		Value VisitName(NameExpression const* expr) override;
+		Value VisitBlock(BlockExpression const* expr) override;
+		Value VisitVar(VarStatement const* expr) override;
+		Value VisitAssign(AssignExpression const* expr) override;
+		Value VisitPostfix(PostfixExpression const* expr) override;
+		Value VisitInvokeFunction(InvokeFunctionExpression const* expr) override;
+		Value VisitRepeat(RepeatStatement const* expr) override;
+		Value VisitWhile(WhileStatement const* stmt) override;
+		Value VisitIfThenElse(IfThenElseExpression const* expr) override;
+		Value VisitFunctionDeclaration(FunctionDeclaration const* decl) override;
+		Value VisitReturn(ReturnStatement const* expr) override;
+		Value VisitBreakContinue(BreakOrContinueStatement const* stmt) override;
+		Value VisitFor(ForStatement const* stmt) override;
+		Value VisitStatements(Statements const* stmts) override;
+		Value VisitAnonymousFunction(AnonymousFunctionExpression const* func) override;
+		Value VisitEnumDeclaration(EnumDeclaration const* decl) override;
+		Value VisitArray(ArrayExpression const* expr) override;
+		Value VisitDictionary(DictionaryExpression const* expr) override;
+		Value VisitIndex(IndexExpression const* expr) override;
+		Value VisitAssignIndex(AssignIndexExpression const* expr) override;
+		Value VisitMember(MemberExpression const* expr) override;
+		Value VisitAssignMember(AssignMemberExpression const* expr) override;
+
+	private:
+		//
+		// virtual registers: locals are negative (-1 - index), temporaries are non-negative
+		//
+		static constexpr int NoRegister = INT_MIN;
+
+		struct VirtualInstruction {
+			RegOp Code;
+			uint8_t Count;
+			int A, B, C;
+		};
+
+		struct LoopInfo {
+			int ScopeDepth;
+			std::vector<int> Breaks{};
+			std::vector<int> Continues{};
+		};
+
+		struct FunctionState {
+			RegisterChunk* Chunk;
+			FunctionState* Parent;
+			bool TopLevel;
+			std::vector<VirtualInstruction> Code{};
+			std::vector<std::unordered_map<Atom, int>> Locals{};		// NoRegister for variables of top-level blocks, which live in scopes
+			int LocalCount{ 0 };
+			std::unordered_set<int> Captured{};		// locals referenced by nested functions
+			std::vector<bool> MultipleDefs{};		// per temporary
+			std::vector<LoopInfo> Loops{};
+			int ScopeDepth{ 0 };
+		};
+
+		int Emit(RegOp code, int a = 0, int b = 0, int c = 0, int count = 0);
+		int Here() const;
+		void PatchJumps(std::vector<int> const& jumps, int target);
+		int NewTemp(bool multipleDefs = false);
+		int NewLocal();
+		int DeclareLocal(Atom name, int local);
+		int FindLocal(FunctionState const* f, Atom name) const;
+		bool IsBlockVariable(FunctionState const* f, Atom name) const;
+		int Capture(FunctionState* f, Atom name);
+		int CompileNode(LogoAstNode const* node);
+		int Materialize();
+		void StoreInto(int target, int source);
+		int AddConstant(Value v);
+		int AddName(Atom name);
+		int AddFieldSite(Atom field);
+		int CompileFunction(Atom name, std::vector<Atom> const& parameters, Expression const* body);
+		void EnterScope();
+		void ExitScope();
+		void LeaveScopes(int depth);
+		void Finish(FunctionState& f);
+
+		static int RegisterOperands(RegOp code);
+
+		FunctionState* m_Function{ nullptr };
+		int m_Result{ NoRegister };
+	};
+}
@@ -0,0 +1,393 @@
+#include "pch.h"
+#include "RegisterMachine.h"
+#include "Interpreter.h"
+#include <Errors.h>
+#include "Dispatch.h"
+#include "ArrayValue.h"
+#include "DictionaryValue.h"
+
+using namespace Logo2;
+using namespace std;
+
+#define BINARY_OP(op) R[inst->A] = R[inst->B] op R[inst->C]; NEXT()
+
+RegisterMachine::RegisterMachine(Interpreter& inter) : m_Interpreter(inter) {
+	m_Registers.reserve(MaxRegisters);
+}
+
+Value RegisterMachine::Run(RegisterChunk const& chunk) {
+	auto scopes = m_Interpreter.ScopeDepth();
+	auto frames = m_Frames.size();
+	auto base = m_Registers.size();
+	auto args = m_Args.size();
+	auto unwind = [&]() {
+		while (m_Interpreter.ScopeDepth() > scopes)
+			m_Interpreter.PopScope();
+		CloseUpvalues(m_Registers.data() + base);
+		m_Frames.resize(frames);
+		m_Registers.resize(base);
+		m_Args.resize(args);
+	};
+
+	Value result;
+	GrowRegisters(base + chunk.RegisterCount);
+	try {
+		result = Execute(&chunk, base);
+	}
+	catch (...) {
+		unwind();
+		throw;
+	}
+	unwind();
+	return result;
+}
+
+uint64_t RegisterMachine::InstructionCount() const {
+	return m_Instructions;
+}
+
+void RegisterMachine::ResetStats() {
+	m_Instructions = 0;
+}
+
+Value RegisterMachine::Execute(RegisterChunk const* chunk, size_t base) {
+#ifdef LOGO2_THREADED_DISPATCH
+	static void* const labels[] = {
+		LABEL(Nop), LABEL(Move), LABEL(LoadConst), LABEL(LoadNull), LABEL(LoadBool),
+		LABEL(LoadGlobal), LABEL(StoreGlobal), LABEL(DefineGlobal), LABEL(LoadUpvalue), LABEL(StoreUpvalue), LABEL(Close),
+		LABEL(Add), LABEL(Sub), LABEL(Mul), LABEL(Div), LABEL(Mod), LABEL(Power), LABEL(And), LABEL(Or), LABEL(Xor),
+		LABEL(Equal), LABEL(NotEqual), LABEL(Less), LABEL(LessEqual), LABEL(Greater), LABEL(GreaterEqual),
+		LABEL(Neg), LABEL(Not),
+		LABEL(Jump), LABEL(JumpIfFalse), LABEL(RepeatInit), LABEL(RepeatNext),
+		LABEL(PushScope), LABEL(PopScope),
+		LABEL(Arg), LABEL(Call), LABEL(CallLocal), LABEL(TailCall), LABEL(TailCallLocal), LABEL(Return), LABEL(DefineFunction), LABEL(MakeClosure),
+		LABEL(MakeArray), LABEL(MakeDictionary), LABEL(LoadIndex), LABEL(StoreIndex), LABEL(LoadField), LABEL(StoreField),
+	};
+	static_assert(std::size(labels) == size_t(RegOp::Count));
+#else
+	using OpType = RegOp;
+#endif
+
+	auto baseFrame = m_Frames.size();
+	auto code = chunk->Code.data();
+	auto R = m_Registers.data() + base;
+	UpvalueList const* upvalues = nullptr;
+	size_t ip = 0;
+	RegInstruction const* inst;
+
+	for (;;) {
+		inst = code + ip++;
+		m_Instructions++;
+
+		DISPATCH(inst->Code) {
+			CASE(Nop) NEXT();
+			CASE(Move) R[inst->A] = R[inst->B]; NEXT();
+			CASE(LoadConst) R[inst->A] = chunk->Constants[inst->B]; NEXT();
+			CASE(LoadNull) R[inst->A] = Value(); NEXT();
+			CASE(LoadBool) R[inst->A] = inst->B != 0; NEXT();
+
+			CASE(LoadGlobal)
+			{
+				auto v = m_Interpreter.FindVariable(chunk->Names[inst->B]);
+				if (!v)
+					throw RuntimeError(ErrorType::UndefinedSymbol, nullptr, AtomTable::Name(chunk->Names[inst->B]));
+				R[inst->A] = v->VarValue;
+				NEXT();
+			}
+
+			CASE(StoreGlobal)
+			{
+				auto v = m_Interpreter.FindVariable(chunk->Names[inst->B]);
+				if (!v)
+					throw RuntimeError(ErrorType::UndefinedSymbol, nullptr, AtomTable::Name(chunk->Names[inst->B]));
+				if ((v->Flags & VariableFlags::Const) == VariableFlags::Const)
+					throw RuntimeError(ErrorType::CannotAssignConst, nullptr, AtomTable::Name(chunk->Names[inst->B]));
+				v->VarValue = R[inst->A];
+				NEXT();
+			}
+
+			CASE(DefineGlobal)
+			{
+				Variable var;
+				var.Flags = inst->Count ? VariableFlags::Const : VariableFlags::None;
+				var.VarValue = R[inst->A];
+				m_Interpreter.AddVariable(chunk->Names[inst->B], move(var));
+				NEXT();
+			}
+
+			CASE(LoadUpvalue) R[inst->A] = *(*upvalues)[inst->B]->Location; NEXT();
+			CASE(StoreUpvalue) *(*upvalues)[inst->B]->Location = R[inst->A]; NEXT();
+
+			CASE(Close)
+			{
+				auto location = &R[inst->A];
+				auto it = find_if(m_OpenUpvalues.begin(), m_OpenUpvalues.end(), [=](auto& up) { return up->Location == location; });
+				if (it != m_OpenUpvalues.end()) {
+					(*it)->Close();
+					m_OpenUpvalues.erase(it);
+				}
+				NEXT();
+			}
+
+			CASE(Add) BINARY_OP(+);
+			CASE(Sub) BINARY_OP(-);
+			CASE(Mul) BINARY_OP(*);
+			CASE(Div) BINARY_OP(/);
+			CASE(Mod) BINARY_OP(%);
+			CASE(And) BINARY_OP(&);
+			CASE(Or) BINARY_OP(|);
+			CASE(Xor) BINARY_OP(^);
+			CASE(Equal) BINARY_OP(==);
+			CASE(NotEqual) BINARY_OP(!=);
+			CASE(Less) BINARY_OP(<);
+			CASE(LessEqual) BINARY_OP(<=);
+			CASE(Greater) BINARY_OP(>);
+			CASE(GreaterEqual) BINARY_OP(>=);
+			CASE(Power) R[inst->A] = R[inst->B].Power(R[inst->C]); NEXT();
+			CASE(Neg) R[inst->A] = -R[inst->B]; NEXT();
+			CASE(Not) R[inst->A] = !R[inst->B]; NEXT();
+
+			CASE(Jump) ip = inst->Target; NEXT();
+			CASE(JumpIfFalse)
+				if (!R[inst->A].ToBoolean())
+					ip = inst->Target;
+				NEXT();
+
+			CASE(RepeatInit)
+				if (!R[inst->A].IsInteger())
+					throw RuntimeError(ErrorType::TypeMismatch);
+				NEXT();
+
+			CASE(RepeatNext)
+			{
+				auto n = R[inst->A].Integer();
+				if (n <= 0)
+					ip = inst->Target;
+				else
+					R[inst->A] = n - 1;
+				NEXT();
+			}
+
+			CASE(PushScope) m_Interpreter.PushScope(); NEXT();
+			CASE(PopScope) m_Interpreter.PopScope(); NEXT();
+
+			CASE(Arg) m_Args.push_back(R[inst->A]); NEXT();
+
+			CASE(Call)
+			CASE(CallLocal)
+			CASE(TailCall)
+			CASE(TailCallLocal)
+			{
+				Function const* f;
+				Ref<Function> closure;
+				if (inst->Code == RegOp::CallLocal || inst->Code == RegOp::TailCallLocal) {
+					if (!R[inst->B].IsFunction())
+						throw RuntimeError(ErrorType::NotCallable);
+					f = R[inst->B].Func();
+					closure = Ref<Function>(const_cast<Function*>(f));
+				}
+				else {
+					f = FindCallee(chunk, inst->B, closure);
+				}
+				if (f->ArgCount != inst->Count)
+					throw RuntimeError(ErrorType::ArgumentCountMismatch);
+
+				auto first = m_Args.size() - inst->Count;
+				if (f->IsNative()) {
+					auto result = m_Interpreter.CallNative(*f, { m_Args.data() + first, (size_t)inst->Count });
+					m_Args.resize(first);
+					R[inst->A] = move(result);
+					NEXT();
+				}
+				if (!f->RegisterCode)
+					throw RuntimeError(ErrorType::NotCallable);
+
+				if ((inst->Code == RegOp::TailCall || inst->Code == RegOp::TailCallLocal) && m_Frames.size() > baseFrame) {
+					//
+					// the callee takes over the frame of the function returning its value, so tail recursion
+					// runs in constant space; at the bottom of this run it is an ordinary call, followed by the Return
+					//
+					auto& frame = m_Frames.back();
+					while (m_Interpreter.ScopeDepth() > frame.ScopeDepth)
+						m_Interpreter.PopScope();
+					CloseUpvalues(R);
+					chunk = f->RegisterCode.get();
+					m_Registers.resize(base);
+					GrowRegisters(base + chunk->RegisterCount);
+					R = m_Registers.data() + base;
+					for (int i = 0; i < inst->Count; i++)
+						R[i] = move(m_Args[first + i]);
+					m_Args.resize(first);
+					upvalues = &f->Upvalues;
+					frame.Callee = move(closure);
+					code = chunk->Code.data();
+					ip = 0;
+					NEXT();
+				}
+
+				m_Frames.push_back(CallFrame{ .Chunk = chunk, .Ip = ip, .Base = base, .ScopeDepth = m_Interpreter.ScopeDepth(), .Upvalues = upvalues, .Result = inst->A, .Callee = move(closure) });
+				chunk = f->RegisterCode.get();
+				base = m_Registers.size();
+				GrowRegisters(base + chunk->RegisterCount);
+				R = m_Registers.data() + base;
+				for (int i = 0; i < inst->Count; i++)
+					R[i] = move(m_Args[first + i]);
+				m_Args.resize(first);
+				upvalues = &f->Upvalues;
+				code = chunk->Code.data();
+				ip = 0;
+				NEXT();
+			}
+
+			CASE(Return)
+			{
+				if (m_Frames.size() == baseFrame)
+					return move(R[inst->A]);
+
+				auto result = move(R[inst->A]);
+				auto& frame = m_Frames.back();
+				while (m_Interpreter.ScopeDepth() > frame.ScopeDepth)
+					m_Interpreter.PopScope();
+				CloseUpvalues(R);
+				m_Registers.resize(base);
+				chunk = frame.Chunk;
+				code = chunk->Code.data();
+				upvalues = frame.Upvalues;
+				base = frame.Base;
+				R = m_Registers.data() + base;
+				R[frame.Result] = move(result);
+				ip = frame.Ip;
+				m_Frames.pop_back();
+				NEXT();
+			}
+
+			CASE(DefineFunction)
+			{
+				auto& proto = chunk->Functions[inst->B];
+				Function f;
+				f.ArgCount = (int)proto->Parameters.size();
+				f.Code = proto->Body;
+				f.Parameters = proto->Parameters;
+				f.RegisterCode = proto;
+				f.Upvalues = CaptureUpvalues(*proto, R, upvalues);
+				m_Interpreter.AddFunction(proto->Name, move(f));
+				NEXT();
+			}
+
+			CASE(MakeClosure)
+			{
+				auto& proto = chunk->Functions[inst->B];
+				auto f = MakeRef<Function>();
+				f->ArgCount = (int)proto->Parameters.size();
+				f->Code = proto->Body;
+				f->Parameters = proto->Parameters;
+				f->RegisterCode = proto;
+				f->Upvalues = CaptureUpvalues(*proto, R, upvalues);
+				R[inst->A] = Value(move(f));
+				NEXT();
+			}
+
+			CASE(MakeArray)
+			{
+				auto first = m_Args.end() - inst->B;
+				auto array = MakeRef<ArrayValue>(vector<Value>(make_move_iterator(first), make_move_iterator(m_Args.end())));
+				m_Args.erase(first, m_Args.end());
+				R[inst->A] = Value(move(array));
+				NEXT();
+			}
+
+			CASE(MakeDictionary)
+			{
+				auto first = m_Args.size() - 2 * inst->B;
+				auto dictionary = MakeRef<DictionaryValue>(inst->B);
+				for (auto i = first; i < m_Args.size(); i += 2)
+					dictionary->Set(m_Args[i], move(m_Args[i + 1]));
+				m_Args.resize(first);
+				R[inst->A] = Value(move(dictionary));
+				NEXT();
+			}
+
+			CASE(LoadIndex) R[inst->A] = R[inst->B].Element(R[inst->C]); NEXT();
+			CASE(StoreIndex) R[inst->A].SetElement(R[inst->B], R[inst->C]); NEXT();
+
+			CASE(LoadField)
+			{
+				auto& site = chunk->FieldSites[inst->C];
+				Value field = R[inst->B].Object()->Get(site.Name, site.Cache);		// A may be the register holding the object
+				R[inst->A] = move(field);
+				NEXT();
+			}
+
+			CASE(StoreField)
+			{
+				auto& site = chunk->FieldSites[inst->B];
+				R[inst->A].Object()->Set(site.Name, site.Cache, R[inst->C]);
+				NEXT();
+			}
+
+			DEFAULT_CASE
+				assert(false);
+				throw RuntimeError(ErrorType::UndefinedOperator);
+		}
+	}
+}
+
+Function const* RegisterMachine::FindCallee(RegisterChunk const* chunk, int index, Ref<Function>& closure) const {
+	auto& name = chunk->Names[index];
+	if (auto f = m_Interpreter.FindFunction(name, chunk->Callees[index]); f)
+		return f;
+
+	auto var = m_Interpreter.FindVariable(name);
+	if (var) {
+		if (var->VarValue.IsFunction()) {
+			closure = Ref<Function>(const_cast<Function*>(var->VarValue.Func()));
+			return closure.get();
+		}
+		throw RuntimeError(ErrorType::NotCallable, nullptr, AtomTable::Name(name));
+	}
+	throw RuntimeError(ErrorType::UndefinedFunction, nullptr, AtomTable::Name(name));
+}
+
+void RegisterMachine::GrowRegisters(size_t size) {
+	if (size > m_Registers.capacity())
+		throw RuntimeError(ErrorType::StackOverflow);
+	m_Registers.resize(size);
+}
+
+UpvalueList RegisterMachine::CaptureUpvalues(RegisterChunk const& proto, Value* regs, UpvalueList const* upvalues) {
+	UpvalueList result(Heap::CurrentResource());
+	result.reserve(proto.Captures.size());
+	for (auto& capture : proto.Captures) {
+		if (capture.Name != Atom::None) {
+			result.push_back(m_Interpreter.Stack().CaptureValue(m_Interpreter.CurrentScope(), capture.Name));
+			continue;
+		}
+		if (!capture.FromLocal) {
+			result.push_back((*upvalues)[capture.Index]);
+			continue;
+		}
+		auto location = regs + capture.Index;
+		auto it = find_if(m_OpenUpvalues.begin(), m_OpenUpvalues.end(), [=](auto& up) { return up->Location == location; });
+		if (it != m_OpenUpvalues.end()) {
+			result.push_back(*it);
+			continue;
+		}
+		auto up = allocate_shared<Upvalue>(pmr::polymorphic_allocator<Upvalue>(Heap::CurrentResource()));
+		up->Location = location;
+		m_OpenUpvalues.push_back(up);
+		result.push_back(move(up));
+	}
+	return result;
+}
+
+void RegisterMachine::CloseUpvalues(Value const* from) {
+	//
+	// variables of the frames being popped move into the upvalues that captured them
+	//
+	erase_if(m_OpenUpvalues, [=](auto& up) {
+		if (up->Location < from)
+			return false;
+		up->Close();
+		return true;
+	});
+}
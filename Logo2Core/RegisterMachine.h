@@ -0,0 +1,50 @@
+#pragma once
+
+#include "RegisterCode.h"
+
+namespace Logo2 {
+	class Interpreter;
+
+	//
+	// register based VM executing RegisterChunks produced by the RegisterCompiler
+	// each call frame is a window of RegisterCount slots in a single register file
+	//
+	class RegisterMachine {
+	public:
+		explicit RegisterMachine(Interpreter& inter);
+
+		Value Run(RegisterChunk const& chunk);
+
+		uint64_t InstructionCount() const;
+		void ResetStats();
+
+	private:
+		//
+		// open upvalues point into the register file, so it never reallocates
+		//
+		static constexpr size_t MaxRegisters = 1 << 16;
+
+		struct CallFrame {
+			RegisterChunk const* Chunk;
+			size_t Ip;
+			size_t Base;
+			size_t ScopeDepth;
+			UpvalueList const* Upvalues;
+			uint16_t Result;
+			Ref<Function> Callee;		// a closure being run, kept alive while its frame reads its upvalues; null for named functions
+		};
+
+		Value Execute(RegisterChunk const* chunk, size_t base);
+		Function const* FindCallee(RegisterChunk const* chunk, int index, Ref<Function>& closure) const;
+		void GrowRegisters(size_t size);
+		UpvalueList CaptureUpvalues(RegisterChunk const& proto, Value* regs, UpvalueList const* upvalues);
+		void CloseUpvalues(Value const* from);
+
+		Interpreter& m_Interpreter;
+		std::vector<Value> m_Registers;
+		std::vector<std::shared_ptr<Upvalue>> m_OpenUpvalues;
+		std::vector<Value> m_Args;
+		std::vector<CallFrame> m_Frames;
+		uint64_t m_Instructions{ 0 };
+	};
+}
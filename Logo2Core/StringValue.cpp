@@ -0,0 +1,202 @@
+#include "pch.h"
+#include "StringValue.h"
+#include "Heap.h"
+#include <Errors.h>
+#include <cstring>
+
+using namespace Logo2;
+
+//
+// a flat node owns its characters; a rope node refers to its two (non empty) parts until it is flattened
+// nodes and characters come from the pools of the heap current when the string was made (the resource of Flat)
+//
+struct StringValue::Node {
+	uint32_t Refs{ 1 };
+	bool Rope{ false };
+	size_t Length{ 0 };
+	StringValue Left{}, Right{};
+	std::pmr::string Flat;
+
+	static Node* Create(Node&& init) {
+		auto resource = init.Flat.get_allocator().resource();
+		return new (resource->allocate(sizeof(Node), alignof(Node))) Node(std::move(init));
+	}
+
+	static void Destroy(Node* node) {
+		auto resource = node->Flat.get_allocator().resource();
+		node->~Node();
+		resource->deallocate(node, sizeof(Node), alignof(Node));
+	}
+};
+
+StringValue::StringValue() noexcept {
+	m_Chars[0] = 0;
+}
+
+StringValue::StringValue(std::string_view text) {
+	if (text.length() <= InlineCapacity) {
+		memcpy(m_Chars, text.data(), text.length());
+		m_Chars[text.length()] = 0;
+		m_Length = (uint8_t)text.length();
+	}
+	else {
+		m_Node = Node::Create(Node{ .Length = text.length(), .Flat = std::pmr::string(text, Heap::CurrentResource()) });
+		m_Length = OnHeap;
+	}
+}
+
+StringValue::StringValue(Node* node) noexcept : m_Node(node), m_Length(OnHeap) {
+}
+
+StringValue::StringValue(StringValue const& other) noexcept : m_Length(other.m_Length) {
+	memcpy(m_Chars, other.m_Chars, sizeof(m_Chars));
+	if (!IsInline())
+		m_Node->Refs++;
+}
+
+StringValue::StringValue(StringValue&& other) noexcept : m_Length(other.m_Length) {
+	memcpy(m_Chars, other.m_Chars, sizeof(m_Chars));
+	other.m_Chars[0] = 0;
+	other.m_Length = 0;
+}
+
+StringValue& StringValue::operator=(StringValue const& other) noexcept {
+	if (this != &other) {
+		if (!other.IsInline())
+			other.m_Node->Refs++;
+		Release();
+		memcpy(m_Chars, other.m_Chars, sizeof(m_Chars));
+		m_Length = other.m_Length;
+	}
+	return *this;
+}
+
+StringValue& StringValue::operator=(StringValue&& other) noexcept {
+	if (this != &other) {
+		Release();
+		memcpy(m_Chars, other.m_Chars, sizeof(m_Chars));
+		m_Length = other.m_Length;
+		other.m_Chars[0] = 0;
+		other.m_Length = 0;
+	}
+	return *this;
+}
+
+StringValue::~StringValue() {
+	Release();
+}
+
+bool StringValue::IsInline() const {
+	return m_Length != OnHeap;
+}
+
+void StringValue::Release() {
+	if (IsInline() || --m_Node->Refs > 0)
+		return;
+
+	if (!m_Node->Rope) {
+		Node::Destroy(m_Node);
+		return;
+	}
+
+	//
+	// a rope built in a loop is a long chain of nodes: free it without recursing
+	//
+	std::vector<Node*> dead{ m_Node };
+	while (!dead.empty()) {
+		auto node = dead.back();
+		dead.pop_back();
+		for (auto part : { &node->Left, &node->Right }) {
+			if (!part->IsInline() && --part->m_Node->Refs == 0)
+				dead.push_back(part->m_Node);
+			part->m_Chars[0] = 0;
+			part->m_Length = 0;
+		}
+		Node::Destroy(node);
+	}
+}
+
+void StringValue::Flatten(Node* node) {
+	std::pmr::string flat(node->Flat.get_allocator());
+	flat.reserve(node->Length);
+	std::vector<StringValue const*> parts{ &node->Right, &node->Left };
+	while (!parts.empty()) {
+		auto part = parts.back();
+		parts.pop_back();
+		if (part->IsInline())
+			flat.append(part->m_Chars, part->m_Length);
+		else if (part->m_Node->Rope) {
+			parts.push_back(&part->m_Node->Right);
+			parts.push_back(&part->m_Node->Left);
+		}
+		else
+			flat.append(part->m_Node->Flat);
+	}
+	node->Flat = std::move(flat);
+	node->Rope = false;
+
+	//
+	// the parts are no longer needed (unless shared with other strings)
+	//
+	node->Left = StringValue();
+	node->Right = StringValue();
+}
+
+size_t StringValue::Length() const {
+	return IsInline() ? m_Length : m_Node->Length;
+}
+
+bool StringValue::Empty() const {
+	return m_Length == 0;
+}
+
+std::string_view StringValue::View() const {
+	if (IsInline())
+		return std::string_view(m_Chars, m_Length);
+	if (m_Node->Rope)
+		Flatten(m_Node);
+	return m_Node->Flat;
+}
+
+char const* StringValue::CStr() const {
+	return View().data();
+}
+
+std::string StringValue::Str() const {
+	return std::string(View());
+}
+
+StringValue StringValue::operator+(StringValue const& right) const {
+	if (right.Empty())
+		return *this;
+	if (Empty())
+		return right;
+
+	//
+	// a rope is only a node, so doubling a string in a loop gets to lengths no string could hold
+	//
+	static auto const maxLength = std::pmr::string().max_size();
+	if (Length() > maxLength - right.Length())
+		throw RuntimeError(ErrorType::OutOfMemory, nullptr, "string too long");
+
+	auto length = Length() + right.Length();
+	if (IsInline() && right.IsInline() && length <= InlineCapacity) {
+		StringValue result;
+		memcpy(result.m_Chars, m_Chars, m_Length);
+		memcpy(result.m_Chars + m_Length, right.m_Chars, right.m_Length);
+		result.m_Chars[length] = 0;
+		result.m_Length = (uint8_t)length;
+		return result;
+	}
+	return StringValue(Node::Create(Node{ .Rope = true, .Length = length, .Left = *this, .Right = right, .Flat = std::pmr::string(Heap::CurrentResource()) }));
+}
+
+bool StringValue::operator==(StringValue const& other) const {
+	if (!IsInline() && !other.IsInline() && m_Node == other.m_Node)
+		return true;
+	return Length() == other.Length() && View() == other.View();
+}
+
+std::strong_ordering StringValue::operator<=>(StringValue const& other) const {
+	return View() <=> other.View();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string_view>
+#include <compare>
+
+namespace Logo2 {
+	//
+	// immutable string held by string Values: copies share the characters, short strings are stored inline
+	// concatenation makes a rope node in O(1), a rope is flattened into one buffer the first time it is read
+	// the refcount is not atomic as values are not shared across threads
+	//
+	class StringValue {
+	public:
+		static constexpr size_t InlineCapacity = 15;
+
+		StringValue() noexcept;
+		StringValue(std::string_view text);
+		StringValue(std::string const& text) : StringValue(std::string_view(text)) {}
+		StringValue(char const* text) : StringValue(std::string_view(text)) {}
+		StringValue(StringValue const& other) noexcept;
+		StringValue(StringValue&& other) noexcept;
+		StringValue& operator=(StringValue const& other) noexcept;
+		StringValue& operator=(StringValue&& other) noexcept;
+		~StringValue();
+
+		size_t Length() const;
+		bool Empty() const;
+		//
+		// the characters are null terminated and live as long as this string
+		//
+		std::string_view View() const;
+		char const* CStr() const;
+		std::string Str() const;
+
+		StringValue operator+(StringValue const& right) const;
+		bool operator==(StringValue const& other) const;
+		std::strong_ordering operator<=>(StringValue const& other) const;
+
+	private:
+		struct Node;
+		static constexpr uint8_t OnHeap = 0xFF;
+
+		explicit StringValue(Node* node) noexcept;
+		bool IsInline() const;
+		void Release();
+		static void Flatten(Node* node);
+
+		union {
+			Node* m_Node;
+			char m_Chars[InlineCapacity + 1];
+		};
+		uint8_t m_Length{ 0 };		// of the inline characters, OnHeap if m_Node is used
+	};
+	static_assert(sizeof(StringValue) == 24);
+}
@@ -3,16 +3,51 @@
 
 using namespace Logo2;
 
-SymbolTable::SymbolTable(SymbolTable* parent) : m_Parent(parent) {
+SymbolTable::SymbolTable(SymbolTable* parent, bool frame) : m_Parent(parent), m_IsFrame(frame) {
 }
 
 bool SymbolTable::AddSymbol(Symbol sym) {
-	return m_Symbols.insert({ sym.Name, std::move(sym) }).second;
+	if (m_Symbols.Contains(sym.Name))
+		return false;
+
+	if (sym.Type == SymbolType::Variable || sym.Type == SymbolType::Argument) {
+		if (auto frame = Frame(); frame)
+			sym.Slot = frame->m_SlotCount++;
+	}
+	auto name = sym.Name;
+	return m_Symbols.TryEmplace(name, std::move(sym)).second;
 }
 
-Symbol const* SymbolTable::FindSymbol(std::string const& name, bool localOnly) const {
-	if (auto it = m_Symbols.find(name); it != m_Symbols.end())
-		return &(it->second);
+Symbol const* SymbolTable::FindSymbol(Atom name, bool localOnly) const {
+	if (auto symbol = m_Symbols.Find(name))
+		return symbol;
 
 	return m_Parent && !localOnly ? m_Parent->FindSymbol(name) : nullptr;
 }
+
+Symbol const* SymbolTable::FindSymbol(Atom name, int& frames, bool& global) const {
+	//
+	// count the function frames crossed on the way to the defining table, global if that is the root
+	//
+	frames = 0;
+	for (auto table = this; table; table = table->m_Parent) {
+		if (auto symbol = table->m_Symbols.Find(name)) {
+			global = table->m_Parent == nullptr;
+			return symbol;
+		}
+		if (table->m_IsFrame)
+			frames++;
+	}
+	return nullptr;
+}
+
+int SymbolTable::FrameSize() const {
+	return m_SlotCount;
+}
+
+SymbolTable* SymbolTable::Frame() {
+	auto table = this;
+	while (table && !table->m_IsFrame)
+		table = table->m_Parent;
+	return table;
+}
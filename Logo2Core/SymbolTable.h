@@ -1,6 +1,8 @@
 #pragma once
 
 #include "Logo2Core.h"
+#include "Atom.h"
+#include "FlatMap.h"
 
 namespace Logo2 {
 	enum class SymbolType {
@@ -19,20 +21,31 @@ namespace Logo2 {
 	DEFINE_ENUM_FLAG_OPERATORS(SymbolFlags);
 
 	struct Symbol {
-		std::string Name;
+		Atom Name;
 		SymbolType Type;
 		SymbolFlags Flags;
+		int Slot{ -1 };		// index in the enclosing function frame, -1 for globals
 	};
 
+	//
+	// a table created with frame = true starts a function frame
+	// variables and arguments declared in it or in nested (block) tables get consecutive slots in that frame
+	//
 	class SymbolTable {
 	public:
-		explicit SymbolTable(SymbolTable* parent = nullptr);
+		explicit SymbolTable(SymbolTable* parent = nullptr, bool frame = false);
 		bool AddSymbol(Symbol sym);
-		Symbol const* FindSymbol(std::string const& name, bool localOnly = false) const;
+		Symbol const* FindSymbol(Atom name, bool localOnly = false) const;
+		Symbol const* FindSymbol(Atom name, int& frames, bool& global) const;
+		int FrameSize() const;
 
 	private:
-		std::unordered_map<std::string, Symbol> m_Symbols;
+		SymbolTable* Frame();
+
+		FlatMap<Atom, Symbol> m_Symbols;
 		SymbolTable* m_Parent;
+		bool m_IsFrame;
+		int m_SlotCount{ 0 };
 	};
 }
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "Atom.h"
+
 namespace Logo2 {
 	enum class TokenType {
 		Invalid,
@@ -48,6 +50,7 @@ namespace Logo2 {
 		LessThan,
 		GreaterThanOrEqual,
 		LessThanOrEqual,
+		Colon,
 
 		Operator = 0x5f,
 
@@ -79,6 +82,7 @@ namespace Logo2 {
 		TokenType Type;
 		std::string Lexeme;
 		int Line, Col;
+		Atom Id{ Atom::None };		// interned lexeme of an identifier
 		std::variant<long long, double, bool> Value;
 	};
 }
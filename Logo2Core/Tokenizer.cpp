@@ -13,7 +13,7 @@ bool Logo2::Tokenizer::Tokenize(string text, int line) {
 }
 
 bool Logo2::Tokenizer::AddToken(string lexeme, TokenType type) {
-	return m_TokenTypes.try_emplace(move(lexeme), type).second;
+	return m_TokenTypes.TryEmplace(move(lexeme), type).second;
 }
 
 int Logo2::Tokenizer::AddTokens(span<pair<string, TokenType>> tokens) {
@@ -64,7 +64,8 @@ bool Logo2::Tokenizer::ProcessSingleLineComment() {
 		m_Current = current;
 		while (*m_Current && *m_Current != '\n')
 			m_Current++;
-		m_Current++;
+		if (*m_Current)
+			m_Current++;
 		m_Line++;
 		m_Col = 1;
 		return true;
@@ -94,11 +95,13 @@ Logo2::Token Logo2::Tokenizer::ParseIdentifier() {
 		m_Col++;
 	}
 	assert(!lexeme.empty());
+	auto hash = std::hash<string_view>{}(lexeme);
 	auto type = TokenType::Identifier;
-	if (auto it = m_TokenTypes.find(lexeme); it != m_TokenTypes.end())
-		type = it->second;
+	if (auto keyword = m_TokenTypes.Find(string_view(lexeme), hash))
+		type = *keyword;
 	int len = (int)lexeme.length();
-	return Token{ .Type = type, .Lexeme = move(lexeme), .Line = m_Line, .Col = m_Col - len, };
+	auto id = type == TokenType::Identifier ? AtomTable::Intern(lexeme, hash) : Atom::None;
+	return Token{ .Type = type, .Lexeme = move(lexeme), .Line = m_Line, .Col = m_Col - len, .Id = id };
 }
 
 Logo2::Token Logo2::Tokenizer::ParseNumber() {
@@ -154,9 +157,8 @@ Logo2::Token Logo2::Tokenizer::ParseOperator() {
 
 	auto type = TokenType::Invalid;
 	do {
-		auto it = m_TokenTypes.find(lexeme);
-		if (it != m_TokenTypes.end()) {
-			type = it->second;
+		if (auto op = m_TokenTypes.Find(lexeme)) {
+			type = *op;
 			break;
 		}
 		lexeme = lexeme.substr(0, lexeme.length() - 1);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Token.h"
+#include "FlatMap.h"
 
 namespace Logo2 {
 	class Tokenizer {
@@ -23,7 +24,10 @@ namespace Logo2 {
 		Token ParseString();
 
 		int m_Line, m_Col{ 1 };
-		std::unordered_map<std::string, TokenType> m_TokenTypes;
+		//
+		// looked up by string_view with the hash the identifier is interned with, so it is computed once
+		//
+		FlatMap<std::string, TokenType, std::hash<std::string_view>> m_TokenTypes;
 		std::string m_Text;
 		const char* m_Current{ nullptr };
 		std::string m_CommentToEndOfLine{ "//" };
@@ -1,2 +1,92 @@
 #include "pch.h"
 #include "TypeObject.h"
+#include <Errors.h>
+
+using namespace Logo2;
+using namespace std;
+
+TypeObject::TypeObject(string fullName, TypeObjectType type) : m_Name(move(fullName)), m_Type(type) {
+}
+
+FieldInfo const* TypeObject::AddField(string name, MemberFlags flags, Value defaultValue) {
+	auto atom = AtomTable::Intern(name);
+	if (m_Sealed || m_Members.contains(atom))
+		return nullptr;
+
+	auto field = make_unique<FieldInfo>();
+	field->Name = atom;
+	field->Type = MemberType::Field;
+	field->Flags = flags;
+	field->Slot = (int)m_Fields.size();
+	field->Default = move(defaultValue);
+	auto info = field.get();
+	m_Fields.push_back(info);
+	m_Members.emplace(atom, move(field));
+	return info;
+}
+
+MemberInfo const* TypeObject::FindMember(Atom name) const {
+	auto it = m_Members.find(name);
+	return it == m_Members.end() ? nullptr : it->second.get();
+}
+
+FieldInfo const* TypeObject::FindField(Atom name) const {
+	auto member = FindMember(name);
+	return member && member->Type == MemberType::Field ? static_cast<FieldInfo const*>(member) : nullptr;
+}
+
+vector<FieldInfo const*> const& TypeObject::Fields() const {
+	return m_Fields;
+}
+
+int TypeObject::FieldCount() const {
+	return (int)m_Fields.size();
+}
+
+string const& TypeObject::Name() const {
+	return m_Name;
+}
+
+TypeObjectType TypeObject::Type() const {
+	return m_Type;
+}
+
+bool TypeObject::IsSealed() const {
+	return m_Sealed;
+}
+
+void TypeObject::Seal() {
+	m_Sealed = true;
+}
+
+Ref<UserObject> UserObject::Create(TypeObject& type) {
+	//
+	// the layout is final once an object exists
+	//
+	type.Seal();
+	auto memory = HeapObject::Allocate(sizeof(UserObject) + type.FieldCount() * sizeof(Value));
+	auto object = new (memory) UserObject(type);
+	HeapObject::Track(object);
+	return Ref<UserObject>(object);
+}
+
+UserObject::UserObject(TypeObject const& type) : HeapObject(Value::TypeUserObject), m_Type(&type) {
+	auto fields = Fields();
+	for (auto field : type.Fields())
+		new (fields + field->Slot) Value(field->Default);
+}
+
+UserObject::~UserObject() {
+	auto fields = Fields();
+	for (int i = m_Type->FieldCount() - 1; i >= 0; i--)
+		fields[i].~Value();
+}
+
+void UserObject::Resolve(Atom name, FieldCache& cache, bool store) const {
+	auto field = m_Type->FindField(name);
+	if (!field)
+		throw RuntimeError(ErrorType::UndefinedSymbol, nullptr, AtomTable::Name(name));
+	if (store && (field->Flags & (MemberFlags::Const | MemberFlags::ReadOnly)) != MemberFlags::None)
+		throw RuntimeError(ErrorType::CannotAssignConst, nullptr, AtomTable::Name(name));
+	cache = FieldCache{ m_Type, field->Slot };
+}
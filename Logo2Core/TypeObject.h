@@ -27,24 +27,88 @@ namespace Logo2 {
 	DEFINE_ENUM_FLAG_OPERATORS(MemberFlags);
 
 	struct MemberInfo {
-		std::string Name;
+		Atom Name;
 		MemberType Type;
 		MemberFlags Flags;
 	};
 
 	struct FieldInfo : MemberInfo {
+		int Slot;			// index of the field in the objects of the type
+		Value Default;		// initial value of the field in new objects
 	};
 
+	//
+	// a type is the shape (hidden class) of its objects: every field is assigned a fixed slot when it is added,
+	// so objects of the same type share one layout; fields can only be added until the first object is created
+	//
 	class TypeObject {
 	public:
 		TypeObject(std::string fullName, TypeObjectType type);
 
-		FieldInfo const* AddField(std::string name, MemberFlags flags, Value = {});
+		FieldInfo const* AddField(std::string name, MemberFlags flags, Value defaultValue = {});
+		FieldInfo const* FindField(Atom name) const;
+		MemberInfo const* FindMember(Atom name) const;
+		std::vector<FieldInfo const*> const& Fields() const;		// in slot order
+		int FieldCount() const;
+		std::string const& Name() const;
+		TypeObjectType Type() const;
+
+		bool IsSealed() const;
+		void Seal();
 
 	private:
 		std::string m_Name;
 		TypeObjectType m_Type;
-		std::unordered_map<std::string, std::unique_ptr<MemberInfo>> m_Members;
+		std::unordered_map<Atom, std::unique_ptr<MemberInfo>> m_Members;
+		std::vector<FieldInfo const*> m_Fields;
+		bool m_Sealed{ false };
 	};
 
+	//
+	// an object of a user type, its fields are stored right after it in the same allocation
+	//
+	struct UserObject : HeapObject {
+		static Ref<UserObject> Create(TypeObject& type);
+
+		TypeObject const& Type() const {
+			return *m_Type;
+		}
+		Value* Fields() {
+			return reinterpret_cast<Value*>(this + 1);
+		}
+		Value const* Fields() const {
+			return reinterpret_cast<Value const*>(this + 1);
+		}
+		Value& Field(int slot) {
+			return Fields()[slot];
+		}
+		int FieldCount() const {
+			return m_Type->FieldCount();
+		}
+
+		//
+		// field by name through the cache of the access site, refilled when the shape differs
+		// a store site is only cached for fields that can be assigned
+		//
+		Value const& Get(Atom name, FieldCache& cache) const {
+			if (cache.Shape != m_Type) [[unlikely]]
+				Resolve(name, cache, false);
+			return Fields()[cache.Slot];
+		}
+		void Set(Atom name, FieldCache& cache, Value value) {
+			if (cache.Shape != m_Type) [[unlikely]]
+				Resolve(name, cache, true);
+			Fields()[cache.Slot] = std::move(value);
+		}
+
+	private:
+		friend struct HeapObject;
+
+		explicit UserObject(TypeObject const& type);
+		~UserObject();
+		void Resolve(Atom name, FieldCache& cache, bool store) const;
+
+		TypeObject const* m_Type;
+	};
+	static_assert(sizeof(UserObject) % alignof(Value) == 0);
 }
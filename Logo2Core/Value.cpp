@@ -1,11 +1,213 @@
 #include "pch.h"
 #include "Value.h"
+#include "ArrayValue.h"
+#include "DictionaryValue.h"
+#include "TypeObject.h"
+#include "Heap.h"
 #include <Errors.h>
+#include <cstring>
 
 #define OPS(op1, op2) (op1 | (op2 << 4))
 
 namespace Logo2 {
-	Value::Value(std::shared_ptr<Function> f) : m_Value(f) {
+#ifdef LOGO2_NANBOX_VALUE
+	static_assert(sizeof(Value) == 8);
+
+	Value::Value(double d) {
+		if (d != d)
+			m_Bits = 0x7FF8000000000000ull;		// canonical NaN
+		else
+			memcpy(&m_Bits, &d, sizeof(d));
+	}
+
+	Value::Value(long long n) {
+		constexpr long long limit = 1ll << (TagShift - 1);
+		if (n >= -limit && n < limit)
+			m_Bits = BoxBits | (uint64_t(TagInteger) << TagShift) | (uint64_t(n) & PayloadMask);
+		else
+			Box(TagBigInteger, n);
+	}
+
+	Value::Value(bool b) : m_Bits(BoxBits | (uint64_t(TagBoolean) << TagShift) | (b ? 1 : 0)) {
+	}
+
+	Value::Value(StringValue s) {
+		Box(TagString, std::move(s));
+	}
+
+	Value::Value(Ref<Function> f) {
+		Box(TagFunction, f.Object());
+	}
+
+	Value::Value(Ref<ArrayValue> array) {
+		Box(TagObject, array.Object());
+	}
+
+	Value::Value(Ref<DictionaryValue> dictionary) {
+		Box(TagObject, dictionary.Object());
+	}
+
+	Value::Value(Ref<UserObject> object) {
+		Box(TagObject, object.Object());
+	}
+
+	template<typename T>
+	void Value::Box(Tag tag, T object) {
+		auto cell = new Cell<T>(std::move(object));
+		cell->Type = tag == TagString ? TypeString : TypeInteger;
+		auto address = reinterpret_cast<uint64_t>(static_cast<CellBase*>(cell));
+		assert((address & ~PayloadMask) == 0);
+		m_Bits = BoxBits | (uint64_t(tag) << TagShift) | address;
+	}
+
+	void Value::Box(Tag tag, HeapObject* object) {
+		//
+		// objects are their own cells
+		//
+		object->Refs++;
+		auto address = reinterpret_cast<uint64_t>(static_cast<CellBase*>(object));
+		assert((address & ~PayloadMask) == 0);
+		m_Bits = BoxBits | (uint64_t(tag) << TagShift) | address;
+	}
+
+	void Value::Destroy() {
+		switch (GetTag()) {
+			case TagBigInteger: delete GetCell<long long>(); break;
+			case TagString: delete GetCell<StringValue>(); break;
+			case TagFunction:
+			case TagObject:
+				HeapObject::Free(static_cast<HeapObject*>(GetCellBase()));
+				break;
+			default: break;
+		}
+	}
+
+	Value::operator bool() const {
+		return m_Bits != NullBits;
+	}
+
+	bool Value::IsInteger() const {
+		return IsBoxed() && (GetTag() == TagInteger || GetTag() == TagBigInteger);
+	}
+
+	bool Value::IsBoolean() const {
+		return IsBoxed() && GetTag() == TagBoolean;
+	}
+
+	bool Value::IsReal() const {
+		return !IsBoxed();
+	}
+
+	bool Value::IsFunction() const {
+		return IsBoxed() && GetTag() == TagFunction;
+	}
+
+	bool Value::IsArray() const {
+		return IsBoxed() && GetTag() == TagObject && GetCellBase()->Type == TypeArray;
+	}
+
+	bool Value::IsDictionary() const {
+		return IsBoxed() && GetTag() == TagObject && GetCellBase()->Type == TypeDictionary;
+	}
+
+	bool Value::IsObject() const {
+		return IsBoxed() && GetTag() == TagObject && GetCellBase()->Type == TypeUserObject;
+	}
+
+	long long Value::Integer() const {
+		if (IsBoxed()) {
+			if (GetTag() == TagInteger)
+				return (long long)(m_Bits << (64 - TagShift)) >> (64 - TagShift);		// sign extend the payload
+			if (GetTag() == TagBigInteger)
+				return GetCell<long long>()->Object;
+		}
+		throw RuntimeError(ErrorType::TypeMismatch);
+	}
+
+	double Value::Real() const {
+		if (IsBoxed())
+			throw RuntimeError(ErrorType::TypeMismatch);
+		double d;
+		memcpy(&d, &m_Bits, sizeof(d));
+		return d;
+	}
+
+	bool Value::Boolean() const {
+		if (!IsBoolean())
+			throw RuntimeError(ErrorType::TypeMismatch);
+		return (m_Bits & 1) != 0;
+	}
+
+	StringValue const& Value::String() const {
+		if (Index() != TypeString)
+			throw RuntimeError(ErrorType::TypeMismatch);
+		return GetCell<StringValue>()->Object;
+	}
+
+	Function const* const Value::Func() const {
+		if (!IsFunction())
+			throw RuntimeError(ErrorType::TypeMismatch);
+		return static_cast<Function*>(GetCellBase());
+	}
+
+	ArrayValue* Value::Array() const {
+		if (!IsArray())
+			throw RuntimeError(ErrorType::TypeMismatch);
+		return static_cast<ArrayValue*>(static_cast<HeapObject*>(GetCellBase()));
+	}
+
+	DictionaryValue* Value::Dictionary() const {
+		if (!IsDictionary())
+			throw RuntimeError(ErrorType::TypeMismatch);
+		return static_cast<DictionaryValue*>(static_cast<HeapObject*>(GetCellBase()));
+	}
+
+	UserObject* Value::Object() const {
+		if (!IsObject())
+			throw RuntimeError(ErrorType::TypeMismatch);
+		return static_cast<UserObject*>(static_cast<HeapObject*>(GetCellBase()));
+	}
+
+	HeapObject* Value::Referent() const {
+		return IsBoxed() && GetTag() >= TagFunction ? static_cast<HeapObject*>(GetCellBase()) : nullptr;
+	}
+
+	Value::TypeIndex Value::Index() const {
+		static constexpr TypeIndex types[] = {
+			TypeNull, TypeNull, TypeInteger, TypeBoolean, TypeInteger, TypeString, TypeFunction, TypeUserObject
+		};
+		if (!IsBoxed())
+			return TypeReal;
+		auto tag = GetTag();
+		return tag == TagObject ? TypeIndex(GetCellBase()->Type) : types[tag];
+	}
+
+	const char* Value::Layout() {
+		return "nan-boxed";
+	}
+#else
+	Value::Value(double d) : m_Value(d) {
+	}
+
+	Value::Value(long long n) : m_Value(n) {
+	}
+
+	Value::Value(bool b) : m_Value(b) {
+	}
+
+	Value::Value(StringValue s) : m_Value(std::move(s)) {
+	}
+
+	Value::Value(Ref<Function> f) : m_Value(std::move(f)) {
+	}
+
+	Value::Value(Ref<ArrayValue> array) : m_Value(std::move(array)) {
+	}
+
+	Value::Value(Ref<DictionaryValue> dictionary) : m_Value(std::move(dictionary)) {
+	}
+
+	Value::Value(Ref<UserObject> object) : m_Value(std::move(object)) {
 	}
 
 	Value::operator bool() const {
@@ -13,19 +215,88 @@ namespace Logo2 {
 	}
 
 	bool Value::IsInteger() const {
-		return m_Value.index() == 0;
+		return m_Value.index() == TypeInteger;
 	}
 
 	bool Value::IsBoolean() const {
-		return m_Value.index() == 2;
+		return m_Value.index() == TypeBoolean;
 	}
 
 	bool Value::IsReal() const {
-		return m_Value.index() == 1;
+		return m_Value.index() == TypeReal;
 	}
 
 	bool Value::IsFunction() const {
-		return m_Value.index() == 5;
+		return m_Value.index() == TypeFunction;
+	}
+
+	bool Value::IsArray() const {
+		return m_Value.index() == TypeArray;
+	}
+
+	bool Value::IsDictionary() const {
+		return m_Value.index() == TypeDictionary;
+	}
+
+	bool Value::IsObject() const {
+		return m_Value.index() == TypeUserObject;
+	}
+
+	long long Value::Integer() const {
+		return std::get<TypeInteger>(m_Value);
+	}
+
+	double Value::Real() const {
+		return std::get<TypeReal>(m_Value);
+	}
+
+	bool Value::Boolean() const {
+		return std::get<TypeBoolean>(m_Value);
+	}
+
+	StringValue const& Value::String() const {
+		return std::get<TypeString>(m_Value);
+	}
+
+	Function const* const Value::Func() const {
+		return std::get<TypeFunction>(m_Value).get();
+	}
+
+	ArrayValue* Value::Array() const {
+		return std::get<TypeArray>(m_Value).get();
+	}
+
+	DictionaryValue* Value::Dictionary() const {
+		return std::get<TypeDictionary>(m_Value).get();
+	}
+
+	UserObject* Value::Object() const {
+		return std::get<TypeUserObject>(m_Value).get();
+	}
+
+	HeapObject* Value::Referent() const {
+		switch (Index()) {
+			case TypeFunction: return std::get<TypeFunction>(m_Value).Object();
+			case TypeUserObject: return std::get<TypeUserObject>(m_Value).Object();
+			case TypeArray: return std::get<TypeArray>(m_Value).Object();
+			case TypeDictionary: return std::get<TypeDictionary>(m_Value).Object();
+			default: break;
+		}
+		return nullptr;
+	}
+
+	Value::TypeIndex Value::Index() const {
+		return (TypeIndex)m_Value.index();
+	}
+
+	const char* Value::Layout() {
+		return "variant";
+	}
+#endif
+	Value::Value(std::string const& s) : Value(StringValue(s)) {
+	}
+
+	Function::Function() : HeapObject(Value::TypeFunction), Upvalues(Heap::CurrentResource()) {
 	}
 
 	float Value::ToFloat() const {
@@ -37,6 +308,7 @@ namespace Logo2 {
 			case TypeInteger: return Integer() != 0;
 			case TypeBoolean: return Boolean();
 			case TypeReal: return Real() != 0.0;
+			default: break;
 		}
 		throw RuntimeError(ErrorType::TypeMismatch);
 	}
@@ -46,7 +318,8 @@ namespace Logo2 {
 			case TypeInteger: return (double)Integer();
 			case TypeReal: return Real();
 			case TypeBoolean: return Boolean() ? 1.0 : 0.0;
-			case TypeString: return std::stof(String());
+			case TypeString: return std::stof(String().Str());
+			default: break;
 		}
 		throw RuntimeError(ErrorType::TypeMismatch);
 	}
@@ -56,32 +329,37 @@ namespace Logo2 {
 			case TypeInteger: return Integer();
 			case TypeReal: return (long long)Real();
 			case TypeBoolean: return Boolean() ? 1 : 0;
-			case TypeString: return strtoll(String().c_str(), nullptr, 0);
+			case TypeString: return strtoll(String().CStr(), nullptr, 0);
+			default: break;
 		}
 		throw RuntimeError(ErrorType::TypeMismatch);
 	}
 
 	Value Value::operator-() const {
-		switch (m_Value.index()) {
+		switch (Index()) {
 			case TypeInteger:	return -Integer();
 			case TypeReal:	return -Real();
+			case TypeArray: return ArrayValue::Apply(ArrayValue::Operation::Mul, *this, -1LL);
+			default: break;
 		}
 		throw RuntimeError(ErrorType::TypeMismatch);
 	}
 
 	Value Value::operator!() const {
-		switch (m_Value.index()) {
+		switch (Index()) {
 			case TypeInteger:	return Integer() ? 0 : 1LL;
 			case TypeReal:	return Real() ? 0.0 : 1.0;
 			case TypeBoolean: return !Boolean();
+			default: break;
 		}
 		throw RuntimeError(ErrorType::TypeMismatch);
 	}
 
 	Value Value::operator~() const {
-		switch (m_Value.index()) {
+		switch (Index()) {
 			case TypeInteger:	return ~Integer();
 			case TypeBoolean: return !Boolean();
+			default: break;
 		}
 		throw RuntimeError(ErrorType::TypeMismatch);
 	}
@@ -102,45 +380,55 @@ namespace Logo2 {
 			case TypeReal | (TypeInteger << 4): return Real() == other.Integer();
 			case TypeInteger | (TypeReal << 4): return Integer() == other.Real();
 			case TypeReal | (TypeReal << 4): return Real() == other.Real();
+			case TypeString | (TypeString << 4): return String() == other.String();
 			case TypeNull | (TypeNull << 4) : return true;
 		}
 		return false;
 	}
 
-	long long Value::Integer() const {
-		return std::get<TypeInteger>(m_Value);
-	}
-
-	double Value::Real() const {
-		return std::get<TypeReal>(m_Value);
-	}
-
-	bool Value::Boolean() const {
-		return std::get<TypeBoolean>(m_Value);
-	}
-
-	std::string const& Value::String() const {
-		return std::get<TypeString>(m_Value);
-	}
-
-	Function const* const Value::Func() const {
-		return std::get<TypeFunction>(m_Value).get();
-	}
-
-	Value::TypeIndex Value::Index() const {
-		return (TypeIndex)m_Value.index();
-	}
-
 	std::string Value::ToString() const {
-		switch (m_Value.index()) {
+		switch (Index()) {
 			case TypeInteger: return std::to_string(Integer());
 			case TypeReal: return std::to_string(Real());
 			case TypeBoolean: return Boolean() ? "true" : "false";
-			case TypeString: return String();
+			case TypeString: return String().Str();
+			case TypeArray: return Array()->ToString();
+			case TypeDictionary: return Dictionary()->ToString();
+			case TypeUserObject: return Object()->Type().Name();
+			default: break;
 		}
 		return std::string();
 	}
 
+	Value Value::Element(Value const& index) const {
+		switch (Index()) {
+			case TypeArray:
+				if (!index.IsInteger())
+					throw RuntimeError(ErrorType::TypeMismatch);
+				return Array()->Get(index.Integer());
+
+			case TypeDictionary: return Dictionary()->Get(index);
+			default: break;
+		}
+		throw RuntimeError(ErrorType::TypeMismatch);
+	}
+
+	void Value::SetElement(Value const& index, Value value) const {
+		switch (Index()) {
+			case TypeArray:
+				if (!index.IsInteger())
+					throw RuntimeError(ErrorType::TypeMismatch);
+				Array()->Set(index.Integer(), std::move(value));
+				return;
+
+			case TypeDictionary:
+				Dictionary()->Set(index, std::move(value));
+				return;
+			default: break;
+		}
+		throw RuntimeError(ErrorType::TypeMismatch);
+	}
+
 	Value Value::operator+(Value const& right) const {
 		switch (Index() | (right.Index() << 4)) {
 			case TypeInteger | (TypeInteger << 4): return Integer() + right.Integer();
@@ -149,10 +437,14 @@ namespace Logo2 {
 			case TypeReal | (TypeReal << 4): return Real() + right.Real();
 			case TypeString | (TypeString << 4) : return String() + right.String();
 		}
+		if (Index() == TypeArray || right.Index() == TypeArray)
+			return ArrayValue::Apply(ArrayValue::Operation::Add, *this, right);
 		throw RuntimeError(ErrorType::TypeMismatch);
 	}
 
 	Value Value::operator-(Value const& right) const {
+		if (Index() == TypeArray || right.Index() == TypeArray)
+			return ArrayValue::Apply(ArrayValue::Operation::Sub, *this, right);
 		return (*this) + -right;
 	}
 
@@ -163,6 +455,8 @@ namespace Logo2 {
 			case TypeInteger | (TypeReal << 4): return Integer() * right.Real();
 			case TypeReal | (TypeReal << 4): return Real() * right.Real();
 		}
+		if (Index() == TypeArray || right.Index() == TypeArray)
+			return ArrayValue::Apply(ArrayValue::Operation::Mul, *this, right);
 		throw RuntimeError(ErrorType::TypeMismatch);
 	}
 
@@ -191,6 +485,9 @@ namespace Logo2 {
 	}
 
 	Value Value::operator/(Value const& right) const {
+		if (Index() == TypeArray || right.Index() == TypeArray)
+			return ArrayValue::Apply(ArrayValue::Operation::Div, *this, right);
+
 		switch (right.Index()) {
 			case TypeInteger: 				
 				if (right.Integer() == 0)
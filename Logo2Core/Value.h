@@ -1,40 +1,231 @@
 #pragma once
 
 #include <functional>
+#include <memory_resource>
 #include <vector>
+#include "Atom.h"
+#include "StringValue.h"
 
 namespace Logo2 {
 	class Expression;
 	class Interpreter;
 	struct Value;
+	struct Function;
 	struct Scope;
+	struct Upvalue;
+	struct CodeChunk;
+	struct RegisterChunk;
+	class ArrayValue;
+	class DictionaryValue;
 
 	class TypeObject;
+	struct UserObject;
 
-	struct UserObject {
-		explicit UserObject(TypeObject& type);
+	using NativeFunction = std::function<Value(Interpreter&, std::vector<Value>&)>;
+
+	//
+	// allocation free native calling convention: a plain function receiving an opaque context
+	// (e.g. the object of a bound member function) and a view of the arguments on the caller's stack
+	//
+	using NativeCall = Value(*)(Interpreter&, void* context, std::span<const Value> args);
+
+	class Heap;
+
+	//
+	// the reference count heading every heap allocation a value can point to, and the Value::TypeIndex of what follows
+	// counts are not atomic as values are not shared across threads
+	//
+	struct RefCounted {
+		uint32_t Refs{ 0 };
+		uint8_t Type{ 0 };
 	};
 
-	using NativeFunction = std::function<Value(Interpreter&, std::vector<Value>&)>;
+	//
+	// an object held by reference by values, that can refer to other values in turn (functions, arrays, dictionaries
+	// and user objects); references between them can form cycles, which the Heap the object was created in finds and frees
+	// a copy of an object (e.g. a named function kept by value) is a new object, not tracked by any heap
+	//
+	struct HeapObject : RefCounted {
+		HeapObject(HeapObject const& other);
+		HeapObject& operator=(HeapObject const&);
 
-	struct Function {
-		int ArgCount;
-		Expression const* Code{ nullptr };
-		NativeFunction NativeCode;
-		std::vector<std::string> Parameters;
-		std::unique_ptr<Scope> Environment;
+		//
+		// memory for a new object, from the pools of the current heap (if any)
+		//
+		static void* Allocate(size_t size);
+		static void Deallocate(void* memory, size_t size);
+		//
+		// adds a new object to the current heap (if any), possibly collecting garbage first
+		//
+		static void Track(HeapObject* object);
+		//
+		// destroys an object whose count dropped to zero
+		//
+		static void Free(HeapObject* object);
+
+	protected:
+		explicit HeapObject(uint8_t type);
+		~HeapObject() = default;
+
+	private:
+		friend class Heap;
+
+		uint8_t Generation{ 0 };
+		bool Marked{ false };
+		bool Pooled{ false };		// allocated from the pools of its heap
+		uint32_t GcRefs{ 0 };		// references from outside the collected objects, during a collection
+		Heap* Owner{ nullptr };
+		HeapObject* Prev{ nullptr };
+		HeapObject* Next{ nullptr };
 	};
 
+	//
+	// counted reference to a heap object; T only needs to be complete where the object is accessed
+	//
+	template<typename T>
+	class Ref {
+	public:
+		Ref() = default;
+		Ref(std::nullptr_t) {}
+		explicit Ref(T* object) : m_Object(object) {
+			Retain();
+		}
+		Ref(Ref const& other) : m_Object(other.m_Object) {
+			Retain();
+		}
+		Ref(Ref&& other) noexcept : m_Object(std::exchange(other.m_Object, nullptr)) {}
+		Ref& operator=(Ref other) noexcept {
+			std::swap(m_Object, other.m_Object);
+			return *this;
+		}
+		~Ref() {
+			if (m_Object && --m_Object->Refs == 0)
+				HeapObject::Free(m_Object);
+		}
+
+		T* get() const {
+			return static_cast<T*>(m_Object);
+		}
+		T* operator->() const {
+			return get();
+		}
+		T& operator*() const {
+			return *get();
+		}
+		explicit operator bool() const {
+			return m_Object != nullptr;
+		}
+		HeapObject* Object() const {
+			return m_Object;
+		}
+
+	private:
+		void Retain() const {
+			if (m_Object)
+				m_Object->Refs++;
+		}
+
+		HeapObject* m_Object{ nullptr };
+	};
+
+	//
+	// new object on the current heap
+	//
+	template<typename T, typename... Args>
+	Ref<T> MakeRef(Args&&... args) {
+		auto memory = HeapObject::Allocate(sizeof(T));
+		T* object;
+		try {
+			object = new (memory) T(std::forward<Args>(args)...);
+		}
+		catch (...) {
+			HeapObject::Deallocate(memory, sizeof(T));
+			throw;
+		}
+		HeapObject::Track(object);
+		return Ref<T>(object);
+	}
+
+	//
+	// inline cache of a call site: the named function the callee resolved to (or null),
+	// valid for the interpreter that filled it in as long as that interpreter's function table epoch is current
+	//
+	struct CallCache {
+		Function const* Target{ nullptr };
+		Interpreter const* Owner{ nullptr };
+		uint64_t Epoch{ 0 };
+	};
+
+	//
+	// inline cache of a field access site: the type (shape) of the objects last seen there and the slot
+	// of the field in it, so accessing an object of that type is a compare and a load
+	//
+	struct FieldCache {
+		TypeObject const* Shape{ nullptr };
+		int Slot{ -1 };
+	};
+
+	//
+	// a field access site of compiled code
+	//
+	struct FieldSite {
+		Atom Name;
+		FieldCache Cache{};
+	};
+
+	//
+	// values are NaN-boxed on 64-bit targets: 8 bytes holding a double, or a tag and a 48 bit payload
+	// (an integer, a boolean or a pointer to a refcounted heap cell) in the space of the quiet NaNs
+	// define LOGO2_VARIANT_VALUE to use the std::variant layout instead
+	//
+#if !defined(LOGO2_VARIANT_VALUE) && (defined(_M_X64) || defined(__x86_64__) || defined(_M_ARM64) || defined(__aarch64__))
+#define LOGO2_NANBOX_VALUE
+#endif
+
 	struct Value {
-		Value(double d) : m_Value(d) {}
-		Value(long long n) : m_Value(n) {}
-		Value(bool b) : m_Value(b) {}
+		Value(double d);
+		Value(long long n);
+		Value(bool b);
 		Value() = default;
-		Value(std::string s) : m_Value(std::move(s)) {}
-		Value(std::shared_ptr<Function> f);
+		Value(std::string const& s);
+		Value(StringValue s);
+		Value(Ref<Function> f);
+		Value(Ref<ArrayValue> array);
+		Value(Ref<DictionaryValue> dictionary);
+		Value(Ref<UserObject> object);
+
+#ifdef LOGO2_NANBOX_VALUE
+		Value(Value const& other) : m_Bits(other.m_Bits) {
+			CountCopy();
+			Retain();
+		}
+		Value(Value&& other) noexcept : m_Bits(other.m_Bits) {
+			other.m_Bits = NullBits;
+		}
+		Value& operator=(Value const& other) {
+			if (this != &other) {
+				CountCopy();
+				other.Retain();
+				Release();
+				m_Bits = other.m_Bits;
+			}
+			return *this;
+		}
+		Value& operator=(Value&& other) noexcept {
+			if (this != &other) {
+				Release();
+				m_Bits = other.m_Bits;
+				other.m_Bits = NullBits;
+			}
+			return *this;
+		}
+		~Value() {
+			Release();
+		}
+#endif
 
 		enum TypeIndex {
-			TypeNull, TypeInteger, TypeReal, TypeBoolean, TypeString, TypeFunction, TypeUserObject
+			TypeNull, TypeInteger, TypeReal, TypeBoolean, TypeString, TypeFunction, TypeUserObject, TypeArray, TypeDictionary
 		};
 
 		operator bool() const;
@@ -42,6 +233,9 @@ namespace Logo2 {
 		bool IsBoolean() const;
 		bool IsReal() const;
 		bool IsFunction() const;
+		bool IsArray() const;
+		bool IsDictionary() const;
+		bool IsObject() const;
 
 		float ToFloat() const;
 		bool ToBoolean() const;
@@ -67,13 +261,198 @@ namespace Logo2 {
 		long long Integer() const;
 		double Real() const;
 		bool Boolean() const;
-		std::string const& String() const;
+		StringValue const& String() const;
 		Function const* const Func() const;
+		ArrayValue* Array() const;
+		DictionaryValue* Dictionary() const;
+		UserObject* Object() const;
+		HeapObject* Referent() const;		// the function, array, dictionary or object held, or null
+
+		//
+		// container[index] and container[index] = value, for arrays and dictionaries
+		//
+		Value Element(Value const& index) const;
+		void SetElement(Value const& index, Value value) const;
 
 		TypeIndex Index() const;
 		std::string ToString() const;
 
+		static const char* Layout();
+
+#ifdef LOGO2_NANBOX_VALUE
+		//
+		// the representation, for the inline paths of the JIT: the bits of integers and booleans have the top 16 bits
+		// of IntegerBits and BooleanBits, values holding a counted reference are those from CellBits up
+		//
+		uint64_t Bits() const {
+			return m_Bits;
+		}
+		static constexpr uint64_t IntegerBits() {
+			return BoxBits | (uint64_t(TagInteger) << TagShift);
+		}
+		static constexpr uint64_t BooleanBits() {
+			return BoxBits | (uint64_t(TagBoolean) << TagShift);
+		}
+		static constexpr uint64_t CellBits() {
+			return BoxBits | (uint64_t(TagBigInteger) << TagShift);
+		}
+#endif
+
+#ifdef LOGO2_COUNT_COPIES
+		//
+		// values copied (constructed or assigned) on this thread, to check that evaluation paths do not copy more
+		// than they have to; only counted with the NaN-boxed layout
+		//
+		static inline thread_local uint64_t Copies{ 0 };
+#endif
+
 	private:
-		std::variant<std::monostate, long long, double, bool, std::string, std::shared_ptr<Function>, std::shared_ptr<UserObject>> m_Value;
+		static void CountCopy() {
+#ifdef LOGO2_COUNT_COPIES
+			Copies++;
+#endif
+		}
+
+#ifdef LOGO2_NANBOX_VALUE
+		//
+		// boxed values have the sign, exponent and quiet bits set (a negative quiet NaN);
+		// NaN doubles are canonicalized to a positive quiet NaN so they never look boxed
+		//
+		enum Tag : uint64_t {
+			TagNull = 1,
+			TagInteger,			// 48 bit signed integer inline
+			TagBoolean,
+			TagBigInteger,		// integers that do not fit in 48 bits, in a cell
+			TagString,
+			TagFunction,
+			TagObject,			// objects of any other type, told apart by the type in their cell
+		};
+		static constexpr uint64_t BoxBits = 0xFFF8000000000000ull;
+		static constexpr int TagShift = 48;
+		static constexpr uint64_t PayloadMask = (1ull << TagShift) - 1;
+		static constexpr uint64_t NullBits = BoxBits | (uint64_t(TagNull) << TagShift);
+
+		//
+		// heap storage of a boxed value: the cell of a big integer or a string,
+		// the object itself for functions and TagObject values
+		//
+		using CellBase = RefCounted;
+		template<typename T>
+		struct Cell : CellBase {
+			explicit Cell(T object) : Object(std::move(object)) {
+				Refs = 1;
+			}
+			T Object;
+		};
+
+		bool IsBoxed() const {
+			return (m_Bits & BoxBits) == BoxBits;
+		}
+		Tag GetTag() const {
+			return Tag((m_Bits >> TagShift) & 7);
+		}
+		bool IsCell() const {
+			return IsBoxed() && GetTag() >= TagBigInteger;
+		}
+		CellBase* GetCellBase() const {
+			return reinterpret_cast<CellBase*>(m_Bits & PayloadMask);
+		}
+		template<typename T>
+		Cell<T>* GetCell() const {
+			return static_cast<Cell<T>*>(GetCellBase());
+		}
+		template<typename T>
+		void Box(Tag tag, T object);
+		void Box(Tag tag, HeapObject* object);
+
+		void Retain() const {
+			if (IsCell())
+				GetCellBase()->Refs++;
+		}
+		void Release() {
+			if (IsCell() && --GetCellBase()->Refs == 0)
+				Destroy();
+		}
+		void Destroy();
+
+		uint64_t m_Bits{ NullBits };
+#else
+		std::variant<std::monostate, long long, double, bool, StringValue, Ref<Function>, Ref<UserObject>, Ref<ArrayValue>, Ref<DictionaryValue>> m_Value;
+#endif
 	};
+
+	//
+	// the variables captured by a closure
+	//
+	using UpvalueList = std::pmr::vector<std::shared_ptr<Upvalue>>;
+
+	struct Function : HeapObject {
+		Function();
+
+		int ArgCount;
+		Expression const* Code{ nullptr };
+		NativeFunction NativeCode;
+		NativeCall Native{ nullptr };
+		void* Context{ nullptr };
+		std::span<Atom const> Parameters;		// owned by the declaration (Code) or the prototype (Chunk, RegisterCode)
+		int FrameSize{ 0 };
+		UpvalueList Upvalues;		// variables captured when the closure was created
+		std::shared_ptr<CodeChunk> Chunk;
+		std::shared_ptr<RegisterChunk> RegisterCode;
+
+		bool IsNative() const {
+			return Native || NativeCode;
+		}
+	};
+
+	//
+	// operand types observed at an operator site: once the same types have been seen Threshold times
+	// in a row a Handler specialized for them is installed, guarded by a check of the operand types
+	// a site whose guard keeps failing (or whose types have no specialization) stays generic
+	//
+	template<typename Handler>
+	struct TypeFeedback {
+		static constexpr uint8_t Threshold = 8;
+		static constexpr uint8_t MaxDeopts = 4;
+
+		Handler Specialized{ nullptr };
+		Value::TypeIndex Left{ Value::TypeNull }, Right{ Value::TypeNull };
+		uint8_t Hits{ 0 };
+		uint8_t Deopts{ 0 };
+
+		bool Matches(Value::TypeIndex left, Value::TypeIndex right = Value::TypeNull) const {
+			return left == Left && right == Right;
+		}
+
+		//
+		// returns true when the site has just become stable and should be specialized
+		//
+		bool Record(Value::TypeIndex left, Value::TypeIndex right = Value::TypeNull) {
+			if (Deopts >= MaxDeopts)
+				return false;
+			if (!Matches(left, right)) {
+				Left = left;
+				Right = right;
+				Hits = 0;
+			}
+			return ++Hits == Threshold;
+		}
+
+		void Specialize(Handler handler) {
+			Specialized = handler;
+			if (!handler)
+				Deopts = MaxDeopts;
+		}
+
+		void Deoptimize() {
+			Specialized = nullptr;
+			Hits = 0;
+			Deopts++;
+		}
+	};
+
+	using BinaryHandler = Value(*)(Value const& left, Value const& right);
+	using UnaryHandler = Value(*)(Value const& arg);
+	using BinaryFeedback = TypeFeedback<BinaryHandler>;
+	using UnaryFeedback = TypeFeedback<UnaryHandler>;
 }
@@ -0,0 +1,456 @@
+#include "pch.h"
+#include "VirtualMachine.h"
+#include "Interpreter.h"
+#include <Errors.h>
+#include "Dispatch.h"
+#include "ArrayValue.h"
+#include "DictionaryValue.h"
+
+using namespace Logo2;
+using namespace std;
+
+#define BINARY_OP(op) {	\
+	auto& left = m_Stack[m_Stack.size() - 2];	\
+	left = left op m_Stack.back();	\
+	m_Stack.pop_back();	\
+	NEXT();	\
+}
+
+VirtualMachine::VirtualMachine(Interpreter& inter) : m_Interpreter(inter) {
+	m_Stack.reserve(256);
+}
+
+Value VirtualMachine::Run(CodeChunk const& chunk) {
+	auto scopes = m_Interpreter.ScopeDepth();
+	auto frames = m_Frames.size();
+	auto stack = m_Stack.size();
+	auto top = m_Interpreter.Stack().Top();
+	auto unwind = [&]() {
+		while (m_Interpreter.ScopeDepth() > scopes)
+			m_Interpreter.PopScope();
+		if (m_Frames.size() > frames)
+			m_Locals = m_Frames[frames].Locals;
+		m_Interpreter.Stack().Release(top);
+		m_Frames.resize(frames);
+		m_Stack.resize(stack);
+	};
+
+	Value result;
+	try {
+		result = Execute(&chunk);
+	}
+	catch (...) {
+		unwind();
+		throw;
+	}
+	unwind();
+	return result;
+}
+
+uint64_t VirtualMachine::InstructionCount() const {
+	return m_Instructions;
+}
+
+void VirtualMachine::ResetStats() {
+	m_Instructions = 0;
+}
+
+const char* VirtualMachine::DispatchKind() {
+#ifdef LOGO2_THREADED_DISPATCH
+	return "threaded";
+#else
+	return "switch";
+#endif
+}
+
+Value VirtualMachine::Execute(CodeChunk const* chunk) {
+#ifdef LOGO2_THREADED_DISPATCH
+	static void* const labels[] = {
+		LABEL(Nop), LABEL(LoadConst), LABEL(LoadNull), LABEL(LoadTrue), LABEL(LoadFalse), LABEL(Pop),
+		LABEL(LoadName), LABEL(StoreName), LABEL(DefineVar), LABEL(LoadLocal), LABEL(StoreLocal), LABEL(DefineLocal),
+		LABEL(LoadUpvalue), LABEL(StoreUpvalue),
+		LABEL(Add), LABEL(Sub), LABEL(Mul), LABEL(Div), LABEL(Mod), LABEL(Power), LABEL(And), LABEL(Or), LABEL(Xor),
+		LABEL(Equal), LABEL(NotEqual), LABEL(Less), LABEL(LessEqual), LABEL(Greater), LABEL(GreaterEqual),
+		LABEL(Neg), LABEL(Not),
+		LABEL(Jump), LABEL(JumpIfFalse), LABEL(RepeatInit), LABEL(RepeatNext),
+		LABEL(PushScope), LABEL(PopScope),
+		LABEL(Call), LABEL(CallValue), LABEL(TailCall), LABEL(Return), LABEL(DefineFunction), LABEL(MakeClosure),
+		LABEL(MakeArray), LABEL(MakeDictionary), LABEL(LoadIndex), LABEL(StoreIndex), LABEL(LoadField), LABEL(StoreField),
+		LABEL(AddLocalConst), LABEL(SubLocalConst), LABEL(CallWithLocal), LABEL(CallWithConst),
+	};
+	static_assert(std::size(labels) == size_t(OpCode::Count));
+#else
+	using OpType = OpCode;
+#endif
+
+	auto baseFrame = m_Frames.size();
+	auto code = chunk->Code.data();
+	size_t ip = 0;
+	Instruction const* inst;
+
+	//
+	// the callee and argument count of the call being set up, shared by the call handlers
+	//
+	Function const* callee;
+	Ref<Function> closure;		// holds callee if it is a function value
+	int argCount;
+	bool popCallee;
+
+	for (;;) {
+		inst = code + ip++;
+		m_Instructions++;
+
+		DISPATCH(inst->Code) {
+			CASE(Nop) NEXT();
+			CASE(LoadConst) m_Stack.push_back(chunk->Constants[inst->Operand]); NEXT();
+			CASE(LoadNull) m_Stack.emplace_back(); NEXT();
+			CASE(LoadTrue) m_Stack.emplace_back(true); NEXT();
+			CASE(LoadFalse) m_Stack.emplace_back(false); NEXT();
+			CASE(Pop) m_Stack.pop_back(); NEXT();
+
+			CASE(LoadName)
+			{
+				auto v = m_Interpreter.FindVariable(chunk->Names[inst->Operand]);
+				if (!v)
+					throw RuntimeError(ErrorType::UndefinedSymbol, nullptr, AtomTable::Name(chunk->Names[inst->Operand]));
+				m_Stack.push_back(v->VarValue);
+				NEXT();
+			}
+
+			CASE(StoreName)
+			{
+				auto v = m_Interpreter.FindVariable(chunk->Names[inst->Operand]);
+				if (!v)
+					throw RuntimeError(ErrorType::UndefinedSymbol, nullptr, AtomTable::Name(chunk->Names[inst->Operand]));
+				if ((v->Flags & VariableFlags::Const) == VariableFlags::Const)
+					throw RuntimeError(ErrorType::CannotAssignConst, nullptr, AtomTable::Name(chunk->Names[inst->Operand]));
+				v->VarValue = m_Stack.back();
+				NEXT();
+			}
+
+			CASE(DefineVar)
+			{
+				Variable var;
+				var.Flags = inst->Count ? VariableFlags::Const : VariableFlags::None;
+				var.VarValue = Pop();
+				m_Interpreter.AddVariable(chunk->Names[inst->Operand], move(var));
+				NEXT();
+			}
+
+			CASE(LoadLocal) m_Stack.push_back(m_Locals.Slots[inst->Operand]); NEXT();
+			CASE(StoreLocal) m_Locals.Slots[inst->Operand] = m_Stack.back(); NEXT();
+			CASE(LoadUpvalue) m_Stack.push_back(*(*m_Locals.Upvalues)[inst->Operand]->Location); NEXT();
+			CASE(StoreUpvalue) *(*m_Locals.Upvalues)[inst->Operand]->Location = m_Stack.back(); NEXT();
+
+			CASE(DefineLocal)
+				m_Interpreter.Stack().Redeclare(&m_Locals.Slots[inst->Operand]);
+				m_Locals.Slots[inst->Operand] = Pop();
+				NEXT();
+
+			CASE(Add) BINARY_OP(+);
+			CASE(Sub) BINARY_OP(-);
+			CASE(Mul) BINARY_OP(*);
+			CASE(Div) BINARY_OP(/);
+			CASE(Mod) BINARY_OP(%);
+			CASE(And) BINARY_OP(&);
+			CASE(Or) BINARY_OP(|);
+			CASE(Xor) BINARY_OP(^);
+			CASE(Equal) BINARY_OP(==);
+			CASE(NotEqual) BINARY_OP(!=);
+			CASE(Less) BINARY_OP(<);
+			CASE(LessEqual) BINARY_OP(<=);
+			CASE(Greater) BINARY_OP(>);
+			CASE(GreaterEqual) BINARY_OP(>=);
+
+			CASE(Power)
+			{
+				auto& left = m_Stack[m_Stack.size() - 2];
+				left = left.Power(m_Stack.back());
+				m_Stack.pop_back();
+				NEXT();
+			}
+
+			CASE(Neg) m_Stack.back() = -m_Stack.back(); NEXT();
+			CASE(Not) m_Stack.back() = !m_Stack.back(); NEXT();
+
+			CASE(Jump) ip = inst->Operand; NEXT();
+			CASE(JumpIfFalse)
+				if (!Pop().ToBoolean())
+					ip = inst->Operand;
+				NEXT();
+
+			CASE(RepeatInit)
+				if (!m_Stack.back().IsInteger())
+					throw RuntimeError(ErrorType::TypeMismatch);
+				NEXT();
+
+			CASE(RepeatNext)
+			{
+				auto& count = m_Stack.back();
+				auto n = count.Integer();
+				if (n <= 0)
+					ip = inst->Operand;
+				else
+					count = n - 1;
+				NEXT();
+			}
+
+			CASE(PushScope) m_Interpreter.PushScope(); NEXT();
+			CASE(PopScope) m_Interpreter.PopScope(); NEXT();
+
+			CASE(Call)
+				callee = FindCallee(chunk, inst->Operand, closure);
+				argCount = inst->Count;
+				popCallee = false;
+				goto invoke;
+
+			CASE(CallValue)
+			{
+				//
+				// CallValue keeps the function value alive below the arguments until the call is set up
+				//
+				auto& value = m_Stack[m_Stack.size() - inst->Count - 1];
+				if (!value.IsFunction())
+					throw RuntimeError(ErrorType::NotCallable);
+				callee = value.Func();
+				closure = Ref<Function>(const_cast<Function*>(callee));
+				argCount = inst->Count;
+				popCallee = true;
+				goto invoke;
+			}
+
+			CASE(CallWithLocal)
+			CASE(CallWithConst)
+			{
+				//
+				// the common case of a one argument native (fd 10, rt angle) skips the operand stack
+				//
+				callee = FindCallee(chunk, inst->Operand, closure);
+				auto& arg = inst->Code == OpCode::CallWithLocal ? m_Locals.Slots[inst->Count] : chunk->Constants[inst->Count];
+				if (callee->IsNative() && callee->ArgCount == 1) {
+					m_Stack.push_back(m_Interpreter.CallNative(*callee, { &arg, 1 }));
+					closure = nullptr;
+					NEXT();
+				}
+				m_Stack.push_back(arg);
+				argCount = 1;
+				popCallee = false;
+				goto invoke;
+			}
+
+			CASE(TailCall)
+			{
+				//
+				// the callee takes over the frame of the function returning its value, so tail recursion
+				// runs in constant space; natives and calls outside a function body are ordinary calls,
+				// followed by the Return
+				//
+				if (inst->Operand < 0) {
+					auto& value = m_Stack[m_Stack.size() - inst->Count - 1];
+					if (!value.IsFunction())
+						throw RuntimeError(ErrorType::NotCallable);
+					callee = value.Func();
+					closure = Ref<Function>(const_cast<Function*>(callee));
+					popCallee = true;
+				}
+				else {
+					callee = FindCallee(chunk, inst->Operand, closure);
+					popCallee = false;
+				}
+				argCount = inst->Count;
+				if (m_Frames.size() == baseFrame || !callee->Chunk)
+					goto invoke;
+				if (callee->ArgCount != argCount)
+					throw RuntimeError(ErrorType::ArgumentCountMismatch);
+
+				auto& frame = m_Frames.back();
+				auto& stack = m_Interpreter.Stack();
+				auto first = m_Stack.size() - argCount;
+				auto args = stack.Allocate(argCount);
+				for (int i = 0; i < argCount; i++)
+					args[i] = move(m_Stack[first + i]);
+				stack.Reuse(m_Locals.Slots, argCount, callee->FrameSize);
+				m_Stack.resize(frame.StackBase);
+				while (m_Interpreter.ScopeDepth() > frame.ScopeDepth)
+					m_Interpreter.PopScope();
+				m_Locals.Upvalues = &callee->Upvalues;
+				frame.Callee = move(closure);
+				chunk = callee->Chunk.get();
+				code = chunk->Code.data();
+				ip = 0;
+				NEXT();
+			}
+
+			invoke:
+			{
+				if (callee->ArgCount != argCount)
+					throw RuntimeError(ErrorType::ArgumentCountMismatch);
+
+				if (callee->IsNative()) {
+					auto first = m_Stack.size() - argCount;
+					auto result = m_Interpreter.CallNative(*callee, { m_Stack.data() + first, (size_t)argCount });
+					m_Stack.resize(first);
+					if (popCallee)
+						m_Stack.pop_back();
+					m_Stack.push_back(move(result));
+					closure = nullptr;
+					NEXT();
+				}
+				if (!callee->Chunk)
+					throw RuntimeError(ErrorType::NotCallable);
+
+				m_Frames.push_back(CallFrame{ .Chunk = chunk, .Ip = ip, .ScopeDepth = m_Interpreter.ScopeDepth(), .Locals = m_Locals, .Callee = move(closure) });
+				Call(*callee, argCount);
+				chunk = callee->Chunk.get();
+				if (popCallee)
+					m_Stack.pop_back();		// the chunk itself is owned by the enclosing chunk
+				m_Frames.back().StackBase = m_Stack.size();
+				code = chunk->Code.data();
+				ip = 0;
+				NEXT();
+			}
+
+			CASE(AddLocalConst) m_Stack.push_back(m_Locals.Slots[inst->Count] + chunk->Constants[inst->Operand]); NEXT();
+			CASE(SubLocalConst) m_Stack.push_back(m_Locals.Slots[inst->Count] - chunk->Constants[inst->Operand]); NEXT();
+
+			CASE(Return)
+			{
+				if (m_Frames.size() == baseFrame)
+					return Pop();
+
+				//
+				// a return from inside a loop leaves its counters behind the result
+				//
+				auto& frame = m_Frames.back();
+				auto result = Pop();
+				m_Stack.resize(frame.StackBase);
+				m_Stack.push_back(move(result));
+				while (m_Interpreter.ScopeDepth() > frame.ScopeDepth)
+					m_Interpreter.PopScope();
+				m_Interpreter.Stack().Release(m_Locals.Slots);
+				m_Locals = frame.Locals;
+				chunk = frame.Chunk;
+				code = chunk->Code.data();
+				ip = frame.Ip;
+				m_Frames.pop_back();
+				NEXT();
+			}
+
+			CASE(DefineFunction)
+			{
+				auto& proto = chunk->Functions[inst->Operand];
+				m_Interpreter.AddFunction(proto->Name, move(*MakeFunction(proto)));
+				NEXT();
+			}
+
+			CASE(MakeClosure)
+			{
+				m_Stack.emplace_back(MakeFunction(chunk->Functions[inst->Operand]));
+				NEXT();
+			}
+
+			CASE(MakeArray)
+			{
+				auto first = m_Stack.end() - inst->Count;
+				auto array = MakeRef<ArrayValue>(vector<Value>(make_move_iterator(first), make_move_iterator(m_Stack.end())));
+				m_Stack.erase(first, m_Stack.end());
+				m_Stack.emplace_back(move(array));
+				NEXT();
+			}
+
+			CASE(MakeDictionary)
+			{
+				auto first = m_Stack.size() - 2 * inst->Count;
+				auto dictionary = MakeRef<DictionaryValue>(inst->Count);
+				for (auto i = first; i < m_Stack.size(); i += 2)
+					dictionary->Set(m_Stack[i], move(m_Stack[i + 1]));
+				m_Stack.resize(first);
+				m_Stack.emplace_back(move(dictionary));
+				NEXT();
+			}
+
+			CASE(LoadIndex)
+			{
+				auto& container = m_Stack[m_Stack.size() - 2];
+				container = container.Element(m_Stack.back());
+				m_Stack.pop_back();
+				NEXT();
+			}
+
+			CASE(StoreIndex)
+			{
+				auto value = Pop();
+				auto index = Pop();
+				m_Stack.back().SetElement(index, value);
+				m_Stack.back() = move(value);
+				NEXT();
+			}
+
+			CASE(LoadField)
+			{
+				auto& site = chunk->FieldSites[inst->Operand];
+				auto& object = m_Stack.back();
+				Value field = object.Object()->Get(site.Name, site.Cache);		// copied before the object may be released
+				object = move(field);
+				NEXT();
+			}
+
+			CASE(StoreField)
+			{
+				auto& site = chunk->FieldSites[inst->Operand];
+				auto value = Pop();
+				m_Stack.back().Object()->Set(site.Name, site.Cache, value);
+				m_Stack.back() = move(value);
+				NEXT();
+			}
+
+			DEFAULT_CASE
+				assert(false);
+				throw RuntimeError(ErrorType::UndefinedOperator);
+		}
+	}
+}
+
+void VirtualMachine::Call(Function const& f, int argCount) {
+	//
+	// same binding rules as Interpreter::InvokeFunction
+	//
+	auto base = m_Stack.size() - argCount;
+	m_Locals = Frame{ m_Interpreter.Stack().Allocate(f.FrameSize), &f.Upvalues };
+	for (int i = 0; i < argCount; i++)
+		m_Locals.Slots[i] = move(m_Stack[base + i]);
+	m_Stack.resize(base);
+}
+
+Ref<Function> VirtualMachine::MakeFunction(shared_ptr<CodeChunk> const& proto) {
+	auto f = MakeRef<Function>();
+	f->ArgCount = (int)proto->Parameters.size();
+	f->Code = proto->Body;
+	f->Parameters = proto->Parameters;
+	f->Chunk = proto;
+	f->FrameSize = proto->FrameSize;
+	f->Upvalues = m_Interpreter.Stack().CaptureAll(m_Locals.Slots ? &m_Locals : nullptr, proto->Captures, m_Interpreter.CurrentScope());
+	return f;
+}
+
+Function const* VirtualMachine::FindCallee(CodeChunk const* chunk, int index, Ref<Function>& closure) const {
+	auto& name = chunk->Names[index];
+	if (auto f = m_Interpreter.FindFunction(name, chunk->Callees[index]); f)
+		return f;
+
+	auto var = m_Interpreter.FindVariable(name);
+	if (var) {
+		if (var->VarValue.IsFunction()) {
+			closure = Ref<Function>(const_cast<Function*>(var->VarValue.Func()));
+			return closure.get();
+		}
+		throw RuntimeError(ErrorType::NotCallable, nullptr, AtomTable::Name(name));
+	}
+	throw RuntimeError(ErrorType::UndefinedFunction, nullptr, AtomTable::Name(name));
+}
+
+Value VirtualMachine::Pop() {
+	auto v = move(m_Stack.back());
+	m_Stack.pop_back();
+	return v;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Bytecode.h"
+#include "Interpreter.h"
+
+namespace Logo2 {
+	class Interpreter;
+
+	//
+	// stack based VM executing CodeChunks produced by the Compiler
+	// globals, scopes and functions are shared with the Interpreter
+	//
+	class VirtualMachine {
+	public:
+		explicit VirtualMachine(Interpreter& inter);
+
+		Value Run(CodeChunk const& chunk);
+
+		uint64_t InstructionCount() const;
+		void ResetStats();
+
+		static const char* DispatchKind();		// shared by both VMs
+
+	private:
+		struct CallFrame {
+			CodeChunk const* Chunk;
+			size_t Ip;
+			size_t ScopeDepth;
+			size_t StackBase{ 0 };		// operand stack height of the callee, the arguments taken off
+			Frame Locals;
+			Ref<Function> Callee;		// a closure being run, kept alive while its frame reads its upvalues; null for named functions
+		};
+
+		Value Execute(CodeChunk const* chunk);
+		void Call(Function const& f, int argCount);
+		Ref<Function> MakeFunction(std::shared_ptr<CodeChunk> const& proto);
+		Function const* FindCallee(CodeChunk const* chunk, int index, Ref<Function>& closure) const;
+		Value Pop();
+
+		Interpreter& m_Interpreter;
+		Frame m_Locals;		// slots live on the Interpreter's ValueStack
+		std::vector<Value> m_Stack;
+		std::vector<CallFrame> m_Frames;
+		uint64_t m_Instructions{ 0 };
+	};
+}
@@ -22,6 +22,12 @@ namespace Logo2 {
 	class Statements;
 	class AnonymousFunctionExpression;
 	class EnumDeclaration;
+	class ArrayExpression;
+	class DictionaryExpression;
+	class IndexExpression;
+	class AssignIndexExpression;
+	class MemberExpression;
+	class AssignMemberExpression;
 
 	class Visitor abstract {
 	public:
@@ -44,6 +50,12 @@ namespace Logo2 {
 		virtual Value VisitStatements(Statements const* stmts) = 0;
 		virtual Value VisitAnonymousFunction(AnonymousFunctionExpression const* func) = 0;
 		virtual Value VisitEnumDeclaration(EnumDeclaration const* decl) = 0;
+		virtual Value VisitArray(ArrayExpression const* expr) = 0;
+		virtual Value VisitDictionary(DictionaryExpression const* expr) = 0;
+		virtual Value VisitIndex(IndexExpression const* expr) = 0;
+		virtual Value VisitAssignIndex(AssignIndexExpression const* expr) = 0;
+		virtual Value VisitMember(MemberExpression const* expr) = 0;
+		virtual Value VisitAssignMember(AssignMemberExpression const* expr) = 0;
 	};
 }
 
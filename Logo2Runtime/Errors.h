@@ -13,6 +13,9 @@ namespace Logo2 {
 		UndefinedOperator,
 		UndefinedSymbol,
 		NotCallable,
+		StackOverflow,
+		IndexOutOfRange,
+		OutOfMemory,
 	};
 
 	struct RuntimeError {
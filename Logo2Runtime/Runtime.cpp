@@ -9,49 +9,47 @@
 
 using namespace Logo2;
 
-Runtime::Runtime(Interpreter& inter) {
-    inter.AddNativeFunction("fd", 1, [this](auto& intr, auto& args) {
-        GetTurtle().Forward(args[0].ToFloat());
-        return Value();
-        });
-    inter.AddNativeFunction("bk", 1, [this](auto& intr, auto& args) {
-        GetTurtle().Back(args[0].ToFloat());
-        return Value();
-        });
-    inter.AddNativeFunction("penwidth", 1, [this](auto& intr, auto& args) {
-        GetTurtle().SetPenWidth(args[0].ToFloat());
-        return Value();
-        });
-    inter.AddNativeFunction("rt", 1, [this](auto& intr, auto& args) {
-        auto& t = GetTurtle();
-        t.Rotate(args[0].ToFloat());
-        return Value();
-        });
-    inter.AddNativeFunction("penup", 0, [this](auto& intr, auto& args) {
-        GetTurtle().Penup();
-        return Value();
-        });
-    inter.AddNativeFunction("pendown", 0, [this](auto& intr, auto& args) {
-        GetTurtle().Pendown();
-        return Value();
-        });
-    inter.AddNativeFunction("pencolor", 3, [this](auto& intr, auto& args) {
-        GetTurtle().SetPenColor((BYTE)args[0].ToInteger(), (BYTE)args[1].ToInteger(), (BYTE)args[2].ToInteger());
-        return Value();
-        });
-    inter.AddNativeFunction("print", 1, [this](auto& intr, auto& args) {
-        std::print("{}", args[0].ToString());
-        return Value();
-        });
-    inter.AddNativeFunction("println", 1, [this](auto& intr, auto& args) {
-        std::println("{}", args[0].ToString());
-        return Value();
-        });
-    inter.AddNativeFunction("exit", 1, [this](auto& intr, auto& args) {
-        throw QuitAppException{ (int)args[0].ToInteger() };
-        return Value();
-        });
+namespace {
+    void Print(std::string const& text) {
+        std::print("{}", text);
+    }
+
+    void PrintLine(std::string const& text) {
+        std::println("{}", text);
+    }
+
+    void Exit(int code) {
+        throw QuitAppException{ code };
+    }
+
+    Value MemoryUsed(Interpreter& inter, void*, std::span<const Value>) {
+        return Value((long long)inter.GetHeap().Memory().Used);
+    }
+
+    Value MemoryPeak(Interpreter& inter, void*, std::span<const Value>) {
+        return Value((long long)inter.GetHeap().Memory().Peak);
+    }
+
+    Value MemoryLimit(Interpreter& inter, void*, std::span<const Value>) {
+        return Value((long long)inter.GetHeap().Memory().Limit);
+    }
+}
 
+Runtime::Runtime(Interpreter& inter) : m_Turtle(inter.GetHeap().Resource()) {
+    inter.AddNative<&Turtle::Forward>("fd", &m_Turtle);
+    inter.AddNative<&Turtle::Back>("bk", &m_Turtle);
+    inter.AddNative<&Turtle::SetPenWidth>("penwidth", &m_Turtle);
+    inter.AddNative<&Turtle::Rotate>("rt", &m_Turtle);
+    inter.AddNative<&Turtle::Penup>("penup", &m_Turtle);
+    inter.AddNative<&Turtle::Pendown>("pendown", &m_Turtle);
+    using SetOpaqueColor = void (Turtle::*)(BYTE, BYTE, BYTE);
+    inter.AddNative<static_cast<SetOpaqueColor>(&Turtle::SetPenColor)>("pencolor", &m_Turtle);
+    inter.AddNative<&Print>("print");
+    inter.AddNative<&PrintLine>("println");
+    inter.AddNative<&Exit>("exit");
+    inter.AddNativeFunction("memused", 0, MemoryUsed, nullptr);
+    inter.AddNativeFunction("mempeak", 0, MemoryPeak, nullptr);
+    inter.AddNativeFunction("memlimit", 0, MemoryLimit, nullptr);
 }
 
 Turtle& Runtime::GetTurtle() {
@@ -6,7 +6,7 @@
 using namespace Gdiplus;
 using namespace Logo2;
 
-Turtle::Turtle() {
+Turtle::Turtle(std::pmr::memory_resource* resource) : m_Commands(resource) {
 }
 
 void Logo2::Turtle::SetNotify(ICommandNotify* pNotify) {
@@ -75,6 +75,10 @@ float Turtle::GetStep() const {
 	return m_Step;
 }
 
+void Logo2::Turtle::SetPenColor(BYTE r, BYTE g, BYTE b) {
+	SetPenColor(r, g, b, 255);
+}
+
 void Logo2::Turtle::SetPenColor(BYTE r, BYTE g, BYTE b, BYTE a) {
 	TurtleCommand cmd;
 	cmd.Type = TurtleCommandType::SetColor;
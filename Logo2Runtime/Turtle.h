@@ -1,6 +1,7 @@
 #pragma once
 
 #include <span>
+#include <memory_resource>
 
 namespace Logo2 {
 	struct TurtleState {
@@ -37,7 +38,10 @@ namespace Logo2 {
 
 	class Turtle {
 	public:
-		Turtle();
+		//
+		// the commands are allocated from resource (the pools of the interpreter, so they count against its memory limit)
+		//
+		explicit Turtle(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 
 		void SetNotify(ICommandNotify* pNotify);
 
@@ -49,7 +53,8 @@ namespace Logo2 {
 		bool IsPenup() const;
 		void SetStep(float size);
 		float GetStep() const;
-		void SetPenColor(BYTE r, BYTE g, BYTE b, BYTE a = 255);
+		void SetPenColor(BYTE r, BYTE g, BYTE b);
+		void SetPenColor(BYTE r, BYTE g, BYTE b, BYTE a);
 		void SetPenWidth(float width);
 		void SetRadians(bool radians);
 		bool IsRadians() const;
@@ -62,7 +67,7 @@ namespace Logo2 {
 	private:
 		float ToRad(float angle) const;
 
-		std::vector<TurtleCommand> m_Commands;
+		std::pmr::vector<TurtleCommand> m_Commands;
 		ICommandNotify* m_pNotify{ nullptr };
 		TurtleState m_State;
 		bool m_Penup{ false };